@@ -0,0 +1,286 @@
+/***************************************************************/
+/* Host microbenchmarks for the simulator's hot paths          */
+/*                                                             */
+/* Build next to mu-mips.c, e.g.                               */
+/*   gcc -O2 -pthread -o microbench bench/microbench.c -lm     */
+/* and run ./microbench [-r reps] [-f name] [--json]           */
+/*                                                             */
+/* Each benchmark is timed -r times (default 15); a sample is  */
+/* many calls, so the reported ns/op is per call. Median, min  */
+/* and standard deviation are over the samples.                */
+/***************************************************************/
+#define main mu_mips_main
+#include "../mu-mips.c"
+#undef main
+
+#include <math.h>
+#include <unistd.h>
+
+#define MB_MAX_REPS 101
+#define MB_LOAD_WORDS 16384
+
+volatile uint32_t mb_sink;
+uint32_t mb_ops; //calls per sample, set by each benchmark's setup
+
+typedef struct
+{
+	const char *name;
+	void (*setup)();
+	void (*body)();
+} Micro_Bench;
+
+/***************************************************************/
+/* Benchmark bodies                                            */
+/***************************************************************/
+void mb_setup_mem()
+{
+	mb_ops = 1 << 16;
+}
+
+void mb_mem_read()
+{
+	uint32_t i, sum = 0;
+	for (i = 0; i < mb_ops; i++)
+	{
+		sum += mem_read_32(MEM_STACK_BEGIN + ((i << 2) & 0xFFFF));
+	}
+	mb_sink = sum;
+}
+
+void mb_mem_write()
+{
+	uint32_t i;
+	for (i = 0; i < mb_ops; i++)
+	{
+		mem_write_32(MEM_STACK_BEGIN + ((i << 2) & 0xFFFF), i);
+	}
+}
+
+void mb_setup_cache()
+{
+	mb_ops = 1 << 16;
+	memset(&L1Cache, 0, sizeof(L1Cache));
+	MEM_WB.IR = 0xAC000000; //SW, selects the word path in cache_write_32
+}
+
+/* Every access stays within one 256-byte window: all hits after the first pass */
+void mb_cache_read_hit()
+{
+	uint32_t i, sum = 0;
+	for (i = 0; i < mb_ops; i++)
+	{
+		sum += cache_read_32(MEM_STACK_BEGIN + ((i << 2) & 0xFF));
+	}
+	mb_sink = sum;
+}
+
+/* Consecutive accesses are 256 bytes apart: same index, new tag, always a miss */
+void mb_cache_read_miss()
+{
+	uint32_t i, sum = 0;
+	for (i = 0; i < mb_ops; i++)
+	{
+		sum += cache_read_32(MEM_STACK_BEGIN + ((i << 8) & 0xFFFF));
+	}
+	mb_sink = sum;
+}
+
+void mb_cache_write_hit()
+{
+	uint32_t i;
+	for (i = 0; i < mb_ops; i++)
+	{
+		cache_write_32(MEM_STACK_BEGIN + ((i << 2) & 0xFF), i);
+	}
+}
+
+void mb_cache_write_miss()
+{
+	uint32_t i;
+	for (i = 0; i < mb_ops; i++)
+	{
+		cache_write_32(MEM_STACK_BEGIN + ((i << 8) & 0xFFFF), i);
+	}
+}
+
+/* An endless loop of ALU ops, a load and a store, with the pipeline already full */
+void mb_setup_cycle()
+{
+	static const uint32_t loop[] = {
+		0x25080001, //addiu $8, $8, 1
+		0x25290001, //addiu $9, $9, 1
+		0x8FAA0000, //lw $10, 0($29)
+		0x256B0001, //addiu $11, $11, 1
+		0xAFAB0004, //sw $11, 4($29)
+		0x258C0001, //addiu $12, $12, 1
+		0x08100000, //j 0x00400000
+	};
+	uint32_t i;
+
+	for (i = 0; i < sizeof(loop) / sizeof(loop[0]); i++)
+	{
+		mem_write_32(MEM_TEXT_BEGIN + 4 * i, loop[i]);
+	}
+	memset(&L1Cache, 0, sizeof(L1Cache));
+	ENABLE_FORWARDING = 0;
+	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	pipeline_flush();
+	CURRENT_STATE.REGS[29] = MEM_STACK_BEGIN;
+	RUN_FLAG = TRUE;
+	for (i = 0; i < 64; i++)
+	{
+		cycle();
+	}
+	mb_ops = 1 << 14;
+}
+
+void mb_cycle()
+{
+	uint32_t i;
+	for (i = 0; i < mb_ops; i++)
+	{
+		cycle();
+	}
+}
+
+/* load_program() of a MB_LOAD_WORDS-word image; one op is one whole load */
+void mb_setup_load()
+{
+	FILE *fp;
+	uint32_t i;
+
+	strcpy(prog_file, "/tmp/mu-mb.in");
+	fp = fopen(prog_file, "w");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error: Can't create %s\n", prog_file);
+		exit(-1);
+	}
+	for (i = 0; i < MB_LOAD_WORDS; i++)
+	{
+		fprintf(fp, "%08x\n", 0x25080001 + (i & 0xFF));
+	}
+	fclose(fp);
+	mb_ops = 4;
+}
+
+void mb_load_program()
+{
+	uint32_t i;
+	for (i = 0; i < mb_ops; i++)
+	{
+		load_program();
+	}
+}
+
+Micro_Bench benches[] = {
+	{ "mem_read_32", mb_setup_mem, mb_mem_read },
+	{ "mem_write_32", mb_setup_mem, mb_mem_write },
+	{ "cache_read_32_hit", mb_setup_cache, mb_cache_read_hit },
+	{ "cache_read_32_miss", mb_setup_cache, mb_cache_read_miss },
+	{ "cache_write_32_hit", mb_setup_cache, mb_cache_write_hit },
+	{ "cache_write_32_miss", mb_setup_cache, mb_cache_write_miss },
+	{ "cycle", mb_setup_cycle, mb_cycle },
+	{ "load_program", mb_setup_load, mb_load_program },
+};
+
+int mb_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	int reps = 15, json = 0, i, r, first = 1;
+	const char *filter = NULL;
+	double ns[MB_MAX_REPS];
+	FILE *out;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+		{
+			reps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+		{
+			filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--json") == 0)
+		{
+			json = 1;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-r reps] [-f name] [--json]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (reps < 1 || reps > MB_MAX_REPS)
+	{
+		fprintf(stderr, "Error: reps must be 1..%d\n", MB_MAX_REPS);
+		exit(1);
+	}
+
+	/* the simulator narrates on stdout; keep results on a private copy */
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+	{
+		fprintf(stderr, "Error: can't redirect stdout\n");
+		exit(1);
+	}
+
+	initialize();
+	if (json)
+	{
+		fprintf(out, "[");
+	}
+	else
+	{
+		fprintf(out, "%-22s %14s %14s %14s %8s\n", "benchmark", "median", "min", "stddev", "ops");
+	}
+	for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++)
+	{
+		double mean = 0, var = 0;
+
+		if (filter != NULL && strstr(benches[i].name, filter) == NULL)
+		{
+			continue;
+		}
+		benches[i].setup();
+		benches[i].body(); //warm up
+		for (r = 0; r < reps; r++)
+		{
+			double t0 = host_seconds();
+			benches[i].body();
+			ns[r] = (host_seconds() - t0) * 1e9 / mb_ops;
+			mean += ns[r];
+		}
+		mean /= reps;
+		for (r = 0; r < reps; r++)
+		{
+			var += (ns[r] - mean) * (ns[r] - mean);
+		}
+		qsort(ns, reps, sizeof(ns[0]), mb_compare);
+
+		if (json)
+		{
+			fprintf(out, "%s\n {\"name\":\"%s\",\"median_ns\":%.3f,\"min_ns\":%.3f,\"stddev_ns\":%.3f,\"ops\":%u,\"reps\":%d}",
+					first ? "" : ",", benches[i].name, ns[reps / 2], ns[0], sqrt(var / reps), mb_ops, reps);
+		}
+		else
+		{
+			fprintf(out, "%-22s %12.2fns %12.2fns %12.2fns %8u\n", benches[i].name, ns[reps / 2], ns[0], sqrt(var / reps), mb_ops);
+		}
+		first = 0;
+	}
+	if (json)
+	{
+		fprintf(out, "\n]\n");
+	}
+	fclose(out);
+	remove("/tmp/mu-mb.in");
+	return 0;
+}
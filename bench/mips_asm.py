@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""Two-pass assembler for the MIPS subset MU-MIPS executes.
+
+usage: mips_asm.py prog.s [prog.in]
+
+Writes one hex word per line, the format load_program() reads, starting
+at 0x00400000. Branch offsets are relative to the branch itself and there
+is no delay slot, matching the simulator's EX stage.
+
+Pseudo-ops: li, la, move, b, beqz, bnez and ".equ NAME, value". Constants
+that do not fit in 16 bits are built with lui/ori and addresses (la) with
+lui/addiu, as a MIPS compiler emits them. %hi(x), %ahi(x) and %lo(x) take
+the halves of a constant; %ahi adds the carry that a sign-extended %lo
+needs, so "lui $t0, %ahi(x); lw $t0, %lo(x)($t0)" loads the word at x.
+"""
+import re, sys
+
+REGNAMES = ['zero','at','v0','v1','a0','a1','a2','a3','t0','t1','t2','t3','t4','t5','t6','t7',
+            's0','s1','s2','s3','s4','s5','s6','s7','t8','t9','k0','k1','gp','sp','fp','ra']
+TEXT = 0x00400000
+
+R3 = {'add':0x20,'addu':0x21,'sub':0x22,'subu':0x23,'and':0x24,'or':0x25,'xor':0x26,'nor':0x27,'slt':0x2A}
+SH = {'sll':0x00,'srl':0x02,'sra':0x03}
+MD = {'mult':0x18,'multu':0x19,'div':0x1A,'divu':0x1B}
+IMM = {'addi':0x08,'addiu':0x09,'slti':0x0A,'andi':0x0C,'ori':0x0D,'xori':0x0E}
+MEMOP = {'lb':0x20,'lh':0x21,'lw':0x23,'sb':0x28,'sh':0x29,'sw':0x2B}
+BR2 = {'beq':0x04,'bne':0x05}
+BR1 = {'blez':0x06,'bgtz':0x07}
+
+def reg(s):
+    s = s.strip().lstrip('$')
+    if s.isdigit(): return int(s)
+    if s.startswith('r') and s[1:].isdigit(): return int(s[1:])
+    return REGNAMES.index(s)
+
+def num(s, labels):
+    s = s.strip()
+    if s in labels: return labels[s]
+    return int(s, 0)
+
+def expand(op, args):
+    if op == 'li':
+        return [('lui', [args[0], '%hi(' + args[1] + ')']),
+                ('ori', [args[0], args[0], '%lo(' + args[1] + ')'])]
+    if op == 'la':
+        return [('lui', [args[0], '%ahi(' + args[1] + ')']),
+                ('addiu', [args[0], args[0], '%lo(' + args[1] + ')'])]
+    if op == 'move': return [('addu', [args[0], args[1], '$0'])]
+    if op == 'b': return [('beq', ['$0', '$0', args[0]])]
+    if op == 'beqz': return [('beq', [args[0], '$0', args[1]])]
+    if op == 'bnez': return [('bne', [args[0], '$0', args[1]])]
+    return [(op, args)]
+
+def short(op, args, labels):
+    # li of a constant known on the first pass that fits in one instruction
+    if op != 'li': return None
+    try: v = num(args[1], labels) & 0xFFFFFFFF
+    except ValueError: return None
+    if v < 0x8000: return [('addiu', [args[0], '$0', str(v)])]
+    if v < 0x10000: return [('ori', [args[0], '$0', str(v)])]
+    if v & 0xFFFF == 0: return [('lui', [args[0], str(v >> 16)])]
+    return None
+
+def parse(text):
+    items, labels = [], {}
+    pc = TEXT
+    for line in text.splitlines():
+        line = line.split('#')[0].strip()
+        while True:
+            m = re.match(r'^([A-Za-z_][\w.]*):\s*(.*)$', line)
+            if not m: break
+            labels[m.group(1)] = pc
+            line = m.group(2)
+        if not line: continue
+        if line.startswith('.equ'):
+            name, val = [x.strip() for x in line[4:].split(',')]
+            labels[name] = int(val, 0)
+            continue
+        parts = line.split(None, 1)
+        op = parts[0].lower()
+        args = [a.strip() for a in parts[1].split(',')] if len(parts) > 1 else []
+        for e in short(op, args, labels) or expand(op, args):
+            items.append((pc, e[0], e[1]))
+            pc += 4
+    return items, labels
+
+def imm16(v): return v & 0xFFFF
+
+def encode(pc, op, a, labels):
+    def val(s):
+        s = s.strip()
+        m = re.match(r'%(hi|ahi|lo)\((.*)\)', s)
+        if m:
+            v = num(m.group(2), labels)
+            if m.group(1) == 'ahi': v += 0x8000
+            return (v >> 16) & 0xFFFF if m.group(1) != 'lo' else v & 0xFFFF
+        return num(s, labels)
+    if op in R3: return (reg(a[1])<<21)|(reg(a[2])<<16)|(reg(a[0])<<11)|R3[op]
+    if op in SH: return (reg(a[1])<<16)|(reg(a[0])<<11)|((val(a[2])&31)<<6)|SH[op]
+    if op in MD: return (reg(a[0])<<21)|(reg(a[1])<<16)|MD[op]
+    if op == 'jr': return (reg(a[0])<<21)|0x08
+    if op == 'jalr': return (reg(a[0])<<21)|(31<<11)|0x09
+    if op == 'syscall': return 0x0C
+    if op in ('mfhi','mflo'): return (reg(a[0])<<11)|(0x10 if op=='mfhi' else 0x12)
+    if op in ('mthi','mtlo'): return (reg(a[0])<<21)|(0x11 if op=='mthi' else 0x13)
+    if op in IMM: return (IMM[op]<<26)|(reg(a[1])<<21)|(reg(a[0])<<16)|imm16(val(a[2]))
+    if op == 'lui': return (0x0F<<26)|(reg(a[0])<<16)|imm16(val(a[1]))
+    if op in MEMOP:
+        m = re.match(r'(.*)\((.*)\)', a[1])
+        off = val(m.group(1)) if m.group(1).strip() else 0
+        return (MEMOP[op]<<26)|(reg(m.group(2))<<21)|(reg(a[0])<<16)|imm16(off)
+    # this simulator resolves branch targets relative to the branch itself, no delay slot
+    if op in BR2: return (BR2[op]<<26)|(reg(a[0])<<21)|(reg(a[1])<<16)|imm16((val(a[2])-pc)>>2)
+    if op in BR1: return (BR1[op]<<26)|(reg(a[0])<<21)|imm16((val(a[1])-pc)>>2)
+    if op in ('bltz','bgez'): return (0x01<<26)|(reg(a[0])<<21)|((op=='bgez')<<16)|imm16((val(a[1])-pc)>>2)
+    if op in ('j','jal'): return ((0x02 if op=='j' else 0x03)<<26)|((val(a[0])>>2)&0x03FFFFFF)
+    raise SystemExit('unknown op %s at 0x%x' % (op, pc))
+
+def main():
+    if len(sys.argv) < 2: raise SystemExit(__doc__)
+    src = open(sys.argv[1]).read()
+    items, labels = parse(src)
+    out = open(sys.argv[2], 'w') if len(sys.argv) > 2 else sys.stdout
+    for pc, op, a in items:
+        out.write('%08x\n' % (encode(pc, op, a, labels) & 0xFFFFFFFF))
+
+if __name__ == '__main__':
+    main()
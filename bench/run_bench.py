@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""Run the MU-MIPS workload suite and compare against a stored baseline.
+
+usage: run_bench.py [--sim ./mu-mips] [--update] [--only NAME] ...
+
+Each bench/workloads/*.in program is run through the pipeline model
+(`forward`, `run`, `stats`) and once through the functional model
+(`fastforward`) as a reference for the result in $v1. Model metrics
+(cycles, instructions, cache hits/misses, $v1) must match the baseline
+exactly; host throughput (simulated instructions per host second, best of
+--repeat runs) may drop by at most --tolerance. Any difference exits 1.
+
+--check adds one more run with the lockstep checker on (`check on`), which
+compares every retired instruction against the functional model and fails
+the workload at the first divergence.
+
+--fuse runs every workload with macro-op fusion off and on (`fuse on`),
+each with forwarding off and on, and fails it unless $v1 and the number of
+retired instructions are the same in all four runs.
+
+--mt runs every workload on 1 to 4 hardware threads (`threads <n> rr|miss`)
+under both policies, each with forwarding off and on, and fails it unless
+every thread halts with the reference $v1.
+
+After an intentional timing or model change, rerun with --update and
+commit the new baseline.json. Host numbers are only comparable on the
+machine and build flags the baseline was recorded with.
+"""
+import argparse, glob, json, os, re, subprocess, sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MODEL_KEYS = ('cycles', 'instructions', 'cache_hits', 'cache_misses', 'v1')
+
+
+def simulate(sim, prog, commands):
+    out = subprocess.run([sim, prog], input=commands, capture_output=True,
+                         text=True, check=False).stdout
+    stats = re.search(r'^.*?STATS (\{.*\})$', out, re.M)
+    v1 = re.search(r'\[R3\]\s*:\s*(0x[0-9a-fA-F]+)', out)
+    return (json.loads(stats.group(1)) if stats else None,
+            int(v1.group(1), 16) if v1 else None)
+
+
+def measure(args, prog):
+    best = None
+    for _ in range(args.repeat):
+        st, v1 = simulate(args.sim, prog, 'forward %d\nrun %d\nrdump\nstats\nquit\n'
+                          % (args.forward, args.max_cycles))
+        if st is None:
+            raise SystemExit('%s: simulator printed no STATS line' % prog)
+        st['v1'] = v1
+        if best is None or st['host_seconds'] < best['host_seconds']:
+            best = st
+    _, best['ref_v1'] = simulate(args.sim, prog, 'fastforward %d\nrdump\nquit\n' % args.max_cycles)
+    return best
+
+
+def check(args, prog):
+    out = subprocess.run([args.sim, prog], capture_output=True, text=True, check=False,
+                         input='forward %d\ncheck on\nrun %d\nquit\n'
+                         % (args.forward, args.max_cycles)).stdout
+    m = re.search(r'Lockstep check FAILED after (\d+) instructions.*\n\s*(0x[0-9a-fA-F]+)', out)
+    return 'check failed at %s (inst %s)' % (m.group(2), m.group(1)) if m else None
+
+
+def fuse_check(args, prog):
+    seen = {}
+    for fwd in (0, 1):
+        for fuse in ('off', 'on'):
+            st, v1 = simulate(args.sim, prog, 'forward %d\nfuse %s\nrun %d\nrdump\nstats\nquit\n'
+                              % (fwd, fuse, args.max_cycles))
+            seen['forward %d fuse %s' % (fwd, fuse)] = (v1, st['instructions'] if st else None)
+    first = seen['forward 0 fuse off']
+    bad = ['%s: v1 %s, instructions %s' % (k, v[0], v[1]) for k, v in seen.items() if v != first]
+    return 'fuse differs (forward 0 fuse off: v1 %s, instructions %s; %s)' % (first + ('; '.join(bad),)) if bad else None
+
+
+def mt_check(args, prog, ref_v1):
+    bad = []
+    for fwd in (0, 1):
+        for policy in ('rr', 'miss'):
+            for n in range(1, 5):
+                out = subprocess.run([args.sim, prog], capture_output=True, text=True, check=False,
+                                     input='forward %d\nthreads %d %s\nrun %d\nthreads show\nquit\n'
+                                     % (fwd, n, policy, args.max_cycles)).stdout
+                rows = re.findall(r'^(\d+)\t\t0x[0-9a-f]+\t\d+\t\t[0-9.]+\t\d+\t\t(0x[0-9a-f]+)\t(\w+)$',
+                                  out.split('[Thread]')[-1], re.M)
+                wrong = ['%s %s' % (t, 'v1 ' + v1 if state == 'done' else state)
+                         for t, v1, state in rows if state != 'done' or int(v1, 16) != ref_v1]
+                if len(rows) != n or wrong:
+                    bad.append('forward %d threads %d %s: %s' % (fwd, n, policy, ', '.join(wrong) or 'no report'))
+    return 'threads differ (%s)' % '; '.join(bad) if bad else None
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('--sim', default='./mu-mips', help='simulator binary')
+    ap.add_argument('--baseline', default=os.path.join(HERE, 'baseline.json'))
+    ap.add_argument('--update', action='store_true', help='rewrite the baseline')
+    ap.add_argument('--only', action='append', help='run only this workload')
+    ap.add_argument('--forward', type=int, default=0, help='forwarding setting')
+    ap.add_argument('--max-cycles', type=int, default=20000000)
+    ap.add_argument('--repeat', type=int, default=5, help='host timing repetitions')
+    ap.add_argument('--tolerance', type=float, default=0.20,
+                    help='allowed host throughput drop (fraction)')
+    ap.add_argument('--check', action='store_true',
+                    help='also run under the lockstep checker')
+    ap.add_argument('--fuse', action='store_true',
+                    help='also check that fusion leaves $v1 and the retired count alone')
+    ap.add_argument('--mt', action='store_true',
+                    help='also check that every hardware thread ends with the reference $v1')
+    args = ap.parse_args()
+
+    progs = sorted(glob.glob(os.path.join(HERE, 'workloads', '*.in')))
+    names = [os.path.basename(p)[:-3] for p in progs]
+    if args.only:
+        progs = [p for p, n in zip(progs, names) if n in args.only]
+        names = [n for n in names if n in args.only]
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    except FileNotFoundError:
+        baseline = {}
+
+    print('%-8s %10s %10s %6s %7s %10s %6s  %s'
+          % ('workload', 'cycles', 'insts', 'CPI', 'hit%', 'MIPS', 'ref', 'vs baseline'))
+    results, failed = {}, False
+    for name, prog in zip(names, progs):
+        r = measure(args, prog)
+        results[name] = r
+        notes = []
+        base = baseline.get(name)
+        if base is None:
+            notes.append('new')
+        else:
+            for k in MODEL_KEYS:
+                if r[k] != base.get(k):
+                    notes.append('%s %s->%s' % (k, base.get(k), r[k]))
+            if r['sim_ips'] < base['sim_ips'] * (1 - args.tolerance):
+                notes.append('host %.0f%% slower' % (100 * (1 - r['sim_ips'] / base['sim_ips'])))
+        if not r['halted']:
+            notes.append('did not halt')
+        if r['v1'] != r['ref_v1']:
+            notes.append('ref v1 %s != %s' % tuple('none' if v is None else '0x%x' % v
+                                                  for v in (r['v1'], r['ref_v1'])))
+        if args.check:
+            bad = check(args, prog)
+            if bad:
+                notes.append(bad)
+        if args.fuse:
+            bad = fuse_check(args, prog)
+            if bad:
+                notes.append(bad)
+        if args.mt:
+            bad = mt_check(args, prog, r['ref_v1'])
+            if bad:
+                notes.append(bad)
+        failed |= bool(notes) and notes != ['new']
+        print('%-8s %10d %10d %6.3f %6.1f%% %10.2f %6s  %s'
+              % (name, r['cycles'], r['instructions'], r['cpi'], 100 * r['hit_rate'],
+                 r['sim_ips'] / 1e6, 'ok' if r['v1'] == r['ref_v1'] else 'DIFF',
+                 ', '.join(notes) or 'ok'))
+
+    if args.update:
+        keep = MODEL_KEYS + ('ref_v1', 'cpi', 'hit_rate', 'sim_ips', 'cpi_stack')
+        baseline.update({n: {k: r[k] for k in keep} for n, r in results.items()})
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('baseline written to %s' % args.baseline)
+        return 0
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,41 @@
+# Bit-serial CRC-32 (reflected polynomial 0xedb88320) over 512 words.
+# Result: $v1 = CRC of the buffer.
+
+        .equ BUF, 0x7ff00000
+
+        li    $s0, BUF
+        li    $s1, 0xedb88320
+        li    $t9, 0x1b873593     # xorshift32 state
+
+        move  $t0, $s0
+        li    $t1, 512
+fill:   sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        sw    $t9, 0($t0)
+        addiu $t0, $t0, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, fill
+
+        li    $v1, 0xffffffff
+        move  $t0, $s0
+        li    $t1, 512
+word:   lw    $t2, 0($t0)
+        xor   $v1, $v1, $t2
+        li    $t3, 32
+bit:    andi  $t4, $v1, 1
+        srl   $v1, $v1, 1
+        beq   $t4, $0, nox
+        xor   $v1, $v1, $s1
+nox:    addiu $t3, $t3, -1
+        bne   $t3, $0, bit
+        addiu $t0, $t0, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, word
+        nor   $v1, $v1, $0
+
+        li    $v0, 10
+        syscall
@@ -0,0 +1,57 @@
+# Branchy five-state recognizer fed 2-bit symbols from xorshift.
+#   s0: 0->s1 3->s2 else s0     s1: 1->s2 0->s1 else s0
+#   s2: 2->s3 1->s1 else s0     s3: 3->s4 0->s2 else s0
+#   s4: accept, count and return to s0
+# Result: $v1 = number of accepts in 20000 steps.
+
+        li    $t9, 0x85ebca6b     # xorshift32 state
+        li    $s1, 20000
+        li    $s2, 0              # state
+        li    $v1, 0
+        li    $a1, 1
+        li    $a2, 2
+        li    $a3, 3
+
+step:   sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        andi  $t0, $t9, 3         # symbol
+        beq   $s2, $0, st0
+        beq   $s2, $a1, st1
+        beq   $s2, $a2, st2
+        beq   $s2, $a3, st3
+        addiu $v1, $v1, 1         # s4
+        li    $s2, 0
+        b     next
+
+st0:    beq   $t0, $0, to1
+        beq   $t0, $a3, to2
+        b     to0
+st1:    beq   $t0, $a1, to2
+        beq   $t0, $0, to1
+        b     to0
+st2:    beq   $t0, $a2, to3
+        beq   $t0, $a1, to1
+        b     to0
+st3:    beq   $t0, $a3, to4
+        beq   $t0, $0, to2
+        b     to0
+
+to0:    li    $s2, 0
+        b     next
+to1:    li    $s2, 1
+        b     next
+to2:    li    $s2, 2
+        b     next
+to3:    li    $s2, 3
+        b     next
+to4:    li    $s2, 4
+
+next:   addiu $s1, $s1, -1
+        bne   $s1, $0, step
+
+        li    $v0, 10
+        syscall
@@ -0,0 +1,73 @@
+# Global-variable traffic as compiled code does it: every access builds the
+# address with lui %ahi and a %lo offset, so word, halfword and byte loads
+# follow their lui (the fusable lui+load pair), constants are lui/ori and
+# the bucket array's address is lui/addiu. Globals sit at different byte
+# lanes and some %lo offsets are negative.
+# Result: $v1 = rotate/xor hash of the final globals and the 16 buckets.
+
+        .equ SEED,    0x7ff00000  # word, LCG state
+        .equ MAXH,    0x7ff08002  # halfword, upper lane, %lo < 0
+        .equ LAST,    0x7ff08005  # byte, lane 1, %lo < 0
+        .equ BUCKETS, 0x7ff0c000  # 16 words, %lo < 0
+
+        li    $t0, 12345
+        lui   $t9, %ahi(SEED)
+        sw    $t0, %lo(SEED)($t9)
+        li    $s0, 0              # sum of the signed LAST bytes
+        li    $s7, 3000           # iterations
+
+loop:   lui   $t0, %ahi(SEED)
+        lw    $t0, %lo(SEED)($t0)
+        li    $t1, 1103515245
+        multu $t0, $t1
+        mflo  $t0
+        addiu $t0, $t0, 12345
+        lui   $t9, %ahi(SEED)
+        sw    $t0, %lo(SEED)($t9)
+
+        srl   $t2, $t0, 16
+        andi  $t3, $t2, 15
+        sll   $t3, $t3, 2
+        la    $t4, BUCKETS
+        addu  $t4, $t4, $t3       # &buckets[(seed >> 16) & 15]
+        lw    $t5, 0($t4)
+        addiu $t5, $t5, 1
+        sw    $t5, 0($t4)
+
+        andi  $t6, $t2, 0x7fff
+        lui   $t7, %ahi(MAXH)
+        lh    $t7, %lo(MAXH)($t7)
+        slt   $t8, $t7, $t6
+        beq   $t8, $0, nomax
+        lui   $t9, %ahi(MAXH)
+        sh    $t6, %lo(MAXH)($t9)
+
+nomax:  srl   $t6, $t0, 8
+        lui   $t9, %ahi(LAST)
+        sb    $t6, %lo(LAST)($t9)
+        lui   $t7, %ahi(LAST)
+        lb    $t7, %lo(LAST)($t7)  # sign-extended
+        addu  $s0, $s0, $t7
+        addiu $s7, $s7, -1
+        bne   $s7, $0, loop
+
+        move  $v1, $s0
+        lui   $t0, %ahi(SEED)
+        lw    $t0, %lo(SEED)($t0)
+        xor   $v1, $v1, $t0
+        lui   $t0, %ahi(MAXH)
+        lh    $t0, %lo(MAXH)($t0)
+        xor   $v1, $v1, $t0
+        la    $t4, BUCKETS
+        li    $t5, 16
+hash:   sll   $t1, $v1, 5
+        srl   $t2, $v1, 27
+        or    $v1, $t1, $t2
+        lw    $t3, 0($t4)
+        xor   $v1, $v1, $t3
+        addiu $t4, $t4, 4
+        addiu $t5, $t5, -1
+        bne   $t5, $0, hash
+
+        li    $v0, 10
+        syscall
@@ -0,0 +1,61 @@
+# Insertion sort of 128 non-negative words.
+# Result: $v1 = order-sensitive rotate/xor hash of the sorted array,
+#         $a1 = number of adjacent pairs out of order (0 when correct).
+
+        .equ ARR, 0x7ff00000
+        .equ N, 128
+
+        li    $s0, ARR
+        li    $s1, N
+        li    $t9, 0x2545f491     # xorshift32 state
+
+        move  $t0, $s0
+        move  $t1, $s1
+fill:   sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        andi  $t3, $t9, 0x7fff
+        sw    $t3, 0($t0)
+        addiu $t0, $t0, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, fill
+
+        li    $s2, 1              # i
+outer:  sll   $t0, $s2, 2
+        addu  $t0, $t0, $s0       # &a[i]
+        lw    $t1, 0($t0)         # key
+        addiu $t2, $t0, -4        # &a[j]
+inner:  slt   $t4, $t2, $s0       # j < 0
+        bne   $t4, $0, place
+        lw    $t3, 0($t2)
+        slt   $t4, $t1, $t3       # key < a[j]
+        beq   $t4, $0, place
+        sw    $t3, 4($t2)
+        addiu $t2, $t2, -4
+        b     inner
+place:  sw    $t1, 4($t2)
+        addiu $s2, $s2, 1
+        bne   $s2, $s1, outer
+
+        li    $v1, 0
+        li    $a1, 0
+        move  $t0, $s0
+        li    $t1, 0              # previous element
+        move  $t2, $s1
+check:  lw    $t3, 0($t0)
+        slt   $t4, $t3, $t1
+        addu  $a1, $a1, $t4
+        sll   $t5, $v1, 1
+        srl   $t6, $v1, 31
+        or    $v1, $t5, $t6
+        xor   $v1, $v1, $t3
+        move  $t1, $t3
+        addiu $t0, $t0, 4
+        addiu $t2, $t2, -1
+        bne   $t2, $0, check
+
+        li    $v0, 10
+        syscall
@@ -0,0 +1,40 @@
+# Linked-list pointer chasing: 512 8-byte nodes {next, value} linked with
+# a stride of 167 nodes so consecutive hops land on different cache lines.
+# Result: $v1 = sum of node values over 8 full traversals.
+
+        .equ NODES, 0x7ff00000
+
+        li    $s0, NODES
+        li    $t9, 0x3c6ef372     # xorshift32 state
+
+        li    $t0, 0              # k
+        li    $s1, 512
+build:  sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        sll   $t1, $t0, 3
+        addu  $t1, $t1, $s0       # &node[k]
+        addiu $t3, $t0, 167
+        andi  $t3, $t3, 511
+        sll   $t3, $t3, 3
+        addu  $t3, $t3, $s0       # &node[(k + 167) % 512]
+        sw    $t3, 0($t1)
+        andi  $t4, $t9, 0xffff
+        sw    $t4, 4($t1)
+        addiu $t0, $t0, 1
+        bne   $t0, $s1, build
+
+        li    $v1, 0
+        move  $t0, $s0            # p
+        li    $t5, 4096           # hops
+chase:  lw    $t4, 4($t0)
+        lw    $t0, 0($t0)
+        addu  $v1, $v1, $t4
+        addiu $t5, $t5, -1
+        bne   $t5, $0, chase
+
+        li    $v0, 10
+        syscall
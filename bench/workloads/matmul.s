@@ -0,0 +1,59 @@
+# 16x16 integer matrix multiply C = A * B with xorshift-filled operands.
+# Result: $v1 = sum of all elements of C.
+
+        .equ A, 0x7ff00000
+        .equ B, 0x7ff00400
+        .equ C, 0x7ff00800
+
+        li    $s0, A
+        li    $s1, B
+        li    $s2, C
+        li    $t9, 0x92d68ca2     # xorshift32 state
+        li    $a0, 16             # N
+
+        move  $t0, $s0            # fill A and B (2*N*N words)
+        li    $t1, 512
+fill:   sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        andi  $t3, $t9, 0xff
+        sw    $t3, 0($t0)
+        addiu $t0, $t0, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, fill
+
+        li    $v1, 0
+        li    $s3, 0              # i
+iloop:  li    $s4, 0              # j
+jloop:  sll   $t0, $s3, 6
+        addu  $t0, $t0, $s0       # &A[i][0]
+        sll   $t1, $s4, 2
+        addu  $t1, $t1, $s1       # &B[0][j]
+        li    $t2, 16             # k
+        li    $t3, 0              # acc
+kloop:  lw    $t4, 0($t0)
+        lw    $t5, 0($t1)
+        mult  $t4, $t5
+        addiu $t0, $t0, 4         # keep MFLO clear of the MULT write-back
+        addiu $t1, $t1, 64
+        addiu $t2, $t2, -1
+        mflo  $t6
+        addu  $t3, $t3, $t6
+        bne   $t2, $0, kloop
+
+        sll   $t7, $s3, 6
+        sll   $t8, $s4, 2
+        addu  $t7, $t7, $t8
+        addu  $t7, $t7, $s2
+        sw    $t3, 0($t7)         # C[i][j]
+        addu  $v1, $v1, $t3
+        addiu $s4, $s4, 1
+        bne   $s4, $a0, jloop
+        addiu $s3, $s3, 1
+        bne   $s3, $a0, iloop
+
+        li    $v0, 10
+        syscall
@@ -0,0 +1,50 @@
+# memset a 1 KB buffer, memcpy it to a second buffer 4 KB away (same
+# cache sets, so the copy thrashes the direct-mapped L1) and sum the copy.
+# Repeated for 8 passes with a different fill pattern each pass.
+# Result: $v1 = sum of every copied word over all passes.
+
+        .equ SRC, 0x7ff00000
+        .equ DST, 0x7ff01000
+
+        li    $s0, SRC
+        li    $s1, DST
+        li    $s2, 8              # passes
+        li    $v1, 0
+
+pass:   move  $t0, $s0            # memset, unrolled by 4
+        li    $t1, 256
+        sll   $t2, $s2, 8
+        or    $t2, $t2, $s2
+set:    sw    $t2, 0($t0)
+        sw    $t2, 4($t0)
+        sw    $t2, 8($t0)
+        sw    $t2, 12($t0)
+        addiu $t0, $t0, 16
+        addiu $t1, $t1, -4
+        bne   $t1, $0, set
+
+        move  $t0, $s0            # memcpy, unrolled by 2
+        move  $t3, $s1
+        li    $t1, 256
+copy:   lw    $t4, 0($t0)
+        lw    $t5, 4($t0)
+        sw    $t4, 0($t3)
+        sw    $t5, 4($t3)
+        addiu $t0, $t0, 8
+        addiu $t3, $t3, 8
+        addiu $t1, $t1, -2
+        bne   $t1, $0, copy
+
+        move  $t3, $s1            # checksum the destination
+        li    $t1, 256
+sum:    lw    $t4, 0($t3)
+        addu  $v1, $v1, $t4
+        addiu $t3, $t3, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, sum
+
+        addiu $s2, $s2, -1
+        bne   $s2, $0, pass
+
+        li    $v0, 10
+        syscall
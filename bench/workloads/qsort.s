@@ -0,0 +1,86 @@
+# Recursive quicksort (Lomuto partition) of 256 non-negative words,
+# exercising JAL/JR and stack frames.
+# Result: $v1 = order-sensitive rotate/xor hash of the sorted array,
+#         $a1 = number of adjacent pairs out of order (0 when correct).
+
+        .equ ARR, 0x7ff00000
+        .equ N, 256
+        .equ STACK, 0x7fffff00
+
+        li    $s0, ARR
+        li    $s1, N
+        li    $sp, STACK
+        li    $t9, 0x6b8b4567     # xorshift32 state
+
+        move  $t0, $s0
+        move  $t1, $s1
+fill:   sll   $t2, $t9, 13
+        xor   $t9, $t9, $t2
+        srl   $t2, $t9, 17
+        xor   $t9, $t9, $t2
+        sll   $t2, $t9, 5
+        xor   $t9, $t9, $t2
+        andi  $t3, $t9, 0x7fff
+        sw    $t3, 0($t0)
+        addiu $t0, $t0, 4
+        addiu $t1, $t1, -1
+        bne   $t1, $0, fill
+
+        move  $a0, $s0
+        addiu $a1, $s0, 1020      # &a[N-1]
+        jal   qsort
+
+        li    $v1, 0
+        li    $a1, 0
+        move  $t0, $s0
+        li    $t1, 0
+        move  $t2, $s1
+check:  lw    $t3, 0($t0)
+        slt   $t4, $t3, $t1
+        addu  $a1, $a1, $t4
+        sll   $t5, $v1, 1
+        srl   $t6, $v1, 31
+        or    $v1, $t5, $t6
+        xor   $v1, $v1, $t3
+        move  $t1, $t3
+        addiu $t0, $t0, 4
+        addiu $t2, $t2, -1
+        bne   $t2, $0, check
+
+        li    $v0, 10
+        syscall
+
+# qsort($a0 = &lo, $a1 = &hi), both inclusive
+qsort:  slt   $t0, $a0, $a1
+        beq   $t0, $0, qret
+        addiu $sp, $sp, -16
+        sw    $ra, 0($sp)
+        sw    $a0, 4($sp)
+        sw    $a1, 8($sp)
+        lw    $t1, 0($a1)         # pivot
+        addiu $t2, $a0, -4        # i
+        move  $t3, $a0            # j
+part:   beq   $t3, $a1, pdone
+        lw    $t4, 0($t3)
+        slt   $t5, $t1, $t4       # pivot < a[j]
+        bne   $t5, $0, pnext
+        addiu $t2, $t2, 4
+        lw    $t6, 0($t2)
+        sw    $t4, 0($t2)
+        sw    $t6, 0($t3)
+pnext:  addiu $t3, $t3, 4
+        b     part
+pdone:  addiu $t2, $t2, 4
+        lw    $t6, 0($t2)
+        sw    $t1, 0($t2)
+        sw    $t6, 0($a1)
+        sw    $t2, 12($sp)        # pivot position
+        addiu $a1, $t2, -4
+        jal   qsort
+        lw    $t2, 12($sp)
+        addiu $a0, $t2, 4
+        lw    $a1, 8($sp)
+        jal   qsort
+        lw    $ra, 0($sp)
+        addiu $sp, $sp, 16
+qret:   jr    $ra
@@ -1,31 +1,605 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 #include "mu-mips.h"
 #include "mu-cache.h"
 
 int ENABLE_FORWARDING = 1;
-int stall = 0;
-uint32_t ID_EX_rs = 0;
-uint32_t ID_EX_rt = 0;
-uint32_t EX_MEM_RegisterRd = 0;
-uint32_t EX_MEM_RegisterRt = 0;
-uint32_t MEM_WB_RegisterRt = 0;
-uint32_t MEM_WB_RegisterRd = 0;
+uint32_t EX_MEM_RegisterRd = 0; //ir_dest() of the instruction in EX_MEM
+uint32_t MEM_WB_RegisterRd = 0; //and in MEM_WB
 int EX_MEM_RegWrite = 1;
 int MEM_WB_RegWrite = 1;
-int forwardA = 0;
-int forwardB = 0;
-uint32_t prevInstruction = 0;
 int branch = 0;
 int EX_stall = 0;
 int MEM_stall = 0;
 int IF_stall = 0;
 uint32_t stallInstruction = 0;
 
+/* CPI stack: every simulated cycle is charged to exactly one category. A retiring
+   instruction is charged to CPI_BASE; a bubble reaching WB to the cause recorded
+   when it was inserted, which travels down the latches with it. */
+enum
+{
+	CPI_BASE,
+	CPI_LOAD_USE,
+	CPI_DATA_HAZARD,
+	CPI_CONTROL,
+	CPI_IFETCH_MISS,
+	CPI_DCACHE_MISS,
+	CPI_STRUCTURAL,
+	CPI_TLB,
+	CPI_STORE_BUFFER,
+	CPI_NUM
+};
+const char *cpi_names[CPI_NUM] = {"base", "load-use", "data hazard", "control flush", "I-fetch miss", "D-cache miss", "structural", "TLB walk",
+								  "store buffer"};
+uint32_t cpi_cycles[CPI_NUM];
+int ID_EX_cause = CPI_BASE;
+int EX_MEM_cause = CPI_BASE;
+int MEM_WB_cause = CPI_BASE;
+/* Functional units. MULT/MULTU and DIV/DIVU issue to their unit in EX, which then
+   takes interval cycles before it accepts another; HI/LO are readable latency
+   cycles after issue. ID holds a multiply or divide until its unit is free, and
+   MFHI/MFLO until HI/LO are ready and no older HI/LO write is still in flight. */
+enum
+{
+	FU_ALU,
+	FU_MUL,
+	FU_DIV,
+	FU_NUM
+};
+typedef struct Func_Unit_Struct {
+	uint32_t latency;
+	uint32_t interval; //initiation interval
+	uint32_t free_at;  //first cycle the unit accepts an operation
+	uint32_t ops;
+	uint32_t busy;   //cycles it could not accept one
+	uint32_t stalls; //structural stall cycles spent waiting for it
+} Func_Unit;
+const char *fu_names[FU_NUM] = {"alu", "mul", "div"};
+Func_Unit fu[FU_NUM] = {
+	[FU_ALU] = {.latency = 1, .interval = 1},
+	[FU_MUL] = {.latency = 1, .interval = 1},
+	[FU_DIV] = {.latency = 1, .interval = 1},
+};
+uint32_t hilo_ready = 0; //first cycle MFHI/MFLO may read the last multiply/divide result in EX
+uint32_t hilo_stalls = 0;
+
+/* MMU (mmu on): a two-level page table in kernel data memory, built as an identity
+   map and editable by the program. IF translates through the I-TLB and MEM through
+   the D-TLB; a miss walks the table with cache_read_32(), and the pipeline sits out
+   the walk's cycles, charged to CPI_TLB. The functional model does not translate. */
+#define MMU_PAGE_BITS 12
+#define MMU_PT_BASE (MEM_KDATA_END - 0x10000) //directory, then the second-level tables
+#define MMU_PT_TABLES 15                      //second-level tables that fit after it
+#define MMU_PTE_VALID 0x1
+#define MMU_FAULT_PADDR 0xFFFFF000 //unmapped: a faulting load reads 0 and a store is dropped
+#define MMU_WALK_READ_CYCLES 1     //per page-table read
+#define MMU_WALK_MISS_CYCLES 100   //more when that read misses in the D-cache
+#define TLB_MAX_ENTRIES 256
+#define TLB_NO_VPN 0xFFFFFFFF
+
+typedef struct TLB_Entry_Struct {
+	uint32_t vpn; //TLB_NO_VPN when empty
+	uint32_t pfn;
+	uint32_t used; //LRU stamp
+} TLB_Entry;
+
+typedef struct TLB_Struct {
+	uint32_t entries;
+	uint32_t ways;
+	uint32_t last_vpn; //most recently used translation, tried before the sets
+	uint32_t last_pfn;
+	uint32_t clock;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t walk_cycles;
+	TLB_Entry e[TLB_MAX_ENTRIES];
+} TLB;
+
+int mmu_enabled = 0;
+TLB itlb = {.entries = 16, .ways = 4};
+TLB dtlb = {.entries = 32, .ways = 4};
+uint32_t mmu_wait = 0;    //walk cycles the pipeline still has to sit out
+uint32_t mmu_walk_pc = 0; //instruction the walk is charged to in the per-PC profile
+uint32_t mmu_faults = 0;
+
+/* Scratchpad (spm on): on-chip memory at SPM_BEGIN that loads and stores reach in the
+   MEM cycle, bypassing L1Cache. Four words at DMA_REGS program a DMA engine that
+   copies between it and main memory in the background, dma_rate bytes per pipeline
+   cycle; it makes no progress while a D-cache refill or page walk freezes the pipeline. */
+#define SPM_BEGIN 0x20000000
+#define SPM_MAX_SIZE 0x10000
+#define DMA_REGS (SPM_BEGIN + SPM_MAX_SIZE)
+#define SPM_WINDOW (SPM_MAX_SIZE + 16) //scratchpad, then the DMA registers
+enum
+{
+	DMA_SRC,
+	DMA_DST,
+	DMA_LEN, //bytes, rounded up to words
+	DMA_CTRL //write non-zero to start a transfer; reads 1 while one is running
+};
+
+int spm_enabled = 0;
+uint32_t spm_size = 0x4000;
+uint32_t spm_window = 0; //SPM_WINDOW while enabled, so a single compare routes an access
+uint8_t spm_mem[SPM_MAX_SIZE];
+uint32_t spm_reads = 0;
+uint32_t spm_writes = 0;
+uint32_t dma_reg[4];
+uint32_t dma_rate = 4;
+uint32_t dma_src = 0; //the running transfer
+uint32_t dma_dst = 0;
+uint32_t dma_left = 0;
+uint32_t dma_space = 0; //thread whose memory it copies (mt_space when it started)
+uint32_t dma_transfers = 0;
+uint32_t dma_bytes = 0;
+uint32_t dma_busy_cycles = 0;
+uint32_t spm_read_word(uint32_t addr);
+void spm_write_word(uint32_t addr, uint32_t value);
+
+/* Store buffer (sb on): MEM hands SB/SH/SW to a FIFO of line entries instead of
+   writing through L1Cache, and the oldest entry drains into L1 in the background,
+   one pipeline cycle on a hit and SB_MISS_CYCLES on a miss. A store to a line that
+   is already buffered is combined into its entry. Memory is updated in MEM, so the
+   functional model, debugger and DMA see every store at once; the buffer decides
+   when L1 does. A load whose bytes buffered stores fully cover is forwarded; one
+   that overlaps them only partly, or a store that finds the buffer full, freezes
+   the pipeline while the entries ahead of it drain (CPI_STORE_BUFFER). */
+#define SB_MAX_ENTRIES 64
+#define SB_MISS_CYCLES 100
+
+typedef struct SB_Entry_Struct {
+	uint32_t line; //address of the 16-byte L1 line
+	uint32_t mask; //bytes written, bit 4 * word + byte
+	uint32_t space; //thread whose memory the line is in (mt_space)
+} SB_Entry;
+
+int sb_enabled = 0;
+uint32_t sb_size = 8;
+SB_Entry sb[SB_MAX_ENTRIES]; //ring of sb_count entries from sb_head
+uint32_t sb_head = 0;
+uint32_t sb_count = 0;
+uint32_t sb_busy = 0;    //cycles until the head entry has drained, 0 before it starts
+uint32_t sb_wait = 0;    //cycles the pipeline still has to sit out for a drain
+uint32_t sb_wait_pc = 0; //load or store the wait is charged to in the per-PC profile
+uint32_t sb_stores = 0;
+uint32_t sb_combined = 0;
+uint32_t sb_forwards = 0;
+uint32_t sb_drains = 0;
+uint32_t sb_drain_misses = 0;
+uint32_t sb_full_stalls = 0;
+uint32_t sb_overlap_stalls = 0;
+uint32_t sb_wait_cycles = 0;
+uint32_t sb_max_count = 0;
+uint64_t sb_occupancy = 0; //sb_count summed over pipeline cycles
+
+/* Macro-op fusion (fuse on): when IF fetches the first instruction of a recognized
+   pair, it takes the second from the same decoded block in the same cycle and the
+   two go through ID/EX/MEM/WB as one op. A lui-* pair becomes its second
+   instruction with $0 as rs and the LUI's result as that operand; the pair
+   overwrites the LUI's register, so the LUI never writes it on its own. A
+   slt-branch pair keeps the compare, and EX resolves the branch on its result.
+   Pairs are not fused across a page with the MMU on, or onto a breakpoint. */
+enum
+{
+	FUSE_LUI_ORI,    //lui rt, hi; ori rt, rt, lo
+	FUSE_LUI_ADDIU,  //lui rt, hi; addiu rt, rt, lo
+	FUSE_LUI_LOAD,   //lui rt, hi; lw/lh/lb rt, lo(rt)
+	FUSE_SLT_BRANCH, //slt/slti r, ...; beq/bne r, $0
+	FUSE_NUM
+};
+const char *fuse_names[FUSE_NUM] = {"lui-ori", "lui-addiu", "lui-load", "slt-branch"};
+
+typedef struct Fuse_Op_Struct {
+	uint32_t first; //the pair as fetched; 0 unless the slot holds a fused pair
+	uint32_t second;
+	uint32_t hi; //lui-* pairs: the LUI's result
+	uint32_t kind;
+	uint32_t raw; //cycles the second would have waited in ID for the first, counted in flight
+} Fuse_Op;
+
+int fuse_enabled = 0;
+int fuse_allowed[FUSE_NUM] = {1, 1, 1, 1};
+uint32_t fuse_pairs[FUSE_NUM];
+uint32_t fuse_saved = 0; //cycles the retired pairs saved, see WB_stage
+Fuse_Op IF_ID_fuse, ID_EX_fuse, EX_MEM_fuse, MEM_WB_fuse; //travel with the latches, like *_cause
+
+uint32_t ID_EX_blame = 0; //PC a bubble's cycles are charged to in the per-PC profile
+uint32_t EX_MEM_blame = 0;
+uint32_t MEM_WB_blame = 0;
+
+/* Per-PC profile (pcprof), indexed by word offset into the loaded program */
+typedef struct PC_Profile_Struct {
+	uint32_t retired;
+	uint32_t cycles; //retire cycles plus bubbles blamed on this PC
+	uint32_t stalls; //bubble cycles among them
+	uint32_t misses; //D-cache misses in MEM
+	uint32_t back_taken; //taken branches or jumps backwards from here
+	uint32_t back_target;
+} PC_Profile;
+
+PC_Profile *pcprof = NULL; //NULL while profiling is off
+uint32_t pcprof_size = 0;
+uint32_t pcprof_miss_pc = 0; //last load/store that missed; run() charges the miss penalty to it
+
+/* Lockstep checker (check on): a functional reference steps once per WB retire */
+int check_enabled = 0;
+int check_store_valid = 0; //the instruction now in MEM_WB stored through cache_write_32
+uint32_t check_store_addr;
+uint32_t check_store_word; //word written
+uint32_t check_store_old;  //word before the store
+void check_retire();
+
+void pcprof_charge(uint32_t pc, int retired, int cause);
+void pcprof_miss(uint32_t pc);
+void pcprof_redirect(uint32_t pc, uint32_t ir, uint32_t target);
+
+double SIM_HOST_SECONDS = 0; //host time spent inside run(), runAll() and fast_forward()
+uint32_t miss_wait = 1; //D-cache miss penalty cycles charged so far; simulated state, so replays repeat it
+
+/* Snapshot ring (back / goto): the first write to a memory page after a snapshot
+   keeps the page's old contents with that snapshot */
+#define SNAP_PAGE_BITS 12
+#define SNAP_RING 64
+#define SNAP_INTERVAL 1000000 //default cycles between snapshots
+uint8_t *snap_saved[NUM_MEM_REGION]; //per page: old contents kept, or nothing to keep. NULL while snapshots are off
+uint32_t snap_next = 0; //take a snapshot once CYCLE_COUNT reaches this
+void snap_save_page(int region, uint32_t page);
+void snap_take();
+void snap_restart();
+
+/* Breakpoints are flagged in the block cache's decoded records, so only a fetch of
+   a flagged instruction arms the check in MEM. Watchpoints flag 4 KB pages; loads
+   and stores look further only on a flagged page. */
+#define WATCH_PAGE_BITS 12
+#define BRK_MAX 32
+enum
+{
+	BRK_EXEC = 1,
+	BRK_READ = 2,
+	BRK_WRITE = 4
+};
+int brk_armed = 0;  //an instruction with a breakpoint has been fetched
+int brk_stop = 0;   //a breakpoint or watchpoint hit; the run ends after this cycle
+int brk_ignore = 0; //goto/back replay runs through breakpoints
+int brk_hit_kind = 0; //what stopped the run, and the data address for a watchpoint
+uint32_t brk_hit_addr = 0;
+uint32_t watch_count = 0;
+uint8_t watch_page[1 << (32 - WATCH_PAGE_BITS)];
+int brk_at(uint32_t pc);
+int brk_check(uint32_t pc);
+void watch_check(uint32_t pc, int kind, uint32_t addr, uint32_t size);
+
+/* CURRENT_STATE is the only architectural state. Stages read it as of the start of
+   the cycle; their register, HI/LO and PC writes are logged and applied together by
+   state_commit() at the cycle boundary. A taken branch or jump in EX leaves its
+   target in redirect_pc, which IF fetches from in the same cycle. */
+typedef struct State_Write_Struct {
+	uint32_t *reg;
+	uint32_t value;
+} State_Write;
+
+#define STATE_LOG_SIZE 8 //WB's HI and LO, IF's PC
+
+State_Write state_log[STATE_LOG_SIZE];
+int state_log_used = 0;
+uint32_t redirect_pc = 0;
+int redirect_valid = 0;
+
+static inline void state_write(uint32_t *reg, uint32_t value)
+{
+	assert(state_log_used < STATE_LOG_SIZE);
+	state_log[state_log_used].reg = reg;
+	state_log[state_log_used].value = value;
+	state_log_used++;
+}
+
+/* Value reg has once this cycle commits: a write already logged, if any. ID and EX
+   read the register file through this, so WB's write this cycle reaches them. */
+static inline uint32_t state_read(const uint32_t *reg)
+{
+	uint32_t value = *reg;
+	int i;
+
+	for (i = 0; i < state_log_used; i++)
+	{
+		if (state_log[i].reg == reg)
+		{
+			value = state_log[i].value;
+		}
+	}
+	return value;
+}
+
+/* Pipeline trace: per-instruction stage entries plus stall and flush events,
+   streamed to a binary file and converted offline (trace konata / trace chrome).
+   Building with -DPIPE_TRACE=0 removes every hook. TRACE is only used inside the
+   stages, whose probe argument is 0 in the loops built for runs without probes. */
+#ifndef PIPE_TRACE
+#define PIPE_TRACE 1
+#endif
+
+enum
+{
+	TRACE_IF,
+	TRACE_ID,
+	TRACE_EX,
+	TRACE_MEM,
+	TRACE_WB,
+	TRACE_STALL,
+	TRACE_FLUSH
+};
+
+typedef struct Trace_Record_Struct {
+	uint32_t cycle;
+	uint32_t seq; //fetch order, assigned in IF
+	uint32_t pc;
+	uint32_t ir;
+	uint8_t kind;  //TRACE_*
+	uint8_t cause; //CPI_* for stalls
+	uint8_t pad[2];
+} Trace_Record;
+
+#define TRACE_MAGIC 0x5254554D //"MUTR"
+#define TRACE_BUFFER_RECORDS 8192
+
+FILE *trace_fp = NULL;
+Trace_Record trace_buf[TRACE_BUFFER_RECORDS];
+uint32_t trace_used = 0;
+uint32_t trace_seq = 0;
+uint32_t IF_ID_seq = 0;
+uint32_t ID_EX_seq = 0;
+uint32_t EX_MEM_seq = 0;
+uint32_t MEM_WB_seq = 0;
+uint32_t ID_seen_seq = 0; //last instruction whose ID entry was recorded
+
+void trace_emit(int kind, uint32_t seq, uint32_t pc, uint32_t ir, int cause);
+
+#if PIPE_TRACE
+#define TRACE(kind, seq, pc, ir, cause)                   \
+	do                                                    \
+	{                                                     \
+		if (probe && trace_fp != NULL)                    \
+		{                                                 \
+			trace_emit((kind), (seq), (pc), (ir), (cause)); \
+		}                                                 \
+	} while (0)
+#else
+#define TRACE(kind, seq, pc, ir, cause) \
+	do                                  \
+	{                                   \
+	} while (0)
+#endif
+
+/* Buffered file written by its own thread: the simulator fills one buffer while
+   the thread writes the queued ones, and only waits when all are queued */
+#define AW_BUFFERS 8
+#define AW_BUFFER_BYTES 65536
+
+typedef struct Async_Writer_Struct {
+	FILE *fp;
+	char *buf; //AW_BUFFERS buffers of AW_BUFFER_BYTES
+	uint32_t len[AW_BUFFERS];
+	uint32_t head;   //oldest queued buffer, the one the thread writes
+	uint32_t queued; //buffers handed to the thread; the simulator fills buffer head + queued
+	int stop;
+	uint32_t waits; //times the simulator found every buffer queued
+	uint64_t bytes;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Async_Writer;
+
+/* Interval statistics (interval <n> <file>): every n cycles one CSV row of deltas
+   goes to <file> and the interval's basic block vector, in SimPoint's .bb format,
+   to <file>.bb. A block is a run of retired instructions ending in a branch or
+   jump, named by its first PC as the word index into the text segment, plus one. */
+#define BBV_SLOTS 4096 //distinct blocks per interval; more are counted in bbv_lost
+
+typedef struct Interval_Base_Struct {
+	uint32_t cycle;
+	uint32_t instructions;
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+	uint32_t branches;
+	uint32_t cpi[CPI_NUM];
+} Interval_Base;
+
+uint32_t interval_len = 0; //0 while off
+uint32_t interval_next = 0xFFFFFFFF; //close the interval once CYCLE_COUNT reaches this
+uint32_t interval_done = 0; //end cycle of the last row written; replays after goto/back skip up to it
+uint32_t interval_rows = 0;
+Interval_Base interval_base; //counters when the interval began
+Async_Writer interval_csv, interval_bbv;
+uint32_t taken_branches = 0; //taken branches and jumps, counted in EX
+
+uint32_t bbv_pc[BBV_SLOTS]; //open-addressed by block PC, 0 is an empty slot
+uint32_t bbv_count[BBV_SLOTS]; //instructions retired in the block this interval
+uint32_t bbv_used[BBV_SLOTS]; //slots in use, in first-seen order
+uint32_t bbv_nused = 0;
+uint32_t bbv_start = 0; //first PC of the block being retired, 0 before its first instruction
+uint32_t bbv_len = 0;
+uint32_t bbv_lost = 0;
+
+/* Hardware multithreading (threads <n> rr|miss): n contexts share the pipeline and
+   L1. Each latch carries its instruction's thread (*_tid); a stage is handed that
+   thread's CPU_State, so its reads and logged writes go straight to the thread's
+   registers, and runs with the thread's memory mapped in. Hazards, forwarding and branch flushes only act between
+   latches of the same thread. A D-cache miss no longer freezes the core: the thread
+   that missed squashes its younger instructions and fetches nothing for
+   MT_MISS_CYCLES (under linefill, until its word arrives), while the others run.
+   rr fetches from the next ready thread every cycle, miss stays on one thread
+   until it misses. Threads run the loaded program from its entry point, each in a
+   copy of every region but the text taken when threads start. L1 tags and store
+   buffer entries carry the thread whose memory a line is in (mt_space). */
+#define MT_MAX 8
+#define MT_IDLE MT_MAX //tid of a bubble fetched while no thread was ready
+#define MT_MISS_CYCLES 100
+#define MT_SPACE_SHIFT 29 //above the widest L1 tag
+
+enum
+{
+	MT_ROUND_ROBIN,
+	MT_SWITCH_ON_MISS
+};
+
+uint32_t mt_threads = 0; //0 while off
+int mt_policy = MT_ROUND_ROBIN;
+CPU_State mt_ctx[MT_MAX]; //threads 1 and up; thread 0 runs on CURRENT_STATE
+uint32_t mt_ready_at[MT_MAX]; //no fetch before this cycle
+int mt_done[MT_MAX];
+uint32_t mt_retired[MT_MAX];
+uint32_t mt_misses[MT_MAX];
+uint32_t mt_current = 0; //last thread fetched from
+uint32_t mt_switches = 0;
+uint32_t mt_idle = 0; //cycles IF found no thread ready
+uint32_t mt_start_cycle = 0;
+uint32_t IF_ID_tid = 0, ID_EX_tid = 0, EX_MEM_tid = 0, MEM_WB_tid = 0;
+uint8_t *mt_mem[MT_MAX][NUM_MEM_REGION]; //each thread's copy of the regions, kept once allocated
+uint8_t *mt_saved[MT_MAX][NUM_MEM_REGION]; //and its snap_saved flags
+uint32_t mt_space = 0; //thread whose memory MEM_REGIONS points at; 0 between cycles
+void mt_map(uint32_t t);
+void mt_init(uint32_t n, int policy);
+void mt_command(const char *arg);
+
+/* Line-fill timing (linefill whole|cwf): an L1 miss streams its four words over
+   the bus, the first after fill_first cycles and one more every fill_beat cycles.
+   whole returns them in address order and holds the requester until the line is
+   complete; cwf sends the requested word first and lets the pipeline restart as
+   soon as it arrives, while the rest of the line keeps streaming. A later access
+   to the line waits for its word only if that word is still on the way, and one
+   line fills at a time, so a miss behind a fill waits for the bus. The data are
+   in L1 at once; only the stall (fill_wait, CPI_DCACHE_MISS) is timed. With
+   linefill off the fixed miss penalty of run() applies. */
+#define FILL_WORDS 4
+
+enum
+{
+	FILL_OFF,
+	FILL_WHOLE,
+	FILL_CWF
+};
+
+int fill_mode = FILL_OFF;
+uint32_t fill_first = 64; //cycles to the first word; with the beats, 100 for a whole line
+uint32_t fill_beat = 12;  //cycles between words
+uint32_t fill_line = 0;   //line now streaming in, or the last one
+uint32_t fill_start = 0;  //cycle its fill began
+uint32_t fill_crit = 0;   //word sent first
+uint32_t fill_end = 0;    //cycle its last word arrives
+uint32_t fill_wait = 0;   //cycles the pipeline still has to sit out for a word
+uint32_t fill_wait_pc = 0;
+uint32_t fill_lines = 0;
+uint32_t fill_streaming = 0; //accesses that found their word still on the way
+uint32_t fill_bus_waits = 0; //misses that found the bus busy with another fill
+uint32_t fill_wait_cycles = 0;
+uint32_t fill_saved = 0; //cycles not waited compared with whole-line fills
+
+/* Host-time profile of the simulator itself: one cycle in PROF_PERIOD is timed
+   per stage and per subsystem (hostprof). The probes cost even when idle, so
+   they are only compiled in with -DHOST_PROFILE=1. */
+#ifndef HOST_PROFILE
+#define HOST_PROFILE 0
+#endif
+#define PROF_PERIOD 64
+
+enum
+{
+	PROF_WB,
+	PROF_MEM,
+	PROF_EX,
+	PROF_ID,
+	PROF_IF,
+	PROF_COMMIT, //state_commit()
+	PROF_DECODE, //IF's fetch through the basic-block cache
+	PROF_MEMORY, //mem_read_32 / mem_write_32
+	PROF_CACHE,	 //cache_read_32 / cache_write_32
+	PROF_STATS,	 //trace recording
+	PROF_CYCLE,	 //whole cycle()
+	PROF_NUM
+};
+
+#if HOST_PROFILE
+const char *prof_names[PROF_NUM] = {"WB", "MEM", "EX", "ID", "IF", "commit", "fetch/decode", "memory", "cache", "stats", "cycle"};
+int prof_enabled = 0;
+int prof_sampling = 0; //the current cycle is being timed
+typedef struct Prof_Counters_Struct {
+	uint64_t ticks[PROF_NUM];
+	uint64_t calls[PROF_NUM];
+	uint64_t nested[PROF_NUM]; //probes that closed inside this slot's interval
+} Prof_Counters;
+
+Prof_Counters prof, prof_saved; //prof_saved rolls back a sampled cycle the host interrupted
+uint64_t prof_probes = 0;
+uint64_t prof_discarded = 0;
+uint64_t prof_probe_ticks;	 //cost of an empty probe, calibrated by hostprof on
+uint64_t prof_nested_ticks; //what one nested probe adds to the enclosing one
+uint64_t prof_start_ticks;
+double prof_start_seconds;
+
+/* Cheap timestamp: the TSC where there is one, else nanoseconds */
+static inline uint64_t prof_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#define PROF_BEGIN(slot)                                   \
+	uint64_t prof_n_##slot = prof_probes;                  \
+	uint64_t prof_t_##slot = prof_sampling ? prof_now() : 0
+#define PROF_END(slot)                                          \
+	do                                                          \
+	{                                                           \
+		if (prof_sampling)                                      \
+		{                                                       \
+			prof.ticks[slot] += prof_now() - prof_t_##slot;     \
+			prof.nested[slot] += prof_probes - prof_n_##slot;   \
+			prof.calls[slot]++;                                 \
+			prof_probes++;                                      \
+		}                                                       \
+	} while (0)
+#else
+#define PROF_BEGIN(slot)
+#define PROF_END(slot) \
+	do                 \
+	{                  \
+	} while (0)
+#endif
+
+extern uint32_t bb_lo, bb_hi;
+void bb_invalidate(uint32_t address);
+void bb_flush();
+void jit_invalidate(uint32_t address);
+void jit_flush();
+void jit_rearm();
+void jit_command(const char *arg);
+void trace_export_konata(const char *in_path, const char *out_path);
+void trace_export_chrome(const char *in_path, const char *out_path);
+void disassemble(uint32_t instruction, uint32_t addr, char *buf, size_t len);
+
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
 /***************************************************************/
@@ -36,16 +610,54 @@ void help()
 	printf("\t**********MU-MIPS Help MENU**********\n\n");
 	printf("sim\t-- simulate program to completion \n");
 	printf("run <n>\t-- simulate program for <n> instructions\n");
+	printf("fastforward <n>\t-- execute <n> instructions functionally, without pipeline timing\n");
+	printf("jit on|off|show\t-- translate hot blocks to x86-64 for fastforward; translation stats\n");
 	printf("rdump\t-- dump register values\n");
 	printf("cacheDump\t --  cache dump values\n");
+	printf("cpi\t-- print the CPI stack (cycles charged per stall cause)\n");
+	printf("stats\t-- print counters, cache hit rate and host speed as one JSON line\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
 	printf(
 		"mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
+	printf("dumpbin <start> <stop> <file>\t-- write memory <start>..<stop> to a binary file\n");
+	printf("loadbin <addr> <file>\t-- load a binary file into memory at <addr>\n");
+	printf("diff <file> <file>\t-- list the word ranges where two dumps differ\n");
+	printf("diffmem <addr> <file>\t-- list the word ranges where memory from <addr> differs from a dump\n");
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
 	printf("show\t-- print the current content of the pipeline registers\n");
+	printf("trace <file>|off\t-- stream per-instruction stage timing to a binary trace file\n");
+	printf("trace konata|chrome <trace> <out>\t-- convert a trace for Konata or chrome://tracing\n");
+	printf("hostprof on|off|show|reset\t-- sample host time per pipeline stage and subsystem\n");
+	printf("pcprof on|off|show|reset\t-- per-PC retired/cycles/stalls/misses, hot loops\n");
+	printf("pcprof callgrind <file>\t-- write the per-PC profile for KCachegrind (<file>.asm is the listing)\n");
+	printf("check on|off|status\t-- compare every retire against the functional model, stop on divergence\n");
+	printf("goto <cycle>\t-- seek to <cycle>, replaying from the nearest earlier snapshot\n");
+	printf("back <n>\t-- step back <n> cycles\n");
+	printf("snap <n>|off|show\t-- take a snapshot every <n> cycles (default %u) for goto/back\n", SNAP_INTERVAL);
+	printf("break <addr>\t-- stop when the instruction at <addr> is next to retire\n");
+	printf("watch r|w|rw <start> <end>\t-- stop after a load/store touches bytes <start>..<end>\n");
+	printf("blist\t-- list breakpoints and watchpoints\n");
+	printf("delete <n>|all\t-- remove breakpoint or watchpoint <n>\n");
+	printf("gdb <port>\t-- serve one GDB remote session on 127.0.0.1:<port>\n");
+	printf("unit show\t-- functional unit ops, occupancy, structural and HI/LO stalls\n");
+	printf("unit alu|mul|div <latency> <interval>\t-- set a unit's result latency and initiation interval\n");
+	printf("mmu on|off|show|flush\t-- translate through TLBs and an identity-mapped page table; TLB stats\n");
+	printf("mmu itlb|dtlb <entries> <ways>\t-- set a TLB's size and associativity\n");
+	printf("spm on|off|show\t-- scratchpad at 0x%08x, bypassing L1, with DMA registers at 0x%08x\n", SPM_BEGIN, DMA_REGS);
+	printf("spm size <bytes> | spm dma <bytes per cycle>\t-- set the scratchpad size or the DMA bandwidth\n");
+	printf("sb on|off|show\t-- buffer stores between MEM and L1, with forwarding and write-combining; stats\n");
+	printf("sb size <entries>\t-- set the store buffer depth (default 8)\n");
+	printf("l1\t-- show the L1 sets and ways (set at build time by L1_WAY_BITS)\n");
+	printf("linefill whole|cwf|off|show\t-- time L1 line fills beat by beat, whole line or critical word first with early restart\n");
+	printf("linefill first|beat <cycles>\t-- set the latency of a fill's first word (default 64) and of each further word (default 12)\n");
+	printf("fuse on|off|show\t-- issue LUI+ORI/ADDIU/load and SLT+BEQ/BNE pairs as one op; pair counts\n");
+	printf("fuse <pair> on|off\t-- enable or disable one pair kind\n");
+	printf("threads <n> rr|miss\t-- share the pipeline among <n> hardware threads, switching every cycle or on a D-cache miss\n");
+	printf("threads off|show\t-- back to one thread; per-thread IPC and throughput\n");
+	printf("interval <n> <file>|off|show\t-- every <n> cycles write IPC, hit rate and stalls to <file> (CSV) and a basic block vector to <file>.bb\n");
 	printf("?\t-- display help menu\n");
 	printf("forward\t Set/reset forwarding\n");
 	printf("quit\t-- exit the simulator\n\n");
@@ -59,15 +671,23 @@ void help()
 uint32_t mem_read_32(uint32_t address)
 {
 	int i;
+	uint32_t value = 0;
+	PROF_BEGIN(PROF_MEMORY);
 	for (i = 0; i < NUM_MEM_REGION; i++)
 	{
 		if ((address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end))
 		{
 			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset + 3] << 24) | (MEM_REGIONS[i].mem[offset + 2] << 16) | (MEM_REGIONS[i].mem[offset + 1] << 8) | (MEM_REGIONS[i].mem[offset + 0] << 0);
+			value = (MEM_REGIONS[i].mem[offset + 3] << 24) | (MEM_REGIONS[i].mem[offset + 2] << 16) | (MEM_REGIONS[i].mem[offset + 1] << 8) | (MEM_REGIONS[i].mem[offset + 0] << 0);
+			break;
 		}
 	}
-	return 0;
+	if (address - SPM_BEGIN < spm_window)
+	{
+		value = spm_read_word(address);
+	}
+	PROF_END(PROF_MEMORY);
+	return value;
 }
 
 /***************************************************************/
@@ -77,11 +697,17 @@ void mem_write_32(uint32_t address, uint32_t value)
 {
 	int i;
 	uint32_t offset;
+	PROF_BEGIN(PROF_MEMORY);
 	for (i = 0; i < NUM_MEM_REGION; i++)
 	{
 		if ((address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end))
 		{
 			offset = address - MEM_REGIONS[i].begin;
+			if (snap_saved[i] != NULL && !(snap_saved[i][offset >> SNAP_PAGE_BITS] & snap_saved[i][(offset + 3) >> SNAP_PAGE_BITS]))
+			{
+				snap_save_page(i, offset >> SNAP_PAGE_BITS);
+				snap_save_page(i, (offset + 3) >> SNAP_PAGE_BITS);
+			}
 
 			MEM_REGIONS[i].mem[offset + 3] = (value >> 24) & 0xFF;
 			MEM_REGIONS[i].mem[offset + 2] = (value >> 16) & 0xFF;
@@ -89,190 +715,4675 @@ void mem_write_32(uint32_t address, uint32_t value)
 			MEM_REGIONS[i].mem[offset + 0] = (value >> 0) & 0xFF;
 		}
 	}
+	if (address - SPM_BEGIN < spm_window)
+	{
+		spm_write_word(address, value);
+	}
+	if (address <= bb_hi && address + 3 >= bb_lo)
+	{
+		bb_invalidate(address); //store into decoded text
+	}
+	PROF_END(PROF_MEMORY);
+}
+
+/* Time an L1 access under linefill. A miss starts the fill of addr's line once the
+   bus is free; an access to the line still streaming in waits only if its word has
+   not arrived yet. */
+void fill_access(uint32_t addr, int miss)
+{
+	uint32_t word = (addr >> 2) & (FILL_WORDS - 1);
+	uint32_t ready;
+
+	if (miss)
+	{
+		if (fill_end > CYCLE_COUNT)
+		{
+			fill_bus_waits++;
+			if (fill_mode == FILL_CWF)
+			{
+				//the restart that let this miss come early is paid back here
+				fill_saved -= fill_end - CYCLE_COUNT < fill_saved ? fill_end - CYCLE_COUNT : fill_saved;
+			}
+		}
+		fill_start = fill_end > CYCLE_COUNT ? fill_end : CYCLE_COUNT;
+		fill_line = addr & 0xFFFFFFF0;
+		fill_crit = fill_mode == FILL_CWF ? word : 0;
+		fill_end = fill_start + fill_first + (FILL_WORDS - 1) * fill_beat;
+		fill_lines++;
+	}
+	else if ((addr & 0xFFFFFFF0) != fill_line)
+	{
+		return;
+	}
+	ready = fill_start + fill_first + ((word - fill_crit) & (FILL_WORDS - 1)) * fill_beat;
+	if (fill_mode == FILL_WHOLE)
+	{
+		ready = fill_end;
+	}
+	if (miss)
+	{
+		fill_saved += fill_end - ready;
+	}
+	else if (ready > CYCLE_COUNT)
+	{
+		fill_streaming++;
+		if (fill_mode == FILL_CWF)
+		{
+			fill_saved -= ready - CYCLE_COUNT < fill_saved ? ready - CYCLE_COUNT : fill_saved;
+		}
+	}
+	if (ready > CYCLE_COUNT)
+	{
+		fill_wait += ready - CYCLE_COUNT;
+		fill_wait_pc = MEM_WB.PC - 4;
+	}
+}
+
+#if L1_WAY_BITS < 0 || L1_WAY_BITS > CACHE_MAX_WAY_BITS
+#error "L1_WAY_BITS must be 0 (direct-mapped) to CACHE_MAX_WAY_BITS (fully associative)"
+#endif
+
+/* First block of addr's set in L1, and the tag addr's line has there; under threads
+   the tag also names the thread whose memory the line holds */
+static inline uint32_t cache_set(uint32_t addr)
+{
+	return ((addr >> 4) & ((NUM_CACHE_BLOCKS - 1) >> L1_WAY_BITS)) << L1_WAY_BITS;
+}
+
+static inline uint32_t cache_tag(uint32_t addr)
+{
+	return addr >> (8 - L1_WAY_BITS) | mt_space << MT_SPACE_SHIFT;
+}
+
+/* Way of a set of more than one that holds tag, as a block number, or
+   NUM_CACHE_BLOCKS. All ways are matched on tag and valid bit together, four
+   (eight with AVX2) at a time; lanes past a set of fewer than four ways are masked
+   off, as they belong to the next. */
+uint32_t cache_match(uint32_t set, uint32_t tag)
+{
+	uint32_t ways = 1 << L1_WAY_BITS, i;
+
+#if defined(__SSE2__)
+	int m;
+#if defined(__AVX2__)
+	if (ways >= 8)
+	{
+		__m256i key8 = _mm256_set1_epi32(tag), one8 = _mm256_set1_epi32(1);
+		for (i = 0; i < ways; i += 8)
+		{
+			m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(
+				_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(L1Cache.tag + set + i)), key8),
+				_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(L1Cache.valid + set + i)), one8))));
+			if (m != 0)
+			{
+				return set + i + __builtin_ctz(m);
+			}
+		}
+		return NUM_CACHE_BLOCKS;
+	}
+#endif
+	__m128i key4 = _mm_set1_epi32(tag), one4 = _mm_set1_epi32(1);
+	for (i = 0; i < ways; i += 4)
+	{
+		m = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(
+			_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(L1Cache.tag + set + i)), key4),
+			_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(L1Cache.valid + set + i)), one4))));
+		m &= ways < 4 ? (1 << ways) - 1 : 0xF;
+		if (m != 0)
+		{
+			return set + i + __builtin_ctz(m);
+		}
+	}
+	return NUM_CACHE_BLOCKS;
+#else
+	for (i = 0; i < ways; i++)
+	{
+		if (L1Cache.tag[set + i] == tag && L1Cache.valid[set + i] == 1)
+		{
+			return set + i;
+		}
+	}
+	return NUM_CACHE_BLOCKS;
+#endif
+}
+
+/* Block of L1 holding addr's line, or NUM_CACHE_BLOCKS */
+static inline uint32_t cache_find(uint32_t addr)
+{
+	uint32_t set = cache_set(addr), tag = cache_tag(addr);
+
+	if (L1_WAY_BITS != 0)
+	{
+		return cache_match(set, tag);
+	}
+	return L1Cache.tag[set] == tag && L1Cache.valid[set] == 1 ? set : NUM_CACHE_BLOCKS;
+}
+
+/* Bring addr's line into an invalid way of its set, else the least recently used one */
+uint32_t cache_fill(uint32_t addr)
+{
+	uint32_t ways = 1 << L1_WAY_BITS, set = cache_set(addr), block = set, i;
+
+	for (i = 0; i < ways; i++)
+	{
+		if (L1Cache.valid[set + i] != 1)
+		{
+			block = set + i;
+			break;
+		}
+		if (L1Cache.used[set + i] < L1Cache.used[block])
+		{
+			block = set + i;
+		}
+	}
+	L1Cache.tag[block] = cache_tag(addr);
+	//each cache block contains 4 words
+	//called mem_read_32 4 times with adequate addresses
+	L1Cache.words[block][0] = mem_read_32((addr & 0xFFFFFFF0));// read from memory
+	L1Cache.words[block][1] = mem_read_32((addr & 0xFFFFFFF0) + 0x04);
+	L1Cache.words[block][2] = mem_read_32((addr & 0xFFFFFFF0) + 0x08);
+	L1Cache.words[block][3] = mem_read_32((addr & 0xFFFFFFF0) + 0x0C);
+	L1Cache.valid[block] = 1;
+	L1Cache.used[block] = ++L1Cache.clock;
+	return block;
 }
 
 uint32_t cache_read_32(uint32_t addr)
 {
-	uint32_t index = (addr & 0x000000F0) >> 4;
-	uint32_t tag = (addr & 0xFFFFFF00) >> 8;
+	uint32_t block;
 	uint32_t offsetW = (addr & 0x0000000C) >> 2;
+	if (addr - SPM_BEGIN < spm_window) //the scratchpad answers in the MEM cycle, no L1 involved
+	{
+		spm_reads++;
+		return mem_read_32(addr & 0xFFFFFFFC);
+	}
+	PROF_BEGIN(PROF_CACHE);
+	block = cache_find(addr);
 	
 //cache miss 
-	if (L1Cache.blocks[index].tag != tag || L1Cache.blocks[index].valid != 1)// the tag field and tag bits don’t match, or the valid bit is 0
-	{
-		L1Cache.blocks[index].tag = tag;
-		//each cache block contains 4 words
-		//called mem_read_32 4 times with adequate addresses
-		L1Cache.blocks[index].words[0] = mem_read_32((addr & 0xFFFFFFF0));// read from memory
-		L1Cache.blocks[index].words[1] = mem_read_32((addr & 0xFFFFFFF0) + 0x04);
-		L1Cache.blocks[index].words[2] = mem_read_32((addr & 0xFFFFFFF0) + 0x08);
-		L1Cache.blocks[index].words[3] = mem_read_32((addr & 0xFFFFFFF0) + 0x0C);
-		L1Cache.blocks[index].valid = 1;
-		MISS_FLAG = 1;
+	if (block == NUM_CACHE_BLOCKS)// the tag field and tag bits don’t match, or the valid bit is 0
+	{
+		block = cache_fill(addr);
+		if (fill_mode != FILL_OFF)
+		{
+			fill_access(addr, 1);
+		}
+		else
+		{
+			MISS_FLAG = 1;
+		}
 		cache_misses++;
 	}
 		
 	else
 	{
 		cache_hits++;
+		if (L1_WAY_BITS != 0)
+		{
+			L1Cache.used[block] = ++L1Cache.clock;
+		}
+		if (fill_end > CYCLE_COUNT)
+		{
+			fill_access(addr, 0);
+		}
 	}
 
-	return L1Cache.blocks[index].words[offsetW];
+	PROF_END(PROF_CACHE);
+	return L1Cache.words[block][offsetW];
 }
 
-void cache_write_32(uint32_t addr, uint32_t new)
+/* Merge an SB/SH/SW into the word it lands in, at the store's byte or halfword lane */
+static inline uint32_t store_merge(uint32_t old, uint32_t new, uint32_t instruction, uint32_t addr)
 {
-	uint32_t index = (addr & 0x000000F0) >> 4;
-	uint32_t tag = (addr & 0xFFFFFF00) >> 8;
-	uint32_t offsetW = (addr & 0x0000000C) >> 2;
-	uint32_t data;
-	uint32_t instruction = (MEM_WB.IR & 0xFC000000) >> 26;
-	if (L1Cache.blocks[index].tag != tag || L1Cache.blocks[index].valid != 1)//the tag field and tag bits don’t match, or the valid bit is 0
-	{
-		L1Cache.blocks[index].tag = tag;
-		//called mem_read_32 4 times with adequate addresses
-		L1Cache.blocks[index].words[0] = mem_read_32((addr & 0xFFFFFFF0));// read from memory
-		L1Cache.blocks[index].words[1] = mem_read_32((addr & 0xFFFFFFF0) + 0x04);//content of this cache block will be replaced with the block
-		L1Cache.blocks[index].words[2] = mem_read_32((addr & 0xFFFFFFF0) + 0x08);
-		L1Cache.blocks[index].words[3] = mem_read_32((addr & 0xFFFFFFF0) + 0x0C);
-		L1Cache.blocks[index].valid = 1;
-		MISS_FLAG = 1;
-		cache_misses++;
-	}
-	else
-	{
-		cache_hits++;
-	}
+	uint32_t shift;
 
 	switch (instruction) // store instruction
 	{
 	case 0x28: //store byte SB
-		data = L1Cache.blocks[index].words[offsetW];// read the whole block from memory, update the required word of the given block
-		data = (data & 0xFFFFFF00) | (new & 0x000000FF);
-		break;
+		shift = (addr & 3) * 8;
+		return (old & ~(0xFFu << shift)) | ((new & 0x000000FF) << shift);
 	case 0x29: //SH
-		data = L1Cache.blocks[index].words[offsetW];// read from memory, update the required word of the given block
-		data = (data & 0xFFFF0000) | (new & 0x0000FFFF);
-		break;
+		shift = (addr & 2) * 8;
+		return (old & ~(0xFFFFu << shift)) | ((new & 0x0000FFFF) << shift);
 	case 0x2B: //SW
-		data = new;
-		break;
+		return new;
 	default:
-		data = 0x00;
-		break;
+		return 0x00;
 	}
-	L1Cache.blocks[index].words[offsetW] = data;//the whole block that contains new data should be placed in write buffer
-
-	// offset and store all those word
-	mem_write_32((addr & 0xFFFFFFF0), L1Cache.blocks[index].words[0]);
-	mem_write_32(((addr & 0xFFFFFFF0) + 0x04), L1Cache.blocks[index].words[1]);
-	mem_write_32(((addr & 0xFFFFFFF0) + 0x08), L1Cache.blocks[index].words[2]);
-	mem_write_32(((addr & 0xFFFFFFF0) + 0x0C), L1Cache.blocks[index].words[3]);
-}
-
-/***************************************************************/
-/* Execute one cycle                                                                                                              */
-/***************************************************************/
-void cycle()
-{
-	handle_pipeline();
-	CURRENT_STATE = NEXT_STATE;
-	CYCLE_COUNT++;
 }
 
-/***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
-/***************************************************************/
-void run(int num_cycles)
+void cache_write_32(uint32_t addr, uint32_t new)
 {
-	if (RUN_FLAG == FALSE)
+	uint32_t block;
+	uint32_t offsetW = (addr & 0x0000000C) >> 2;
+	uint32_t data;
+	uint32_t instruction = (MEM_WB.IR & 0xFC000000) >> 26;
+	if (addr - SPM_BEGIN < spm_window)
 	{
-		printf("Simulation Stopped\n\n");
+		data = mem_read_32(addr & 0xFFFFFFFC);
+		check_store_valid = 1;
+		check_store_addr = addr & 0xFFFFFFFC;
+		check_store_old = data;
+		check_store_word = store_merge(data, new, instruction, addr);
+		mem_write_32(addr & 0xFFFFFFFC, check_store_word);
+		spm_writes++;
 		return;
 	}
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i,j=1;
-	for (i = 0; i < num_cycles; i++)
+	PROF_BEGIN(PROF_CACHE);
+	block = cache_find(addr);
+	if (block == NUM_CACHE_BLOCKS)//the tag field and tag bits don’t match, or the valid bit is 0
 	{
-		if (MISS_FLAG == 1)
+		block = cache_fill(addr); //content of this cache block will be replaced with the block
+		if (fill_mode != FILL_OFF)
 		{
-			if(j < 100)
-			{
-				j++;
-				CYCLE_COUNT++;
-			}
-			else
-			{				
-				MISS_FLAG = 0;				
-			}			
+			fill_access(addr, 1);
 		}
 		else
-            if (RUN_FLAG == FALSE) {
-                printf("Simulation Stopped.\n\n");
-                break;
-                    }		
-		cycle();
+		{
+			MISS_FLAG = 1;
+		}
+		cache_misses++;
+	}
+	else
+	{
+		cache_hits++;
+		if (L1_WAY_BITS != 0)
+		{
+			L1Cache.used[block] = ++L1Cache.clock;
+		}
+		if (fill_end > CYCLE_COUNT)
+		{
+			fill_access(addr, 0);
+		}
 	}
+
+	data = store_merge(L1Cache.words[block][offsetW], new, instruction, addr);// update the required word of the given block
+	check_store_valid = 1;
+	check_store_addr = addr & 0xFFFFFFFC;
+	check_store_old = L1Cache.words[block][offsetW];
+	check_store_word = data;
+	L1Cache.words[block][offsetW] = data;//the whole block that contains new data should be placed in write buffer
+
+	// offset and store all those word
+	mem_write_32((addr & 0xFFFFFFF0), L1Cache.words[block][0]);
+	mem_write_32(((addr & 0xFFFFFFF0) + 0x04), L1Cache.words[block][1]);
+	mem_write_32(((addr & 0xFFFFFFF0) + 0x08), L1Cache.words[block][2]);
+	mem_write_32(((addr & 0xFFFFFFF0) + 0x0C), L1Cache.words[block][3]);
+	PROF_END(PROF_CACHE);
 }
 
-/***************************************************************/
-/* simulate to completion                                                                                               */
-/***************************************************************/
-void runAll()
+/* Drop the L1 line holding addr, if any, after memory changed behind the cache */
+void cache_invalidate(uint32_t addr)
 {
-	if (RUN_FLAG == FALSE)
+	uint32_t block = cache_find(addr);
+
+	if (block != NUM_CACHE_BLOCKS)
 	{
-		printf("Simulation Stopped.\n\n");
-		return;
+		L1Cache.valid[block] = 0;
 	}
+}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG)
+/* Host address of simulated addr and the bytes left in its region, or NULL if unmapped */
+uint8_t *mem_host_ptr(uint32_t addr, uint32_t *avail)
+{
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++)
 	{
-		cycle();
+		if (addr >= MEM_REGIONS[i].begin && addr <= MEM_REGIONS[i].end)
+		{
+			*avail = MEM_REGIONS[i].end - addr + 1;
+			return MEM_REGIONS[i].mem + (addr - MEM_REGIONS[i].begin);
+		}
 	}
-	printf("Simulation Finished.\n\n");
+	if (addr - SPM_BEGIN < (spm_window ? spm_size : 0))
+	{
+		*avail = spm_size - (addr - SPM_BEGIN);
+		return spm_mem + (addr - SPM_BEGIN);
+	}
+	return NULL;
 }
 
-void cacheDump()
+/* Copy len bytes out of simulated memory; returns how many were mapped */
+uint32_t mem_read_block(uint32_t addr, uint8_t *buf, uint32_t len)
 {
-	int i;
-	double prob;
-	prob = ((double)cache_misses / ((double)cache_misses + (double)cache_hits)) * 100;
+	uint32_t done = 0, avail, n;
+	uint8_t *p;
 
-	printf("------------Cache Content----------------\n");
-	printf("-----------------------------------------\n");
-	printf("Hitted Caches: %d\n", cache_misses);
-	printf("MIssed Caches: %d\n", cache_hits);
-	printf("Cache Hit probability: %0.2f%c\n", prob, 37);
-	printf("-----------------------------------------\n");
+	while (done < len && (p = mem_host_ptr(addr + done, &avail)) != NULL)
+	{
+		n = len - done < avail ? len - done : avail;
+		memcpy(buf + done, p, n);
+		done += n;
+	}
+	return done;
+}
 
-	printf("Block\tValid\tTag\tWord 1\t\tWord 2\t\tWord 3\t\tWord 4\n");
+/* Copy len bytes into simulated memory behind the simulation's back: the L1 lines,
+   decoded blocks and snapshots covering them are dropped. Returns how many were mapped. */
+uint32_t mem_write_block(uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+	uint32_t done = 0, avail, n, line;
+	uint8_t *p;
 
-	for (i = 0; i < 16; i++)
+	while (done < len && (p = mem_host_ptr(addr + done, &avail)) != NULL)
 	{
-		printf("[B%d]\t%d\t%x\t0x%08x\t0x%08x\t0x%08x\t0x%08x\n", i, L1Cache.blocks[i].valid, L1Cache.blocks[i].tag, L1Cache.blocks[i].words[0], L1Cache.blocks[i].words[1], L1Cache.blocks[i].words[2], L1Cache.blocks[i].words[3]);
+		n = len - done < avail ? len - done : avail;
+		memcpy(p, buf + done, n);
+		done += n;
 	}
-	printf("-----------------------------------------\n");
+	if (done == 0)
+	{
+		return 0;
+	}
+	for (line = addr & 0xFFFFFFF0; line - (addr & 0xFFFFFFF0) < done + (addr & 0xF); line += 16)
+	{
+		cache_invalidate(line);
+	}
+	if (addr <= bb_hi && addr + done - 1 >= bb_lo)
+	{
+		bb_flush();
+	}
+	snap_restart();
+	return done;
+}
+
+/***************************************************************/
+/* MMU: page table, TLBs and walks                             */
+/***************************************************************/
+void tlb_flush(TLB *t)
+{
+	uint32_t i;
+	for (i = 0; i < TLB_MAX_ENTRIES; i++)
+	{
+		t->e[i].vpn = TLB_NO_VPN;
+		t->e[i].used = 0;
+	}
+	t->last_vpn = TLB_NO_VPN;
+	t->clock = 0;
+}
+
+/* Identity-map every page of every memory region, and the scratchpad window */
+void mmu_build()
+{
+	static uint32_t pt[1 + MMU_PT_TABLES][1 << 10]; //directory, then second-level tables
+	uint32_t tables = 0, vpn, *pde, begin, end;
+	int i;
+
+	memset(pt, 0, sizeof(pt));
+	for (i = 0; i <= NUM_MEM_REGION; i++)
+	{
+		begin = i < NUM_MEM_REGION ? MEM_REGIONS[i].begin : SPM_BEGIN;
+		end = i < NUM_MEM_REGION ? MEM_REGIONS[i].end : SPM_BEGIN + SPM_WINDOW - 1;
+		for (vpn = begin >> MMU_PAGE_BITS; vpn <= end >> MMU_PAGE_BITS; vpn++)
+		{
+			pde = &pt[0][vpn >> 10];
+			if (!(*pde & MMU_PTE_VALID))
+			{
+				assert(tables < MMU_PT_TABLES);
+				*pde = (MMU_PT_BASE + (++tables << MMU_PAGE_BITS)) | MMU_PTE_VALID;
+			}
+			pt[(*pde - MMU_PT_BASE) >> MMU_PAGE_BITS][vpn & 0x3FF] = (vpn << MMU_PAGE_BITS) | MMU_PTE_VALID;
+		}
+	}
+	mem_write_block(MMU_PT_BASE, (const uint8_t *)pt, (1 + tables) << MMU_PAGE_BITS);
+}
+
+/* Read the PTE for vpn through the D-cache and charge the walk; 0 if a level is invalid */
+uint32_t mmu_walk(TLB *t, uint32_t vpn, uint32_t pc)
+{
+	uint32_t misses = cache_misses, miss_flag = MISS_FLAG, wait = fill_wait, reads = 1, cycles;
+	uint32_t pte = cache_read_32(MMU_PT_BASE + (vpn >> 10) * 4);
+
+	if (pte & MMU_PTE_VALID)
+	{
+		pte = cache_read_32((pte & ~((1 << MMU_PAGE_BITS) - 1)) + (vpn & 0x3FF) * 4);
+		reads++;
+	}
+	MISS_FLAG = miss_flag; //its misses are paid for here, not again by the D-cache miss penalty
+	fill_wait = wait;
+	cycles = reads * MMU_WALK_READ_CYCLES + (cache_misses - misses) * MMU_WALK_MISS_CYCLES;
+	t->walk_cycles += cycles;
+	mmu_wait += cycles;
+	mmu_walk_pc = pc;
+	return pte;
+}
+
+/* TLB miss on the last translation: look through vaddr's set, walk on a miss */
+uint32_t mmu_lookup(TLB *t, uint32_t vaddr, uint32_t pc)
+{
+	uint32_t vpn = vaddr >> MMU_PAGE_BITS, pte, i;
+	TLB_Entry *set = &t->e[(vpn & (t->entries / t->ways - 1)) * t->ways], *victim = set;
+
+	for (i = 0; i < t->ways && set[i].vpn != vpn; i++)
+	{
+		if (set[i].used < victim->used)
+		{
+			victim = &set[i];
+		}
+	}
+	if (i < t->ways)
+	{
+		t->hits++;
+		victim = &set[i];
+	}
+	else
+	{
+		t->misses++;
+		pte = mmu_walk(t, vpn, pc);
+		if (!(pte & MMU_PTE_VALID))
+		{
+			mmu_faults++;
+			RUN_FLAG = FALSE;
+			printf("Page fault: %s 0x%08x by the instruction at 0x%08x, simulation stopped\n\n",
+				   t == &itlb ? "fetch from" : "access to", vaddr, pc);
+			return MMU_FAULT_PADDR;
+		}
+		victim->vpn = vpn;
+		victim->pfn = pte >> MMU_PAGE_BITS;
+	}
+	victim->used = ++t->clock;
+	t->last_vpn = vpn;
+	t->last_pfn = victim->pfn;
+	return (victim->pfn << MMU_PAGE_BITS) | (vaddr & ((1 << MMU_PAGE_BITS) - 1));
+}
+
+/* Physical address of vaddr, for the instruction at pc */
+static inline uint32_t mmu_translate(TLB *t, uint32_t vaddr, uint32_t pc)
+{
+	if (vaddr >> MMU_PAGE_BITS == t->last_vpn)
+	{
+		t->hits++;
+		return (t->last_pfn << MMU_PAGE_BITS) | (vaddr & ((1 << MMU_PAGE_BITS) - 1));
+	}
+	return mmu_lookup(t, vaddr, pc);
+}
+
+void mmu_show()
+{
+	TLB *tlbs[2] = {&itlb, &dtlb};
+	const char *names[2] = {"I-TLB", "D-TLB"};
+	int i;
+
+	printf("MMU %s, page table at 0x%08x, %u page faults\n", mmu_enabled ? "on" : "off", MMU_PT_BASE, mmu_faults);
+	printf("[TLB]\t[Entries]\t[Ways]\t[Accesses]\t[Misses]\t[Miss rate]\t[Walk cycles]\n");
+	for (i = 0; i < 2; i++)
+	{
+		uint32_t accesses = tlbs[i]->hits + tlbs[i]->misses;
+		printf("%s\t%u\t\t%u\t%-10u\t%-10u\t%6.2f%%\t\t%u\n", names[i], tlbs[i]->entries, tlbs[i]->ways, accesses,
+			   tlbs[i]->misses, accesses ? 100.0 * tlbs[i]->misses / accesses : 0.0, tlbs[i]->walk_cycles);
+	}
+	printf("\n");
+}
+
+/* Empty both TLBs and zero their counters, e.g. after reset */
+void mmu_reset()
+{
+	TLB *tlbs[2] = {&itlb, &dtlb};
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		tlb_flush(tlbs[i]);
+		tlbs[i]->hits = 0;
+		tlbs[i]->misses = 0;
+		tlbs[i]->walk_cycles = 0;
+	}
+	mmu_wait = 0;
+	mmu_faults = 0;
+}
+
+/* mmu on|off|show|flush */
+void mmu_command(const char *arg)
+{
+	if (strcmp(arg, "show") == 0)
+	{
+		mmu_show();
+	}
+	else if (strcmp(arg, "flush") == 0)
+	{
+		tlb_flush(&itlb);
+		tlb_flush(&dtlb);
+		printf("TLBs flushed\n\n");
+	}
+	else if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+	{
+		mmu_enabled = arg[1] == 'n';
+		mmu_reset();
+		if (mmu_enabled)
+		{
+			mmu_build();
+		}
+		snap_restart();
+		printf("MMU %s\n\n", mmu_enabled ? "on, every region identity-mapped" : "off");
+	}
+	else
+	{
+		printf("Usage: mmu on|off|show|flush, or mmu itlb|dtlb <entries> <ways>\n\n");
+	}
+}
+
+/* mmu itlb|dtlb <entries> <ways> */
+void mmu_config(const char *name, uint32_t entries, uint32_t ways)
+{
+	TLB *t = strcmp(name, "itlb") == 0 ? &itlb : strcmp(name, "dtlb") == 0 ? &dtlb : NULL;
+
+	if (t == NULL || ways == 0 || entries == 0 || entries % ways != 0 || entries > TLB_MAX_ENTRIES ||
+		(entries / ways & (entries / ways - 1)) != 0)
+	{
+		printf("Usage: mmu itlb|dtlb <entries> <ways>, at most %d entries in a power-of-two number of sets\n\n",
+			   TLB_MAX_ENTRIES);
+		return;
+	}
+	t->entries = entries;
+	t->ways = ways;
+	tlb_flush(t);
+	snap_restart();
+	mmu_show();
+}
+
+/***************************************************************/
+/* Scratchpad and DMA engine                                   */
+/***************************************************************/
+/* Word at addr in the scratchpad window: scratchpad data past the configured size reads 0 */
+uint32_t spm_read_word(uint32_t addr)
+{
+	uint32_t offset = addr - SPM_BEGIN;
+
+	if (offset >= SPM_MAX_SIZE)
+	{
+		offset = (offset - SPM_MAX_SIZE) >> 2;
+		return offset == DMA_CTRL ? dma_left != 0 : dma_reg[offset];
+	}
+	if (offset + 3 >= spm_size)
+	{
+		return 0;
+	}
+	return (spm_mem[offset + 3] << 24) | (spm_mem[offset + 2] << 16) | (spm_mem[offset + 1] << 8) | spm_mem[offset];
+}
+
+/* Writing the control register (re)starts a transfer from the other three */
+void spm_write_word(uint32_t addr, uint32_t value)
+{
+	uint32_t offset = addr - SPM_BEGIN;
+
+	if (offset >= SPM_MAX_SIZE)
+	{
+		offset = (offset - SPM_MAX_SIZE) >> 2;
+		if (offset != DMA_CTRL)
+		{
+			dma_reg[offset] = value;
+		}
+		else if (value != 0)
+		{
+			dma_src = dma_reg[DMA_SRC] & 0xFFFFFFFC;
+			dma_dst = dma_reg[DMA_DST] & 0xFFFFFFFC;
+			dma_left = (dma_reg[DMA_LEN] + 3) & 0xFFFFFFFC;
+			dma_space = mt_space;
+			dma_transfers++;
+		}
+		return;
+	}
+	if (offset + 3 < spm_size)
+	{
+		spm_mem[offset + 3] = (value >> 24) & 0xFF;
+		spm_mem[offset + 2] = (value >> 16) & 0xFF;
+		spm_mem[offset + 1] = (value >> 8) & 0xFF;
+		spm_mem[offset + 0] = (value >> 0) & 0xFF;
+	}
+}
+
+/* One cycle of the running transfer; main-memory lines it writes are dropped from L1 */
+void dma_step()
+{
+	uint32_t n, space = mt_space;
+
+	dma_busy_cycles++;
+	mt_map(dma_space);
+	for (n = 0; n < dma_rate && dma_left != 0; n += 4)
+	{
+		mem_write_32(dma_dst, mem_read_32(dma_src));
+		cache_invalidate(dma_dst);
+		dma_src += 4;
+		dma_dst += 4;
+		dma_left -= 4;
+		dma_bytes += 4;
+	}
+	mt_map(space);
+}
+
+/* Clear the scratchpad and stop the DMA engine, e.g. after reset */
+void spm_reset()
+{
+	memset(spm_mem, 0, sizeof(spm_mem));
+	memset(dma_reg, 0, sizeof(dma_reg));
+	dma_left = 0;
+	spm_reads = 0;
+	spm_writes = 0;
+	dma_transfers = 0;
+	dma_bytes = 0;
+	dma_busy_cycles = 0;
+}
+
+void spm_show()
+{
+	printf("Scratchpad %s: %u bytes at 0x%08x, DMA registers at 0x%08x, %u bytes per cycle\n", spm_enabled ? "on" : "off",
+		   spm_size, SPM_BEGIN, DMA_REGS, dma_rate);
+	printf("Loads %u, stores %u (no L1 accesses)\n", spm_reads, spm_writes);
+	printf("DMA transfers %u, bytes %u, bus cycles %u (%.2f%% of %u), %u bytes still to copy\n\n", dma_transfers, dma_bytes,
+		   dma_busy_cycles, CYCLE_COUNT ? 100.0 * dma_busy_cycles / CYCLE_COUNT : 0.0, CYCLE_COUNT, dma_left);
+}
+
+/* spm on|off|show */
+void spm_command(const char *arg)
+{
+	if (strcmp(arg, "show") == 0)
+	{
+		spm_show();
+		return;
+	}
+	if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)
+	{
+		printf("Usage: spm on|off|show, spm size <bytes>, spm dma <bytes per cycle>\n\n");
+		return;
+	}
+	spm_enabled = arg[1] == 'n';
+	spm_window = spm_enabled ? SPM_WINDOW : 0;
+	dma_left = 0;
+	snap_restart();
+	spm_show();
+}
+
+/* spm size <bytes>, spm dma <bytes per cycle> */
+void spm_config(const char *name, uint32_t value)
+{
+	if (strcmp(name, "size") == 0 && value % 4 == 0 && value <= SPM_MAX_SIZE)
+	{
+		spm_size = value;
+	}
+	else if (strcmp(name, "dma") == 0 && value % 4 == 0 && value != 0)
+	{
+		dma_rate = value;
+	}
+	else
+	{
+		printf("Usage: spm size <bytes>, a multiple of 4 up to %u; spm dma <bytes per cycle>, a multiple of 4\n\n",
+			   SPM_MAX_SIZE);
+		return;
+	}
+	snap_restart();
+	spm_show();
+}
+
+/***************************************************************/
+/* Store buffer                                                */
+/***************************************************************/
+/* Write the entry's line back into L1, allocating it on a miss; returns the cycles that takes */
+uint32_t sb_fill(const SB_Entry *e)
+{
+	uint32_t line = e->line, space = mt_space;
+	uint32_t block, cycles = 1;
+
+	mt_map(e->space);
+	block = cache_find(line);
+
+	//memory already holds the buffered bytes, so the merged line is memory's copy
+	if (block == NUM_CACHE_BLOCKS)
+	{
+		cache_fill(line);
+		cycles = SB_MISS_CYCLES;
+		cache_misses++;
+		sb_drain_misses++;
+	}
+	else
+	{
+		L1Cache.words[block][0] = mem_read_32(line);
+		L1Cache.words[block][1] = mem_read_32(line + 0x04);
+		L1Cache.words[block][2] = mem_read_32(line + 0x08);
+		L1Cache.words[block][3] = mem_read_32(line + 0x0C);
+		L1Cache.used[block] = ++L1Cache.clock;
+		cache_hits++;
+	}
+	sb_drains++;
+	mt_map(space);
+	return cycles;
+}
+
+/* Drain the oldest n entries now; returns the cycles the pipeline waits for them */
+uint32_t sb_drain(uint32_t n)
+{
+	uint32_t cycles = 0;
+
+	for (; n > 0; n--)
+	{
+		cycles += sb_busy != 0 ? sb_busy : sb_fill(&sb[sb_head]);
+		sb_busy = 0;
+		sb_head = (sb_head + 1) % SB_MAX_ENTRIES;
+		sb_count--;
+	}
+	return cycles;
+}
+
+/* One pipeline cycle of draining the head entry */
+void sb_step()
+{
+	sb_occupancy += sb_count;
+	if (sb_busy == 0)
+	{
+		sb_busy = sb_fill(&sb[sb_head]);
+	}
+	if (--sb_busy == 0)
+	{
+		sb_head = (sb_head + 1) % SB_MAX_ENTRIES;
+		sb_count--;
+	}
+}
+
+/* A load in MEM while stores are buffered; bytes is its mask within the word */
+uint32_t sb_forward(uint32_t addr, uint32_t bytes)
+{
+	uint32_t line = addr & 0xFFFFFFF0;
+	uint32_t need = bytes << (addr & 0xF);
+	uint32_t covered = 0, last = 0, i;
+
+	for (i = 0; i < sb_count; i++)
+	{
+		if (sb[(sb_head + i) % SB_MAX_ENTRIES].line == line && sb[(sb_head + i) % SB_MAX_ENTRIES].space == mt_space)
+		{
+			covered |= sb[(sb_head + i) % SB_MAX_ENTRIES].mask;
+			last = i + 1;
+		}
+	}
+	if ((covered & need) == need)
+	{
+		sb_forwards++;
+		return mem_read_32(addr & 0xFFFFFFFC);
+	}
+	if ((covered & need) != 0)
+	{
+		sb_overlap_stalls++;
+		sb_wait += sb_drain(last);
+		sb_wait_pc = MEM_WB.PC - 4;
+	}
+	return cache_read_32(addr);
+}
+
+/* Loads in MEM go through here; only a non-empty buffer costs a search */
+static inline uint32_t sb_read_32(uint32_t addr, uint32_t bytes)
+{
+	return sb_count != 0 ? sb_forward(addr, bytes) : cache_read_32(addr);
+}
+
+/* SB/SH/SW in MEM with the buffer on; bytes is the store's mask at its lane's low byte */
+void sb_write_32(uint32_t addr, uint32_t value, uint32_t bytes)
+{
+	uint32_t line = addr & 0xFFFFFFF0;
+	uint32_t word = addr & 0xFFFFFFFC;
+	uint32_t shift = (addr & 3) * 8;
+	uint32_t bits = (bytes == 0xF ? 0xFFFFFFFF : bytes == 0x3 ? 0x0000FFFF : 0x000000FF) << shift;
+	uint32_t i, n;
+
+	if (addr - SPM_BEGIN < spm_window)
+	{
+		cache_write_32(addr, value);
+		return;
+	}
+	check_store_valid = 1;
+	check_store_addr = word;
+	check_store_old = mem_read_32(word);
+	check_store_word = (check_store_old & ~bits) | ((value << shift) & bits);
+	mem_write_32(word, check_store_word);
+	sb_stores++;
+
+	//the head's line is already on its way to L1 once it has started draining
+	for (i = sb_busy != 0; i < sb_count; i++)
+	{
+		n = (sb_head + i) % SB_MAX_ENTRIES;
+		if (sb[n].line == line && sb[n].space == mt_space)
+		{
+			sb[n].mask |= bytes << (addr & 0xF);
+			sb_combined++;
+			return;
+		}
+	}
+	if (sb_count == sb_size)
+	{
+		sb_full_stalls++;
+		sb_wait += sb_drain(1);
+		sb_wait_pc = MEM_WB.PC - 4;
+	}
+	n = (sb_head + sb_count) % SB_MAX_ENTRIES;
+	sb[n].line = line;
+	sb[n].mask = bytes << (addr & 0xF);
+	sb[n].space = mt_space;
+	sb_count++;
+	if (sb_count > sb_max_count)
+	{
+		sb_max_count = sb_count;
+	}
+}
+
+/* Empty the buffer and clear its counters, e.g. after reset */
+void sb_reset()
+{
+	sb_head = 0;
+	sb_count = 0;
+	sb_busy = 0;
+	sb_wait = 0;
+	sb_stores = 0;
+	sb_combined = 0;
+	sb_forwards = 0;
+	sb_drains = 0;
+	sb_drain_misses = 0;
+	sb_full_stalls = 0;
+	sb_overlap_stalls = 0;
+	sb_wait_cycles = 0;
+	sb_max_count = 0;
+	sb_occupancy = 0;
+}
+
+void sb_show()
+{
+	printf("Store buffer %s: %u entries of one L1 line, %u buffered now\n", sb_enabled ? "on" : "off", sb_size, sb_count);
+	printf("Stores %u, combined into a buffered line %u (%.1f%%), loads forwarded %u\n", sb_stores, sb_combined,
+		   sb_stores ? 100.0 * sb_combined / sb_stores : 0.0, sb_forwards);
+	printf("Lines drained %u, L1 misses among them %u\n", sb_drains, sb_drain_misses);
+	printf("Occupancy: average %.2f, peak %u\n", CYCLE_COUNT ? (double)sb_occupancy / CYCLE_COUNT : 0.0, sb_max_count);
+	printf("Stall cycles %u: %u stores found it full, %u loads partly overlapped a buffered store\n\n", sb_wait_cycles,
+		   sb_full_stalls, sb_overlap_stalls);
+}
+
+/* sb on|off|show */
+void sb_command(const char *arg)
+{
+	if (strcmp(arg, "show") == 0)
+	{
+		sb_show();
+		return;
+	}
+	if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)
+	{
+		printf("Usage: sb on|off|show, sb size <entries>\n\n");
+		return;
+	}
+	sb_drain(sb_count); //written back at once, so L1 is current without the buffer
+	sb_enabled = arg[1] == 'n';
+	snap_restart();
+	sb_show();
+}
+
+/* sb size <entries> */
+void sb_config(uint32_t entries)
+{
+	if (entries == 0 || entries > SB_MAX_ENTRIES)
+	{
+		printf("Usage: sb size <entries>, 1 to %d\n\n", SB_MAX_ENTRIES);
+		return;
+	}
+	sb_drain(sb_count);
+	sb_size = entries;
+	snap_restart();
+	sb_show();
+}
+
+/* l1: the L1 geometry, fixed at build time like the rest of mu-mips.h's cache shape */
+void l1_show()
+{
+	printf("L1: %d sets of %d ways; build with -DL1_WAY_BITS=<0..%d> for 1 to %d ways\n\n",
+		   NUM_CACHE_BLOCKS >> L1_WAY_BITS, 1 << L1_WAY_BITS, CACHE_MAX_WAY_BITS, NUM_CACHE_BLOCKS);
+}
+
+/* Forget the fill in flight and clear the counters, e.g. after reset */
+void fill_reset()
+{
+	fill_line = 0;
+	fill_start = 0;
+	fill_crit = 0;
+	fill_end = 0;
+	fill_wait = 0;
+	fill_lines = 0;
+	fill_streaming = 0;
+	fill_bus_waits = 0;
+	fill_wait_cycles = 0;
+	fill_saved = 0;
+}
+
+void fill_show()
+{
+	printf("Line fill %s: first word after %u cycles, then one every %u (%u for a whole line)\n",
+		   fill_mode == FILL_CWF ? "critical word first" : fill_mode == FILL_WHOLE ? "whole line" : "off",
+		   fill_first, fill_beat, fill_first + (FILL_WORDS - 1) * fill_beat);
+	printf("Lines filled %u, %u of them behind another fill; accesses that waited for a word still streaming in %u\n",
+		   fill_lines, fill_bus_waits, fill_streaming);
+	printf("Stall cycles %u, saved against whole-line fills %u (%.1f per line)\n\n", fill_wait_cycles, fill_saved,
+		   fill_lines ? (double)fill_saved / fill_lines : 0.0);
+}
+
+/* linefill whole|cwf|off|show */
+void fill_command(const char *arg)
+{
+	if (strcmp(arg, "show") == 0)
+	{
+		fill_show();
+		return;
+	}
+	if (strcmp(arg, "whole") != 0 && strcmp(arg, "cwf") != 0 && strcmp(arg, "off") != 0)
+	{
+		printf("Usage: linefill whole|cwf|off|show, linefill first|beat <cycles>\n\n");
+		return;
+	}
+	fill_mode = arg[0] == 'w' ? FILL_WHOLE : arg[0] == 'c' ? FILL_CWF : FILL_OFF;
+	fill_end = 0; //the fill in flight, if any, is not waited for
+	fill_wait = 0;
+	snap_restart();
+	fill_show();
+}
+
+/* linefill first|beat <cycles> */
+void fill_config(const char *arg, uint32_t cycles)
+{
+	if (strcmp(arg, "first") == 0 && cycles != 0)
+	{
+		fill_first = cycles;
+	}
+	else if (strcmp(arg, "beat") == 0)
+	{
+		fill_beat = cycles;
+	}
+	else
+	{
+		printf("Usage: linefill first <cycles> (at least 1), linefill beat <cycles>\n\n");
+		return;
+	}
+	snap_restart();
+	fill_show();
+}
+
+void fuse_show()
+{
+	uint32_t total = 0;
+	int i;
+
+	printf("Macro-op fusion %s\n", fuse_enabled ? "on" : "off");
+	printf("[Pair]\t\t[Fused]\t\t[Enabled]\n");
+	for (i = 0; i < FUSE_NUM; i++)
+	{
+		printf("%-10s\t%u\t\t%s\n", fuse_names[i], fuse_pairs[i], fuse_allowed[i] ? "yes" : "no");
+		total += fuse_pairs[i];
+	}
+	printf("Instructions retired in a pair %u of %u (%.1f%%), cycles saved %u\n\n", 2 * total, INSTRUCTION_COUNT,
+		   INSTRUCTION_COUNT ? 200.0 * total / INSTRUCTION_COUNT : 0.0, fuse_saved);
+}
+
+/* fuse on|off|show, fuse <pair> on|off */
+void fuse_command(const char *arg)
+{
+	char state[8];
+	int i;
+
+	if (strcmp(arg, "show") == 0)
+	{
+		fuse_show();
+		return;
+	}
+	if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+	{
+		fuse_enabled = arg[1] == 'n';
+		snap_restart();
+		fuse_show();
+		return;
+	}
+	for (i = 0; i < FUSE_NUM; i++)
+	{
+		if (strcmp(arg, fuse_names[i]) == 0 && scanf("%7s", state) == 1 && (strcmp(state, "on") == 0 || strcmp(state, "off") == 0))
+		{
+			fuse_allowed[i] = state[1] == 'n';
+			snap_restart();
+			fuse_show();
+			return;
+		}
+	}
+	printf("Usage: fuse on|off|show, fuse lui-ori|lui-addiu|lui-load|slt-branch on|off\n\n");
+}
+
+/***************************************************************/
+/* Pipeline trace recording                                    */
+/***************************************************************/
+void trace_flush()
+{
+	if (trace_fp != NULL && trace_used != 0)
+	{
+		fwrite(trace_buf, sizeof(Trace_Record), trace_used, trace_fp);
+	}
+	trace_used = 0;
+}
+
+void trace_emit(int kind, uint32_t seq, uint32_t pc, uint32_t ir, int cause)
+{
+	Trace_Record *r;
+
+	if (ir == 0)
+	{
+		return; //bubbles and NOPs never leave IF/ID, so they are not traced
+	}
+	PROF_BEGIN(PROF_STATS);
+	r = &trace_buf[trace_used++];
+
+	r->cycle = CYCLE_COUNT;
+	r->seq = seq;
+	r->pc = pc;
+	r->ir = ir;
+	r->kind = kind;
+	r->cause = cause;
+	r->pad[0] = 0;
+	r->pad[1] = 0;
+	if (trace_used == TRACE_BUFFER_RECORDS)
+	{
+		trace_flush();
+	}
+	PROF_END(PROF_STATS);
+}
+
+void trace_stop()
+{
+	if (trace_fp == NULL)
+	{
+		return;
+	}
+	trace_flush();
+	fclose(trace_fp);
+	trace_fp = NULL;
+	printf("Pipeline trace closed.\n");
+}
+
+void trace_start(const char *path)
+{
+	static int registered = 0;
+	uint32_t header[2] = {TRACE_MAGIC, sizeof(Trace_Record)};
+
+	if (!PIPE_TRACE)
+	{
+		printf("Pipeline tracing was compiled out (PIPE_TRACE=0).\n");
+		return;
+	}
+	trace_stop();
+	trace_fp = fopen(path, "wb");
+	if (trace_fp == NULL)
+	{
+		printf("Error: Can't open trace file %s\n", path);
+		return;
+	}
+	fwrite(header, sizeof(header), 1, trace_fp);
+	if (!registered)
+	{
+		atexit(trace_stop);
+		registered = 1;
+	}
+	printf("Tracing pipeline to %s\n", path);
+}
+
+/***************************************************************/
+/* Buffered writes on a background thread                      */
+/***************************************************************/
+void *aw_thread(void *arg)
+{
+	Async_Writer *w = arg;
+	uint32_t i;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;)
+	{
+		while (w->queued == 0 && !w->stop)
+		{
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->queued == 0)
+		{
+			break;
+		}
+		i = w->head;
+		pthread_mutex_unlock(&w->lock);
+		fwrite(w->buf + (size_t)i * AW_BUFFER_BYTES, 1, w->len[i], w->fp);
+		pthread_mutex_lock(&w->lock);
+		w->head = (w->head + 1) % AW_BUFFERS;
+		w->queued--;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+int aw_open(Async_Writer *w, const char *path)
+{
+	memset(w, 0, sizeof(*w));
+	w->fp = fopen(path, "w");
+	if (w->fp == NULL)
+	{
+		printf("Error: Can't open %s\n", path);
+		return 0;
+	}
+	w->buf = malloc((size_t)AW_BUFFERS * AW_BUFFER_BYTES);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (w->buf == NULL || pthread_create(&w->thread, NULL, aw_thread, w) != 0)
+	{
+		printf("Error: Can't start a writer for %s\n", path);
+		free(w->buf);
+		fclose(w->fp);
+		w->fp = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/* Queue the buffer being filled and move to the next one */
+void aw_submit(Async_Writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->queued++;
+	pthread_cond_signal(&w->cond);
+	if (w->queued == AW_BUFFERS)
+	{
+		w->waits++;
+		while (w->queued == AW_BUFFERS)
+		{
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+	}
+	w->len[(w->head + w->queued) % AW_BUFFERS] = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+void aw_write(Async_Writer *w, const char *data, uint32_t n)
+{
+	uint32_t i, room;
+
+	while (n != 0)
+	{
+		i = (w->head + w->queued) % AW_BUFFERS; //only the simulator changes queued upwards
+		room = AW_BUFFER_BYTES - w->len[i];
+		if (room == 0)
+		{
+			aw_submit(w);
+			continue;
+		}
+		room = n < room ? n : room;
+		memcpy(w->buf + (size_t)i * AW_BUFFER_BYTES + w->len[i], data, room);
+		w->len[i] += room;
+		w->bytes += room;
+		data += room;
+		n -= room;
+	}
+}
+
+void aw_close(Async_Writer *w)
+{
+	if (w->fp == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->len[(w->head + w->queued) % AW_BUFFERS] != 0)
+	{
+		w->queued++;
+	}
+	w->stop = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	fclose(w->fp);
+	free(w->buf);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	w->fp = NULL;
+}
+
+/***************************************************************/
+/* Interval statistics and basic block vectors                 */
+/***************************************************************/
+void bbv_add(uint32_t pc, uint32_t n)
+{
+	uint32_t h = (pc >> 2) * 2654435761u >> 20, probes; //BBV_SLOTS = 1 << 12
+
+	for (probes = 0; probes < BBV_SLOTS; probes++, h = (h + 1) & (BBV_SLOTS - 1))
+	{
+		if (bbv_pc[h] == pc)
+		{
+			bbv_count[h] += n;
+			return;
+		}
+		if (bbv_pc[h] == 0)
+		{
+			if (bbv_nused == BBV_SLOTS / 2)
+			{
+				break; //keep probes short; the rest of the interval's new blocks are lost
+			}
+			bbv_pc[h] = pc;
+			bbv_count[h] = n;
+			bbv_used[bbv_nused++] = h;
+			return;
+		}
+	}
+	bbv_lost += n;
+}
+
+/* WB retired the instruction at pc, n instructions if it carries a fused pair */
+void bbv_retire(uint32_t pc, uint32_t ir, uint32_t n)
+{
+	uint32_t op = ir >> 26;
+
+	if (bbv_start == 0)
+	{
+		bbv_start = pc;
+	}
+	bbv_len += n;
+	if ((op >= 0x01 && op <= 0x07) || (op == 0 && ((ir & 0x3F) == 0x08 || (ir & 0x3F) == 0x09)))
+	{
+		bbv_add(bbv_start, bbv_len);
+		bbv_start = 0;
+		bbv_len = 0;
+	}
+}
+
+/* Start counting a new interval at the current cycle */
+void interval_begin()
+{
+	uint32_t i;
+
+	for (i = 0; i < bbv_nused; i++)
+	{
+		bbv_pc[bbv_used[i]] = 0;
+	}
+	bbv_nused = 0;
+	interval_next = interval_len != 0 ? CYCLE_COUNT + interval_len : 0xFFFFFFFF;
+	interval_base.cycle = CYCLE_COUNT;
+	interval_base.instructions = INSTRUCTION_COUNT;
+	interval_base.cache_hits = cache_hits;
+	interval_base.cache_misses = cache_misses;
+	interval_base.branches = taken_branches;
+	memcpy(interval_base.cpi, cpi_cycles, sizeof(cpi_cycles));
+}
+
+/* Close the interval that ends now: one CSV row and one BBV line, unless a replay already wrote them */
+void interval_sample()
+{
+	char line[512];
+	uint32_t cycles = CYCLE_COUNT - interval_base.cycle, insts = INSTRUCTION_COUNT - interval_base.instructions;
+	uint32_t hits = cache_hits - interval_base.cache_hits, misses = cache_misses - interval_base.cache_misses;
+	uint32_t i, h;
+	int n;
+
+	PROF_BEGIN(PROF_STATS);
+	if (bbv_len != 0)
+	{
+		bbv_add(bbv_start, bbv_len); //a block still retiring counts in each interval it spans
+		bbv_len = 0;
+	}
+	if (interval_len != 0 && cycles != 0 && CYCLE_COUNT > interval_done)
+	{
+		n = snprintf(line, sizeof(line), "%u,%u,%u,%.4f,%.4f,%.4f", interval_base.cycle, cycles, insts,
+					 (double)insts / cycles, hits + misses ? (double)hits / (hits + misses) : 0.0,
+					 insts ? (double)(taken_branches - interval_base.branches) / insts : 0.0);
+		for (i = 0; i < CPI_NUM; i++)
+		{
+			n += snprintf(line + n, sizeof(line) - n, ",%u", cpi_cycles[i] - interval_base.cpi[i]);
+		}
+		line[n++] = '\n';
+		aw_write(&interval_csv, line, n);
+
+		aw_write(&interval_bbv, "T", 1);
+		for (i = 0; i < bbv_nused; i++)
+		{
+			h = bbv_used[i];
+			n = snprintf(line, sizeof(line), ":%u:%u ", ((bbv_pc[h] - MEM_TEXT_BEGIN) >> 2) + 1, bbv_count[h]);
+			aw_write(&interval_bbv, line, n);
+		}
+		aw_write(&interval_bbv, "\n", 1);
+		interval_done = CYCLE_COUNT;
+		interval_rows++;
+	}
+	interval_begin();
+	PROF_END(PROF_STATS);
+}
+
+void interval_show()
+{
+	if (interval_len == 0)
+	{
+		printf("Interval statistics off\n\n");
+		return;
+	}
+	printf("Interval statistics every %u cycles: %u rows, %llu bytes of CSV, %llu bytes of BBV\n", interval_len,
+		   interval_rows, (unsigned long long)interval_csv.bytes, (unsigned long long)interval_bbv.bytes);
+	printf("Writer waits %u, block instructions not in a vector %u\n\n", interval_csv.waits + interval_bbv.waits, bbv_lost);
+}
+
+void interval_stop()
+{
+	if (interval_len == 0)
+	{
+		return;
+	}
+	interval_sample(); //the partial interval since the last row
+	interval_show();
+	interval_len = 0;
+	interval_next = 0xFFFFFFFF;
+	aw_close(&interval_csv);
+	aw_close(&interval_bbv);
+}
+
+/* interval <cycles> <file> */
+void interval_start(uint32_t len, const char *path)
+{
+	static int registered = 0;
+	char bb_path[300], header[300];
+	uint32_t i;
+	int n;
+
+	if (len == 0)
+	{
+		printf("Usage: interval <cycles> <file> | interval off|show\n\n");
+		return;
+	}
+	interval_stop();
+	snprintf(bb_path, sizeof(bb_path), "%s.bb", path);
+	if (!aw_open(&interval_csv, path))
+	{
+		return;
+	}
+	if (!aw_open(&interval_bbv, bb_path))
+	{
+		aw_close(&interval_csv);
+		return;
+	}
+	n = snprintf(header, sizeof(header), "cycle,cycles,instructions,ipc,hit_rate,branch_rate");
+	for (i = 0; i < CPI_NUM; i++)
+	{
+		n += snprintf(header + n, sizeof(header) - n, ",%s", cpi_names[i]);
+	}
+	header[n++] = '\n';
+	aw_write(&interval_csv, header, n);
+	if (!registered)
+	{
+		atexit(interval_stop);
+		registered = 1;
+	}
+	interval_len = len;
+	interval_rows = 0;
+	interval_done = CYCLE_COUNT;
+	bbv_lost = 0;
+	bbv_start = 0;
+	bbv_len = 0;
+	interval_begin();
+	snap_restart();
+	printf("Writing interval statistics every %u cycles to %s and %s.bb\n\n", len, path, path);
+}
+
+/***************************************************************/
+/* Host wall-clock time in seconds                             */
+/***************************************************************/
+double host_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/***************************************************************/
+/* Apply the writes the stages logged during this cycle        */
+/***************************************************************/
+void state_commit()
+{
+	int i;
+	for (i = 0; i < state_log_used; i++)
+	{
+		*state_log[i].reg = state_log[i].value;
+	}
+	state_log_used = 0;
+}
+
+/* The stages take the options they test every cycle (forwarding, probes, MMU) as
+   constant arguments. Each combination gets its own cycle and run loop, built
+   after the stages with the tests folded away; sim_select() picks one. The stages
+   that touch registers also take the CPU_State to use: &CURRENT_STATE, except in
+   the multithreaded cycle, which passes the context of the stage's thread. */
+#define SIM_INLINE static inline __attribute__((always_inline))
+
+typedef struct Sim_Variant_Struct {
+	void (*cycle)();
+	uint32_t (*loop)(uint32_t steps, uint32_t until, int drain);
+} Sim_Variant;
+const Sim_Variant *sim_select();
+
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle()
+{
+	sim_select()->cycle();
+}
+
+/***************************************************************/
+/* One step of run(): a cycle, plus a penalty cycle while a    */
+/* D-cache miss is pending                                     */
+/***************************************************************/
+void sim_step()
+{
+	sim_select()->loop(1, UINT32_MAX, 1);
+}
+
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(int num_cycles)
+{
+	if (RUN_FLAG == FALSE)
+	{
+		printf("Simulation Stopped\n\n");
+		return;
+	}
+	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	uint32_t n = num_cycles > 0 ? num_cycles : 0;
+	double t0 = host_seconds();
+	brk_stop = 0;
+	if (sim_select()->loop(n, UINT32_MAX, 1) < n && !brk_stop)
+	{
+		printf("Simulation Stopped.\n\n");
+	}
+	SIM_HOST_SECONDS += host_seconds() - t0;
+}
+
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll()
+{
+	if (RUN_FLAG == FALSE)
+	{
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	double t0 = host_seconds();
+	brk_stop = 0;
+	while (RUN_FLAG && !brk_stop)
+	{
+		sim_select()->loop(UINT32_MAX, UINT32_MAX, 0);
+	}
+	SIM_HOST_SECONDS += host_seconds() - t0;
+	printf("Simulation Finished.\n\n");
+}
+
+/***************************************************************/
+/* Functional model: decode and execute one instruction         */
+/* architecturally (no pipeline timing). Used to fast-forward.  */
+/***************************************************************/
+enum
+{
+	FOP_NOP,
+	FOP_SLL, FOP_SRL, FOP_SRA, FOP_JR, FOP_JALR, FOP_SYSCALL,
+	FOP_MFHI, FOP_MTHI, FOP_MFLO, FOP_MTLO,
+	FOP_MULT, FOP_MULTU, FOP_DIV, FOP_DIVU,
+	FOP_ADD, FOP_ADDU, FOP_SUB, FOP_SUBU, FOP_AND, FOP_OR, FOP_XOR, FOP_NOR, FOP_SLT,
+	FOP_BLTZ, FOP_BGEZ, FOP_J, FOP_JAL, FOP_BEQ, FOP_BNE, FOP_BLEZ, FOP_BGTZ,
+	FOP_ADDI, FOP_ADDIU, FOP_SLTI, FOP_ANDI, FOP_ORI, FOP_XORI, FOP_LUI,
+	FOP_LB, FOP_LH, FOP_LW, FOP_SB, FOP_SH, FOP_SW,
+	FOP_INVALID
+};
+
+typedef struct Decoded_Inst_Struct {
+	uint32_t IR;
+	uint32_t imm; //already sign/zero extended; byte offset for branches, target for J/JAL
+	uint8_t op;   //one of FOP_*
+	uint8_t rs, rt, rd, sa;
+	uint8_t brk;  //a breakpoint is set here (block cache records only)
+} Decoded_Inst;
+
+typedef struct Func_Result_Struct {
+	int halt;           //SYSCALL reached
+	int store;          //a store was executed, the caller performs it
+	uint32_t store_addr; //word aligned
+	uint32_t store_data; //whole word after merging SB/SH
+} Func_Result;
+
+void decode_instruction(uint32_t instruction, Decoded_Inst *d)
+{
+	uint32_t opcode = (instruction & 0xFC000000) >> 26;
+	uint32_t funct = instruction & 0x0000003F;
+	uint32_t simm = (instruction & 0x8000) ? (instruction | 0xFFFF0000) : (instruction & 0x0000FFFF);
+
+	d->IR = instruction;
+	d->rs = (instruction & 0x03E00000) >> 21;
+	d->rt = (instruction & 0x001F0000) >> 16;
+	d->rd = (instruction & 0x0000F800) >> 11;
+	d->sa = (instruction & 0x000007C0) >> 6;
+	d->imm = simm;
+	d->op = FOP_INVALID;
+	d->brk = 0;
+
+	if (instruction == 0)
+	{
+		d->op = FOP_NOP;
+		return;
+	}
+	if (opcode == 0x00)
+	{
+		switch (funct)
+		{
+		case 0x00: d->op = FOP_SLL; break;
+		case 0x02: d->op = FOP_SRL; break;
+		case 0x03: d->op = FOP_SRA; break;
+		case 0x08: d->op = FOP_JR; break;
+		case 0x09: d->op = FOP_JALR; break;
+		case 0x0C: d->op = FOP_SYSCALL; break;
+		case 0x10: d->op = FOP_MFHI; break;
+		case 0x11: d->op = FOP_MTHI; break;
+		case 0x12: d->op = FOP_MFLO; break;
+		case 0x13: d->op = FOP_MTLO; break;
+		case 0x18: d->op = FOP_MULT; break;
+		case 0x19: d->op = FOP_MULTU; break;
+		case 0x1A: d->op = FOP_DIV; break;
+		case 0x1B: d->op = FOP_DIVU; break;
+		case 0x20: d->op = FOP_ADD; break;
+		case 0x21: d->op = FOP_ADDU; break;
+		case 0x22: d->op = FOP_SUB; break;
+		case 0x23: d->op = FOP_SUBU; break;
+		case 0x24: d->op = FOP_AND; break;
+		case 0x25: d->op = FOP_OR; break;
+		case 0x26: d->op = FOP_XOR; break;
+		case 0x27: d->op = FOP_NOR; break;
+		case 0x2A: d->op = FOP_SLT; break;
+		}
+		return;
+	}
+	switch (opcode)
+	{
+	case 0x01:
+		if (d->rt == 0)
+		{
+			d->op = FOP_BLTZ;
+		}
+		else if (d->rt == 1)
+		{
+			d->op = FOP_BGEZ;
+		}
+		d->imm = simm << 2;
+		break;
+	case 0x02: d->op = FOP_J; d->imm = (instruction & 0x03FFFFFF) << 2; break;
+	case 0x03: d->op = FOP_JAL; d->imm = (instruction & 0x03FFFFFF) << 2; break;
+	case 0x04: d->op = FOP_BEQ; d->imm = simm << 2; break;
+	case 0x05: d->op = FOP_BNE; d->imm = simm << 2; break;
+	case 0x06: d->op = FOP_BLEZ; d->imm = simm << 2; break;
+	case 0x07: d->op = FOP_BGTZ; d->imm = simm << 2; break;
+	case 0x08: d->op = FOP_ADDI; break;
+	case 0x09: d->op = FOP_ADDIU; break;
+	case 0x0A: d->op = FOP_SLTI; break;
+	case 0x0C: d->op = FOP_ANDI; d->imm = instruction & 0x0000FFFF; break;
+	case 0x0D: d->op = FOP_ORI; d->imm = instruction & 0x0000FFFF; break;
+	case 0x0E: d->op = FOP_XORI; d->imm = instruction & 0x0000FFFF; break;
+	case 0x0F: d->op = FOP_LUI; d->imm = (instruction & 0x0000FFFF) << 16; break;
+	case 0x20: d->op = FOP_LB; break;
+	case 0x21: d->op = FOP_LH; break;
+	case 0x23: d->op = FOP_LW; break;
+	case 0x28: d->op = FOP_SB; break;
+	case 0x29: d->op = FOP_SH; break;
+	case 0x2B: d->op = FOP_SW; break;
+	}
+}
+
+/* Execute a decoded instruction against state, which must have state->PC pointing at it.
+   Branch targets follow the pipeline's convention (relative to the branch, no delay slot).
+   Stores are not performed here; they are returned in res so the caller decides. */
+void func_execute(CPU_State *state, const Decoded_Inst *d, Func_Result *res)
+{
+	uint32_t *R = state->REGS;
+	uint32_t pc = state->PC;
+	uint32_t next = pc + 4;
+	uint32_t addr, word, shift;
+	uint64_t product;
+
+	res->halt = 0;
+	res->store = 0;
+
+	switch (d->op)
+	{
+	case FOP_NOP: break;
+	case FOP_SLL: R[d->rd] = R[d->rt] << d->sa; break;
+	case FOP_SRL: R[d->rd] = R[d->rt] >> d->sa; break;
+	case FOP_SRA: R[d->rd] = (uint32_t)((int32_t)R[d->rt] >> d->sa); break;
+	case FOP_JR: next = R[d->rs]; break;
+	case FOP_JALR: next = R[d->rs]; R[d->rd] = pc + 4; break;
+	case FOP_SYSCALL: res->halt = 1; break;
+	case FOP_MFHI: R[d->rd] = state->HI; break;
+	case FOP_MTHI: state->HI = R[d->rs]; break;
+	case FOP_MFLO: R[d->rd] = state->LO; break;
+	case FOP_MTLO: state->LO = R[d->rs]; break;
+	case FOP_MULT:
+		product = (uint64_t)((int64_t)(int32_t)R[d->rs] * (int64_t)(int32_t)R[d->rt]);
+		state->LO = product & 0xFFFFFFFF;
+		state->HI = product >> 32;
+		break;
+	case FOP_MULTU:
+		product = (uint64_t)R[d->rs] * (uint64_t)R[d->rt];
+		state->LO = product & 0xFFFFFFFF;
+		state->HI = product >> 32;
+		break;
+	case FOP_DIV:
+		if (R[d->rt] != 0)
+		{
+			state->LO = (int32_t)R[d->rs] / (int32_t)R[d->rt];
+			state->HI = (int32_t)R[d->rs] % (int32_t)R[d->rt];
+		}
+		break;
+	case FOP_DIVU:
+		if (R[d->rt] != 0)
+		{
+			state->LO = R[d->rs] / R[d->rt];
+			state->HI = R[d->rs] % R[d->rt];
+		}
+		break;
+	case FOP_ADD:
+	case FOP_ADDU: R[d->rd] = R[d->rs] + R[d->rt]; break;
+	case FOP_SUB:
+	case FOP_SUBU: R[d->rd] = R[d->rs] - R[d->rt]; break;
+	case FOP_AND: R[d->rd] = R[d->rs] & R[d->rt]; break;
+	case FOP_OR: R[d->rd] = R[d->rs] | R[d->rt]; break;
+	case FOP_XOR: R[d->rd] = R[d->rs] ^ R[d->rt]; break;
+	case FOP_NOR: R[d->rd] = ~(R[d->rs] | R[d->rt]); break;
+	case FOP_SLT: R[d->rd] = ((int32_t)R[d->rs] < (int32_t)R[d->rt]) ? 1 : 0; break;
+	case FOP_BLTZ: if ((int32_t)R[d->rs] < 0) next = pc + d->imm; break;
+	case FOP_BGEZ: if ((int32_t)R[d->rs] >= 0) next = pc + d->imm; break;
+	case FOP_J: next = ((pc + 4) & 0xF0000000) | d->imm; break;
+	case FOP_JAL: next = ((pc + 4) & 0xF0000000) | d->imm; R[31] = pc + 4; break;
+	case FOP_BEQ: if (R[d->rs] == R[d->rt]) next = pc + d->imm; break;
+	case FOP_BNE: if (R[d->rs] != R[d->rt]) next = pc + d->imm; break;
+	case FOP_BLEZ: if ((int32_t)R[d->rs] <= 0) next = pc + d->imm; break;
+	case FOP_BGTZ: if ((int32_t)R[d->rs] > 0) next = pc + d->imm; break;
+	case FOP_ADDI:
+	case FOP_ADDIU: R[d->rt] = R[d->rs] + d->imm; break;
+	case FOP_SLTI: R[d->rt] = ((int32_t)R[d->rs] < (int32_t)d->imm) ? 1 : 0; break;
+	case FOP_ANDI: R[d->rt] = R[d->rs] & d->imm; break;
+	case FOP_ORI: R[d->rt] = R[d->rs] | d->imm; break;
+	case FOP_XORI: R[d->rt] = R[d->rs] ^ d->imm; break;
+	case FOP_LUI: R[d->rt] = d->imm; break;
+	case FOP_LB:
+		addr = R[d->rs] + d->imm;
+		word = mem_read_32(addr & 0xFFFFFFFC) >> ((addr & 3) * 8);
+		R[d->rt] = (word & 0x80) ? (word | 0xFFFFFF00) : (word & 0x000000FF);
+		break;
+	case FOP_LH:
+		addr = R[d->rs] + d->imm;
+		word = mem_read_32(addr & 0xFFFFFFFC) >> ((addr & 2) * 8);
+		R[d->rt] = (word & 0x8000) ? (word | 0xFFFF0000) : (word & 0x0000FFFF);
+		break;
+	case FOP_LW:
+		R[d->rt] = mem_read_32(R[d->rs] + d->imm);
+		break;
+	case FOP_SB:
+		addr = R[d->rs] + d->imm;
+		shift = (addr & 3) * 8;
+		res->store = 1;
+		res->store_addr = addr & 0xFFFFFFFC;
+		res->store_data = (mem_read_32(res->store_addr) & ~(0xFF << shift)) | ((R[d->rt] & 0xFF) << shift);
+		break;
+	case FOP_SH:
+		addr = R[d->rs] + d->imm;
+		shift = (addr & 2) * 8;
+		res->store = 1;
+		res->store_addr = addr & 0xFFFFFFFC;
+		res->store_data = (mem_read_32(res->store_addr) & ~(0xFFFF << shift)) | ((R[d->rt] & 0xFFFF) << shift);
+		break;
+	case FOP_SW:
+		res->store = 1;
+		res->store_addr = R[d->rs] + d->imm;
+		res->store_data = R[d->rt];
+		break;
+	default:
+		printf("Instruction 0x%08x at 0x%08x is not implemented!\n", d->IR, pc);
+		break;
+	}
+	R[0] = 0;
+	state->PC = next;
+}
+
+/***************************************************************/
+/* Drop everything in flight and restart fetch at the oldest   */
+/* instruction that has not been written back yet.             */
+/***************************************************************/
+/* The oldest instruction not yet written back: the architectural PC */
+uint32_t pipeline_oldest_pc()
+{
+	if (MEM_WB.IR != 0)
+	{
+		return MEM_WB.PC - 4;
+	}
+	if (EX_MEM.IR != 0)
+	{
+		return EX_MEM.PC - 4;
+	}
+	if (ID_EX.IR != 0)
+	{
+		return ID_EX.PC - 4;
+	}
+	if (IF_ID.IR != 0)
+	{
+		return IF_ID.PC - 4;
+	}
+	return CURRENT_STATE.PC;
+}
+
+void pipeline_flush()
+{
+	uint32_t resume = pipeline_oldest_pc();
+
+	memset(&IF_ID, 0, sizeof(IF_ID));
+	memset(&ID_EX, 0, sizeof(ID_EX));
+	memset(&EX_MEM, 0, sizeof(EX_MEM));
+	memset(&MEM_WB, 0, sizeof(MEM_WB));
+	branch = 0;
+	EX_MEM_RegisterRd = 0;
+	MEM_WB_RegisterRd = 0;
+	ID_EX_cause = CPI_BASE;
+	EX_MEM_cause = CPI_BASE;
+	MEM_WB_cause = CPI_BASE;
+	ID_EX_blame = 0;
+	EX_MEM_blame = 0;
+	MEM_WB_blame = 0;
+	memset(&IF_ID_fuse, 0, sizeof(IF_ID_fuse));
+	memset(&ID_EX_fuse, 0, sizeof(ID_EX_fuse));
+	memset(&EX_MEM_fuse, 0, sizeof(EX_MEM_fuse));
+	memset(&MEM_WB_fuse, 0, sizeof(MEM_WB_fuse));
+
+	CURRENT_STATE.PC = resume;
+	state_log_used = 0;
+	redirect_valid = 0;
+	snap_restart(); //the state no longer follows from the snapshots
+}
+
+/***************************************************************/
+/* Lockstep checker: the functional model executes each        */
+/* instruction as WB retires it and must agree on the PC, the  */
+/* destination register, HI/LO and the stored word.            */
+/***************************************************************/
+#define CHECK_HISTORY 8
+
+CPU_State check_state; //reference architectural state
+uint32_t check_count = 0;
+uint32_t check_history[CHECK_HISTORY]; //PCs of the last retires, for the report
+
+/* Reference starts from the current architectural state; in-flight work is discarded */
+void check_start()
+{
+	pipeline_flush();
+	check_state = CURRENT_STATE;
+	check_count = 0;
+	check_enabled = 1;
+}
+
+void check_fail(uint32_t pc, uint32_t ir, const char *what, uint32_t pipeline, uint32_t reference)
+{
+	char text[64];
+	int i;
+
+	disassemble(ir, pc, text, sizeof(text));
+	printf("\nLockstep check FAILED after %u instructions, cycle %u\n", check_count, CYCLE_COUNT);
+	printf("  0x%08x: %s\n", pc, text);
+	printf("  %s: pipeline 0x%08x, reference 0x%08x\n", what, pipeline, reference);
+	printf("  previous retires:");
+	for (i = 1; i <= CHECK_HISTORY && i <= (int)check_count; i++)
+	{
+		printf(" 0x%08x", check_history[(check_count - i) % CHECK_HISTORY]);
+	}
+	printf("\nSimulation stopped; 'check on' resynchronizes the reference.\n\n");
+	check_enabled = 0;
+	RUN_FLAG = FALSE;
+}
+
+/* Called at the end of WB for every retired instruction */
+void check_retire()
+{
+	Decoded_Inst d;
+	Func_Result res;
+	uint32_t pc = MEM_WB.PC - 4;
+	uint32_t ir = MEM_WB.IR;
+	uint32_t *R = check_state.REGS;
+	uint32_t expected, mask, dest = 32;
+	char what[32];
+
+	if (pc != check_state.PC)
+	{
+		check_fail(pc, ir, "retired PC", pc, check_state.PC);
+		return;
+	}
+	if (MEM_WB_fuse.first != 0)
+	{
+		/* step the reference over the first of a fused pair; only slt-branch leaves
+		   its result in a register, a LUI's is overwritten by its partner */
+		decode_instruction(MEM_WB_fuse.first, &d);
+		func_execute(&check_state, &d, &res);
+		dest = d.op == FOP_SLT ? d.rd : d.rt;
+		if (MEM_WB_fuse.kind == FUSE_SLT_BRANCH && state_read(&CURRENT_STATE.REGS[dest]) != R[dest])
+		{
+			snprintf(what, sizeof(what), "$r%u", dest);
+			check_fail(pc, MEM_WB_fuse.first, what, state_read(&CURRENT_STATE.REGS[dest]), R[dest]);
+			return;
+		}
+		check_history[check_count % CHECK_HISTORY] = pc;
+		check_count++;
+		dest = 32;
+		pc += 4;
+		ir = MEM_WB_fuse.second;
+	}
+	decode_instruction(ir, &d);
+	expected = R[d.rs] + d.imm; //effective address, for sub-word stores
+	func_execute(&check_state, &d, &res);
+
+	switch (d.op)
+	{
+	case FOP_SLL: case FOP_SRL: case FOP_SRA: case FOP_JALR: case FOP_MFHI: case FOP_MFLO:
+	case FOP_ADD: case FOP_ADDU: case FOP_SUB: case FOP_SUBU: case FOP_AND: case FOP_OR:
+	case FOP_XOR: case FOP_NOR: case FOP_SLT:
+		dest = d.rd;
+		break;
+	case FOP_ADDI: case FOP_ADDIU: case FOP_SLTI: case FOP_ANDI: case FOP_ORI: case FOP_XORI:
+	case FOP_LUI: case FOP_LB: case FOP_LH: case FOP_LW:
+		dest = d.rt;
+		break;
+	case FOP_JAL:
+		dest = 31;
+		break;
+	}
+	if (dest < 32 && state_read(&CURRENT_STATE.REGS[dest]) != R[dest])
+	{
+		snprintf(what, sizeof(what), "$r%u", dest);
+		check_fail(pc, ir, what, state_read(&CURRENT_STATE.REGS[dest]), R[dest]);
+		return;
+	}
+	if (state_read(&CURRENT_STATE.HI) != check_state.HI)
+	{
+		check_fail(pc, ir, "HI", state_read(&CURRENT_STATE.HI), check_state.HI);
+		return;
+	}
+	if (state_read(&CURRENT_STATE.LO) != check_state.LO)
+	{
+		check_fail(pc, ir, "LO", state_read(&CURRENT_STATE.LO), check_state.LO);
+		return;
+	}
+	if (res.store != check_store_valid)
+	{
+		check_fail(pc, ir, res.store ? "missing store" : "unexpected store", check_store_addr, res.store_addr);
+		return;
+	}
+	if (res.store)
+	{
+		/* memory already holds the pipeline's store, so merge sub-word stores into the old word */
+		mask = d.op == FOP_SB ? 0xFFu << ((expected & 3) * 8) : d.op == FOP_SH ? 0xFFFFu << ((expected & 2) * 8) : 0xFFFFFFFFu;
+		expected = (check_store_old & ~mask) | (res.store_data & mask);
+		if (check_store_addr != (res.store_addr & 0xFFFFFFFC))
+		{
+			check_fail(pc, ir, "store address", check_store_addr, res.store_addr);
+			return;
+		}
+		if (check_store_word != expected)
+		{
+			check_fail(pc, ir, "stored word", check_store_word, expected);
+			return;
+		}
+	}
+	check_history[check_count % CHECK_HISTORY] = pc;
+	check_count++;
+}
+
+/***************************************************************/
+/* Basic-block cache: straight-line runs of text pre-decoded   */
+/* once, keyed by start PC and chained to their successors.    */
+/***************************************************************/
+#define BB_CACHE_SIZE 1024 //direct mapped on the start PC, power of two
+#define BB_MAX_INSTS 32
+
+typedef struct BB_Block_Struct {
+	uint32_t start; //PC of insts[0]
+	uint32_t count; //number of records, 0 marks a free entry
+	struct BB_Block_Struct *fallthrough; //block at start + 4 * count
+	struct BB_Block_Struct *taken;       //block last reached through the final branch
+	Decoded_Inst insts[BB_MAX_INSTS];   //the last one is a branch, jump or SYSCALL unless the block hit BB_MAX_INSTS
+} BB_Block;
+
+BB_Block bb_cache[BB_CACHE_SIZE];
+uint8_t *bb_text = NULL;
+uint32_t bb_text_begin = 0;
+uint32_t bb_text_last = 0; //address of the last whole word in the text region
+uint32_t bb_lo = 0xFFFFFFFF; //text range covered by decoded blocks, so stores elsewhere skip invalidation
+uint32_t bb_hi = 0;
+uint32_t bb_generation = 0; //bumped whenever blocks are dropped
+uint32_t bb_decoded = 0;
+uint32_t bb_chained = 0;
+
+/* IF stage cursor into the block being fetched */
+BB_Block *IF_block = NULL;
+uint32_t IF_block_start = 0;
+uint32_t IF_block_index = 0;
+uint32_t IF_block_generation = 0;
+
+int bb_ends_block(uint8_t op)
+{
+	return (op >= FOP_BLTZ && op <= FOP_BGTZ) || op == FOP_JR || op == FOP_JALR || op == FOP_SYSCALL;
+}
+
+/* Return the block starting at pc, decoding it if needed. NULL if pc is not in the text region. */
+BB_Block *bb_lookup(uint32_t pc)
+{
+	BB_Block *b = &bb_cache[(pc >> 2) & (BB_CACHE_SIZE - 1)];
+	uint32_t addr, count = 0;
+	int i;
+
+	if (b->count != 0 && b->start == pc)
+	{
+		return b;
+	}
+	if (bb_text == NULL)
+	{
+		for (i = 0; i < NUM_MEM_REGION; i++)
+		{
+			if (MEM_REGIONS[i].begin == MEM_TEXT_BEGIN)
+			{
+				bb_text = MEM_REGIONS[i].mem;
+				bb_text_begin = MEM_REGIONS[i].begin;
+				bb_text_last = MEM_REGIONS[i].end - 3;
+			}
+		}
+	}
+	if (bb_text == NULL || pc < bb_text_begin || pc > bb_text_last || (pc & 3) != 0)
+	{
+		return NULL;
+	}
+
+	b->start = pc;
+	b->fallthrough = NULL;
+	b->taken = NULL;
+	for (addr = pc; addr <= bb_text_last && count < BB_MAX_INSTS; addr += 4)
+	{
+		uint8_t *p = bb_text + (addr - bb_text_begin);
+		decode_instruction(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24), &b->insts[count]);
+		b->insts[count].brk = brk_at(addr);
+		count++;
+		if (bb_ends_block(b->insts[count - 1].op))
+		{
+			break;
+		}
+	}
+	b->count = count;
+	if (pc < bb_lo)
+	{
+		bb_lo = pc;
+	}
+	if (pc + 4 * count - 1 > bb_hi)
+	{
+		bb_hi = pc + 4 * count - 1;
+	}
+	bb_decoded++;
+	return b;
+}
+
+/* Follow the successor link of a finished block to pc, filling the link on first use. */
+BB_Block *bb_next(BB_Block *from, uint32_t pc)
+{
+	BB_Block **link;
+
+	if (from == NULL || from->count == 0)
+	{
+		return bb_lookup(pc);
+	}
+	link = (pc == from->start + 4 * from->count) ? &from->fallthrough : &from->taken;
+	if (*link != NULL && (*link)->start == pc && (*link)->count != 0)
+	{
+		bb_chained++;
+		return *link;
+	}
+	*link = bb_lookup(pc);
+	return *link;
+}
+
+/* A store hit decoded text: drop every block that contains the word */
+void bb_invalidate(uint32_t address)
+{
+	int i;
+	for (i = 0; i < BB_CACHE_SIZE; i++)
+	{
+		BB_Block *b = &bb_cache[i];
+		if (b->count != 0 && address + 3 >= b->start && address < b->start + 4 * b->count)
+		{
+			b->count = 0;
+		}
+	}
+	bb_generation++;
+	jit_invalidate(address);
+}
+
+void bb_flush()
+{
+	int i;
+	for (i = 0; i < BB_CACHE_SIZE; i++)
+	{
+		bb_cache[i].count = 0;
+	}
+	bb_lo = 0xFFFFFFFF;
+	bb_hi = 0;
+	bb_generation++;
+	jit_flush();
+}
+
+/* Instruction word at pc for the IF stage, walking the cached blocks instead of scanning MEM_REGIONS */
+uint32_t bb_fetch(uint32_t pc)
+{
+	BB_Block *b = IF_block;
+
+	if (b != NULL && IF_block_generation == bb_generation && b->start == IF_block_start)
+	{
+		if (IF_block_index < b->count && pc == IF_block_start + 4 * IF_block_index)
+		{
+			brk_armed |= b->insts[IF_block_index].brk;
+			return b->insts[IF_block_index++].IR; //next record of the current block
+		}
+		b = bb_next(b, pc);
+	}
+	else
+	{
+		b = bb_lookup(pc);
+	}
+
+	IF_block = b;
+	IF_block_generation = bb_generation;
+	if (b == NULL)
+	{
+		return mem_read_32(pc);
+	}
+	IF_block_start = b->start;
+	IF_block_index = 1;
+	brk_armed |= b->insts[0].brk;
+	return b->insts[0].IR;
+}
+
+/* After bb_fetch() returned the instruction at pc, fuse it with the next record of
+   its block if the two form an enabled pair: IF_ID.IR becomes the op that carries
+   the pair and IF_ID_fuse describes it. Returns non-zero if the pair was taken.
+   Fusion happens here at fetch, not in ID: the pair takes one fetch slot and IF
+   moves on by 8, so ID never sees the second instruction on its own. */
+int fuse_fetch(uint32_t pc, int mmu)
+{
+	const Decoded_Inst *x, *y;
+	uint32_t kind, dest;
+
+	if (IF_block == NULL || IF_block_index == 0 || IF_block_index >= IF_block->count)
+	{
+		return 0;
+	}
+	x = &IF_block->insts[IF_block_index - 1];
+	y = &IF_block->insts[IF_block_index];
+	if (y->brk || (mmu && ((pc + 4) & ((1 << MMU_PAGE_BITS) - 1)) == 0))
+	{
+		return 0;
+	}
+	if (x->op == FOP_LUI)
+	{
+		if (x->rt == 0 || y->rs != x->rt || y->rt != x->rt)
+		{
+			return 0;
+		}
+		switch (y->op)
+		{
+		case FOP_ORI: kind = FUSE_LUI_ORI; break;
+		case FOP_ADDIU: kind = FUSE_LUI_ADDIU; break;
+		case FOP_LB: case FOP_LH: case FOP_LW: kind = FUSE_LUI_LOAD; break;
+		default: return 0;
+		}
+		if (!fuse_allowed[kind])
+		{
+			return 0;
+		}
+		IF_ID_fuse.hi = x->imm;
+		IF_ID.IR = y->IR & ~0x03E00000; //rs is $0, EX supplies the LUI's result instead
+	}
+	else if (x->op == FOP_SLT || x->op == FOP_SLTI)
+	{
+		dest = x->op == FOP_SLT ? x->rd : x->rt;
+		if (dest == 0 || (y->op != FOP_BEQ && y->op != FOP_BNE) || !((y->rs == dest && y->rt == 0) || (y->rs == 0 && y->rt == dest)))
+		{
+			return 0;
+		}
+		kind = FUSE_SLT_BRANCH;
+		if (!fuse_allowed[kind])
+		{
+			return 0;
+		}
+		IF_ID_fuse.hi = 0;
+	}
+	else
+	{
+		return 0;
+	}
+	IF_ID_fuse.first = x->IR;
+	IF_ID_fuse.second = y->IR;
+	IF_ID_fuse.kind = kind;
+	IF_ID_fuse.raw = 0;
+	IF_block_index++;
+	return 1;
+}
+
+/* Execute one decoded instruction on CURRENT_STATE for fast-forward; returns non-zero on SYSCALL */
+int ff_execute(const Decoded_Inst *d)
+{
+	Func_Result res;
+	uint32_t pc = CURRENT_STATE.PC;
+	uint32_t addr = CURRENT_STATE.REGS[d->rs] + d->imm; //effective address of a load or store
+
+	func_execute(&CURRENT_STATE, d, &res);
+	if (res.store)
+	{
+		mem_write_32(res.store_addr, res.store_data);
+		cache_invalidate(res.store_addr);
+	}
+	if (watch_count != 0 && d->op >= FOP_LB && d->op <= FOP_SW && watch_page[addr >> WATCH_PAGE_BITS])
+	{
+		watch_check(pc, d->op >= FOP_SB ? BRK_WRITE : BRK_READ, addr, d->op == FOP_LB || d->op == FOP_SB ? 1 : d->op == FOP_LW || d->op == FOP_SW ? 4 : 2);
+	}
+	if (d->op != FOP_NOP)
+	{
+		INSTRUCTION_COUNT++;
+	}
+	if (dma_left != 0)
+	{
+		dma_step(); //a cycle per instruction without pipeline timing
+	}
+	return res.halt;
+}
+
+/***************************************************************/
+/* Fast-forward JIT: hot blocks of the block cache translated  */
+/* to x86-64, chained to each other in an executable cache.    */
+/***************************************************************/
+/* fast_forward() translates a block once it has entered it JIT_HOT times. Cold
+   blocks, blocks with a breakpoint and code outside the text region stay in the
+   interpreter, and so does all of fast-forward while a watchpoint is set, the
+   scratchpad is on or a DMA copy runs. Translated code keeps the MIPS registers
+   in CURRENT_STATE (rbx points at it), the instruction budget left in r12 and the
+   non-NOP count in r13; loads and stores call jit_load/jit_store. An exit to a
+   known PC is a jump to a stub that returns to fast_forward(), which points the
+   jump at the successor's code once that is translated. A store into a page with
+   translated code flushes the cache, and SYSCALL always returns so RUN_FLAG is
+   cleared outside. Build with -DFF_JIT=0 to keep only the interpreter. */
+#ifndef FF_JIT
+#define FF_JIT 1
+#endif
+#if FF_JIT && !(defined(__x86_64__) && defined(__linux__))
+#undef FF_JIT
+#define FF_JIT 0 //the translator emits x86-64 and maps its cache with mmap
+#endif
+
+int jit_enabled = 1;
+
+#if FF_JIT
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_MAX 4096 //bytes one block's translation may take, stubs included
+#define JIT_MAP_SIZE 4096  //direct mapped on the start PC, power of two
+#define JIT_HOT 16
+#define JIT_NEVER 0xFFFFFFFF //hits of a block that stays in the interpreter
+#define JIT_PAGE_BITS 12
+#define JIT_SLOW_INSTS 4096 //DIV/DIVU and unknown words, run through func_execute()
+
+enum
+{
+	JIT_EXIT_PC,  //CURRENT_STATE.PC holds the next instruction
+	JIT_EXIT_HALT //after a SYSCALL
+};
+
+/* x86-64 registers as numbered in ModRM */
+enum
+{
+	JIT_EAX = 0,
+	JIT_ECX = 1,
+	JIT_EDX = 2,
+	JIT_ESI = 6,
+	JIT_EDI = 7
+};
+
+#define JIT_REG(r) (uint32_t)(offsetof(CPU_State, REGS) + 4 * (r))
+#define JIT_HI (uint32_t)offsetof(CPU_State, HI)
+#define JIT_LO (uint32_t)offsetof(CPU_State, LO)
+#define JIT_PC (uint32_t)offsetof(CPU_State, PC)
+
+typedef struct Jit_Entry_Struct {
+	uint32_t pc;
+	uint32_t hits; //entries from the interpreter so far, or JIT_NEVER
+	uint8_t *code;
+} Jit_Entry;
+
+/* Written by the exit code, read by jit_run() */
+typedef struct Jit_Out_Struct {
+	uint32_t budget;  //instructions left of the budget (r12)
+	uint32_t retired; //non-NOP instructions (r13)
+	uint8_t *link;    //rel32 of the exit jump that left, NULL after a computed jump
+} Jit_Out;
+
+/* A jump to code at the end of the block that leaves to pc */
+typedef struct Jit_Stub_Struct {
+	uint8_t *site; //its rel32
+	uint32_t pc;
+	uint32_t refund; //instructions of the block not executed
+	uint32_t refund_retired;
+	int link; //pc is fixed, the jump may be chained
+} Jit_Stub;
+
+typedef uint32_t (*Jit_Enter)(CPU_State *state, const uint8_t *code, uint32_t budget);
+
+uint8_t *jit_cache = NULL;
+uint8_t *jit_start; //first byte after the entry and exit code
+uint8_t *jit_ptr;
+uint8_t *jit_exit;
+Jit_Enter jit_enter;
+Jit_Out jit_out;
+Jit_Entry jit_map[JIT_MAP_SIZE];
+uint8_t jit_page[((MEM_TEXT_END - MEM_TEXT_BEGIN) >> JIT_PAGE_BITS) + 1];
+Decoded_Inst jit_slow[JIT_SLOW_INSTS];
+uint32_t jit_slow_used = 0;
+Jit_Stub jit_stubs[BB_MAX_INSTS + 3];
+uint32_t jit_stub_count;
+uint32_t jit_generation = 0; //bumped by jit_flush()
+int jit_exit_request = 0;    //set by a flush, so the running block leaves after its store
+uint32_t jit_blocks = 0;
+uint32_t jit_links = 0;
+uint32_t jit_flushes = 0;
+uint64_t jit_insts = 0;
+
+static inline void jit_emit8(uint8_t b)
+{
+	*jit_ptr++ = b;
+}
+
+static inline void jit_emit32(uint32_t v)
+{
+	memcpy(jit_ptr, &v, 4);
+	jit_ptr += 4;
+}
+
+static inline void jit_emit64(uint64_t v)
+{
+	memcpy(jit_ptr, &v, 8);
+	jit_ptr += 8;
+}
+
+static inline void jit_set_rel32(uint8_t *site, const uint8_t *target)
+{
+	int32_t rel = (int32_t)(target - (site + 4));
+	memcpy(site, &rel, 4);
+}
+
+/* host = MIPS register r; $0 is read as zero */
+void jit_load_reg(int host, uint32_t r)
+{
+	if (r == 0)
+	{
+		jit_emit8(0x31); //xor host, host
+		jit_emit8(0xC0 | host << 3 | host);
+		return;
+	}
+	jit_emit8(0x8B); //mov host, [rbx + disp32]
+	jit_emit8(0x83 | host << 3);
+	jit_emit32(JIT_REG(r));
+}
+
+/* CPU_State field at disp = host */
+void jit_store_field(uint32_t disp, int host)
+{
+	jit_emit8(0x89); //mov [rbx + disp32], host
+	jit_emit8(0x83 | host << 3);
+	jit_emit32(disp);
+}
+
+void jit_store_reg(uint32_t r, int host)
+{
+	if (r != 0)
+	{
+		jit_store_field(JIT_REG(r), host);
+	}
+}
+
+void jit_store_imm(uint32_t disp, uint32_t value)
+{
+	jit_emit8(0xC7); //mov dword [rbx + disp32], imm32
+	jit_emit8(0x83);
+	jit_emit32(disp);
+	jit_emit32(value);
+}
+
+void jit_call(const void *fn)
+{
+	jit_emit8(0x48); //mov rax, imm64
+	jit_emit8(0xB8);
+	jit_emit64((uint64_t)(uintptr_t)fn);
+	jit_emit8(0xFF); //call rax
+	jit_emit8(0xD0);
+}
+
+/* Jump (opcode bytes op0 op1, op1 0 for a one-byte opcode) to a stub leaving for pc */
+void jit_stub_jump(uint8_t op0, uint8_t op1, uint32_t pc, uint32_t refund, uint32_t refund_retired, int link)
+{
+	Jit_Stub *s = &jit_stubs[jit_stub_count++];
+
+	jit_emit8(op0);
+	if (op1 != 0)
+	{
+		jit_emit8(op1);
+	}
+	s->site = jit_ptr;
+	s->pc = pc;
+	s->refund = refund;
+	s->refund_retired = refund_retired;
+	s->link = link;
+	jit_emit32(0);
+}
+
+/* Leave with eax = reason and rdx = 0 */
+void jit_leave(uint32_t reason)
+{
+	jit_emit8(0x31); //xor edx, edx
+	jit_emit8(0xD2);
+	if (reason == 0)
+	{
+		jit_emit8(0x31); //xor eax, eax
+		jit_emit8(0xC0);
+	}
+	else
+	{
+		jit_emit8(0xB8); //mov eax, imm32
+		jit_emit32(reason);
+	}
+	jit_emit8(0xE9); //jmp jit_exit
+	jit_emit32(0);
+	jit_set_rel32(jit_ptr - 4, jit_exit);
+}
+
+/* The stubs collected while translating a block */
+void jit_emit_stubs()
+{
+	uint32_t i;
+	Jit_Stub *s;
+
+	for (i = 0; i < jit_stub_count; i++)
+	{
+		s = &jit_stubs[i];
+		jit_set_rel32(s->site, jit_ptr);
+		if (s->refund != 0)
+		{
+			jit_emit8(0x41); //add r12d, imm32
+			jit_emit8(0x81);
+			jit_emit8(0xC4);
+			jit_emit32(s->refund);
+			jit_emit8(0x41); //sub r13d, imm32
+			jit_emit8(0x81);
+			jit_emit8(0xED);
+			jit_emit32(s->refund_retired);
+		}
+		jit_store_imm(JIT_PC, s->pc);
+		if (!s->link)
+		{
+			jit_leave(JIT_EXIT_PC);
+			continue;
+		}
+		jit_emit8(0x48); //mov rdx, imm64: the jump to patch
+		jit_emit8(0xBA);
+		jit_emit64((uint64_t)(uintptr_t)s->site);
+		jit_emit8(0x31); //xor eax, eax
+		jit_emit8(0xC0);
+		jit_emit8(0xE9); //jmp jit_exit
+		jit_emit32(0);
+		jit_set_rel32(jit_ptr - 4, jit_exit);
+	}
+}
+
+/* LB/LH/LW as func_execute() does them */
+uint32_t jit_load(uint32_t addr, uint32_t op)
+{
+	uint32_t word;
+
+	if (op == FOP_LW)
+	{
+		return mem_read_32(addr);
+	}
+	if (op == FOP_LB)
+	{
+		word = mem_read_32(addr & 0xFFFFFFFC) >> ((addr & 3) * 8);
+		return (word & 0x80) ? (word | 0xFFFFFF00) : (word & 0x000000FF);
+	}
+	word = mem_read_32(addr & 0xFFFFFFFC) >> ((addr & 2) * 8);
+	return (word & 0x8000) ? (word | 0xFFFF0000) : (word & 0x0000FFFF);
+}
+
+/* SB/SH/SW as ff_execute() does them; non-zero if the block has to leave */
+uint32_t jit_store(uint32_t addr, uint32_t value, uint32_t op)
+{
+	uint32_t shift;
+
+	if (op == FOP_SB)
+	{
+		shift = (addr & 3) * 8;
+		addr &= 0xFFFFFFFC;
+		value = (mem_read_32(addr) & ~(0xFFu << shift)) | ((value & 0xFF) << shift);
+	}
+	else if (op == FOP_SH)
+	{
+		shift = (addr & 2) * 8;
+		addr &= 0xFFFFFFFC;
+		value = (mem_read_32(addr) & ~(0xFFFFu << shift)) | ((value & 0xFFFF) << shift);
+	}
+	mem_write_32(addr, value);
+	cache_invalidate(addr);
+	return jit_exit_request;
+}
+
+/* Anything without its own translation */
+void jit_func(const Decoded_Inst *d)
+{
+	Func_Result res;
+	func_execute(&CURRENT_STATE, d, &res);
+}
+
+/* Drop every translation, e.g. after a store into translated text */
+void jit_flush()
+{
+	if (jit_cache == NULL)
+	{
+		return;
+	}
+	jit_ptr = jit_start;
+	memset(jit_map, 0, sizeof(jit_map));
+	memset(jit_page, 0, sizeof(jit_page));
+	jit_slow_used = 0;
+	jit_generation++;
+	jit_flushes++;
+	jit_exit_request = 1;
+}
+
+/* Called by bb_invalidate() for a store into decoded text. The word's bytes are in
+   one page unless address is unaligned (a misaligned SW, DMA or a debugger write),
+   so the pages of its first and last byte are checked. */
+void jit_invalidate(uint32_t address)
+{
+	uint32_t first = (address - MEM_TEXT_BEGIN) >> JIT_PAGE_BITS;
+	uint32_t last = (address + 3 - MEM_TEXT_BEGIN) >> JIT_PAGE_BITS;
+
+	if (jit_cache != NULL && first < sizeof(jit_page) && last < sizeof(jit_page) && (jit_page[first] | jit_page[last]))
+	{
+		jit_flush();
+	}
+}
+
+/* A breakpoint went away: blocks kept interpreted for holding one may translate
+   again. Any that still hold a breakpoint are marked again when they turn hot. */
+void jit_rearm()
+{
+	uint32_t i;
+
+	for (i = 0; i < JIT_MAP_SIZE; i++)
+	{
+		if (jit_map[i].hits == JIT_NEVER)
+		{
+			jit_map[i].hits = 0;
+		}
+	}
+}
+
+/* Map the cache and emit the entry and exit code at its start; 0 if mmap fails */
+int jit_init()
+{
+	void *p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	static const uint8_t enter[] = {
+		0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, //push rbx, rbp, r12-r15
+		0x48, 0x83, 0xEC, 0x08, //sub rsp, 8: calls from the blocks see rsp 16-byte aligned
+		0x48, 0x89, 0xFB,       //mov rbx, rdi
+		0x41, 0x89, 0xD4,       //mov r12d, edx
+		0x45, 0x31, 0xED,       //xor r13d, r13d
+		0xFF, 0xE6              //jmp rsi
+	};
+	static const uint8_t leave[] = {
+		0x45, 0x89, 0x26,       //mov [r14], r12d
+		0x45, 0x89, 0x6E, 0x04, //mov [r14 + 4], r13d
+		0x49, 0x89, 0x56, 0x08, //mov [r14 + 8], rdx
+		0x48, 0x83, 0xC4, 0x08, //add rsp, 8
+		0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, //pop r15-r12, rbp, rbx
+		0xC3                    //ret
+	};
+
+	if (p == MAP_FAILED)
+	{
+		return 0;
+	}
+	jit_cache = p;
+	jit_ptr = jit_cache;
+	memcpy(jit_ptr, enter, sizeof(enter));
+	jit_ptr += sizeof(enter);
+	jit_exit = jit_ptr;
+	jit_emit8(0x49); //mov r14, &jit_out
+	jit_emit8(0xBE);
+	jit_emit64((uint64_t)(uintptr_t)&jit_out);
+	memcpy(jit_ptr, leave, sizeof(leave));
+	jit_ptr += sizeof(leave);
+	jit_enter = (Jit_Enter)(uintptr_t)jit_cache;
+	jit_start = jit_ptr;
+	return 1;
+}
+
+/* rd = rs op rt, op one of the "op r/m32, r32" opcodes with eax, ecx */
+void jit_rr(uint8_t op, const Decoded_Inst *d)
+{
+	jit_load_reg(JIT_EAX, d->rs);
+	jit_load_reg(JIT_ECX, d->rt);
+	jit_emit8(op);
+	jit_emit8(0xC8);
+	if (d->op == FOP_NOR)
+	{
+		jit_emit8(0xF7); //not eax
+		jit_emit8(0xD0);
+	}
+	jit_store_reg(d->rd, JIT_EAX);
+}
+
+/* rt = rs op imm, op one of the "op eax, imm32" opcodes */
+void jit_ri(uint8_t op, const Decoded_Inst *d)
+{
+	jit_load_reg(JIT_EAX, d->rs);
+	jit_emit8(op);
+	jit_emit32(d->imm);
+	jit_store_reg(d->rt, JIT_EAX);
+}
+
+/* Translate block b; NULL if the cache has no room left even after a flush */
+uint8_t *jit_translate(const BB_Block *b)
+{
+	uint8_t *code;
+	uint32_t k, pc, retired = 0, after = 0, last_op;
+	const Decoded_Inst *d;
+
+	if (jit_cache + JIT_CODE_SIZE - jit_ptr < JIT_BLOCK_MAX || jit_slow_used + BB_MAX_INSTS > JIT_SLOW_INSTS)
+	{
+		jit_flush();
+	}
+	for (k = 0; k < b->count; k++)
+	{
+		retired += b->insts[k].op != FOP_NOP;
+	}
+	code = jit_ptr;
+	jit_stub_count = 0;
+
+	jit_emit8(0x41); //cmp r12d, count
+	jit_emit8(0x81);
+	jit_emit8(0xFC);
+	jit_emit32(b->count);
+	jit_stub_jump(0x0F, 0x82, b->start, 0, 0, 0); //jb: not enough budget for the whole block
+	jit_emit8(0x41); //sub r12d, count
+	jit_emit8(0x81);
+	jit_emit8(0xEC);
+	jit_emit32(b->count);
+	jit_emit8(0x41); //add r13d, retired
+	jit_emit8(0x81);
+	jit_emit8(0xC5);
+	jit_emit32(retired);
+
+	for (k = 0; k < b->count; k++)
+	{
+		d = &b->insts[k];
+		pc = b->start + 4 * k;
+		after += d->op != FOP_NOP;
+		switch (d->op)
+		{
+		case FOP_NOP:
+			break;
+		case FOP_SLL: case FOP_SRL: case FOP_SRA:
+			jit_load_reg(JIT_EAX, d->rt);
+			jit_emit8(0xC1); //shl/shr/sar eax, sa
+			jit_emit8(d->op == FOP_SLL ? 0xE0 : d->op == FOP_SRL ? 0xE8 : 0xF8);
+			jit_emit8(d->sa);
+			jit_store_reg(d->rd, JIT_EAX);
+			break;
+		case FOP_ADD: case FOP_ADDU: jit_rr(0x01, d); break;
+		case FOP_SUB: case FOP_SUBU: jit_rr(0x29, d); break;
+		case FOP_AND: jit_rr(0x21, d); break;
+		case FOP_OR: case FOP_NOR: jit_rr(0x09, d); break;
+		case FOP_XOR: jit_rr(0x31, d); break;
+		case FOP_ADDI: case FOP_ADDIU: jit_ri(0x05, d); break;
+		case FOP_ANDI: jit_ri(0x25, d); break;
+		case FOP_ORI: jit_ri(0x0D, d); break;
+		case FOP_XORI: jit_ri(0x35, d); break;
+		case FOP_SLT: case FOP_SLTI:
+			jit_load_reg(JIT_EAX, d->rs);
+			if (d->op == FOP_SLT)
+			{
+				jit_load_reg(JIT_ECX, d->rt);
+			}
+			jit_emit8(0x31); //xor edx, edx
+			jit_emit8(0xD2);
+			if (d->op == FOP_SLT)
+			{
+				jit_emit8(0x39); //cmp eax, ecx
+				jit_emit8(0xC8);
+			}
+			else
+			{
+				jit_emit8(0x3D); //cmp eax, imm32
+				jit_emit32(d->imm);
+			}
+			jit_emit8(0x0F); //setl dl
+			jit_emit8(0x9C);
+			jit_emit8(0xC2);
+			jit_store_reg(d->op == FOP_SLT ? d->rd : d->rt, JIT_EDX);
+			break;
+		case FOP_LUI:
+			if (d->rt != 0)
+			{
+				jit_store_imm(JIT_REG(d->rt), d->imm);
+			}
+			break;
+		case FOP_MFHI: case FOP_MFLO:
+			jit_emit8(0x8B); //mov eax, [rbx + HI/LO]
+			jit_emit8(0x83);
+			jit_emit32(d->op == FOP_MFHI ? JIT_HI : JIT_LO);
+			jit_store_reg(d->rd, JIT_EAX);
+			break;
+		case FOP_MTHI: case FOP_MTLO:
+			jit_load_reg(JIT_EAX, d->rs);
+			jit_store_field(d->op == FOP_MTHI ? JIT_HI : JIT_LO, JIT_EAX);
+			break;
+		case FOP_MULT: case FOP_MULTU:
+			jit_load_reg(JIT_EAX, d->rs);
+			jit_load_reg(JIT_ECX, d->rt);
+			jit_emit8(0xF7); //imul ecx / mul ecx: edx:eax = eax * ecx
+			jit_emit8(d->op == FOP_MULT ? 0xE9 : 0xE1);
+			jit_store_field(JIT_LO, JIT_EAX);
+			jit_store_field(JIT_HI, JIT_EDX);
+			break;
+		case FOP_LB: case FOP_LH: case FOP_LW:
+			jit_load_reg(JIT_EDI, d->rs);
+			jit_emit8(0x81); //add edi, imm32
+			jit_emit8(0xC7);
+			jit_emit32(d->imm);
+			jit_emit8(0xBE); //mov esi, op
+			jit_emit32(d->op);
+			jit_call(jit_load);
+			jit_store_reg(d->rt, JIT_EAX);
+			break;
+		case FOP_SB: case FOP_SH: case FOP_SW:
+			jit_load_reg(JIT_EDI, d->rs);
+			jit_emit8(0x81); //add edi, imm32
+			jit_emit8(0xC7);
+			jit_emit32(d->imm);
+			jit_load_reg(JIT_ESI, d->rt);
+			jit_emit8(0xBA); //mov edx, op
+			jit_emit32(d->op);
+			jit_call(jit_store);
+			jit_emit8(0x85); //test eax, eax
+			jit_emit8(0xC0);
+			jit_stub_jump(0x0F, 0x85, pc + 4, b->count - k - 1, retired - after, 0); //jnz: the cache was flushed
+			break;
+		case FOP_BEQ: case FOP_BNE:
+			jit_load_reg(JIT_EAX, d->rs);
+			jit_load_reg(JIT_ECX, d->rt);
+			jit_emit8(0x39); //cmp eax, ecx
+			jit_emit8(0xC8);
+			jit_stub_jump(0x0F, d->op == FOP_BEQ ? 0x84 : 0x85, pc + d->imm, 0, 0, 1); //je/jne
+			jit_stub_jump(0xE9, 0, pc + 4, 0, 0, 1);
+			break;
+		case FOP_BLTZ: case FOP_BGEZ: case FOP_BLEZ: case FOP_BGTZ:
+			jit_load_reg(JIT_EAX, d->rs);
+			jit_emit8(0x85); //test eax, eax
+			jit_emit8(0xC0);
+			jit_stub_jump(0x0F, d->op == FOP_BLTZ ? 0x88 : d->op == FOP_BGEZ ? 0x89 : d->op == FOP_BLEZ ? 0x8E : 0x8F,
+						  pc + d->imm, 0, 0, 1); //js/jns/jle/jg
+			jit_stub_jump(0xE9, 0, pc + 4, 0, 0, 1);
+			break;
+		case FOP_J: case FOP_JAL:
+			if (d->op == FOP_JAL)
+			{
+				jit_store_imm(JIT_REG(31), pc + 4);
+			}
+			jit_stub_jump(0xE9, 0, ((pc + 4) & 0xF0000000) | d->imm, 0, 0, 1);
+			break;
+		case FOP_JR: case FOP_JALR:
+			jit_load_reg(JIT_EAX, d->rs);
+			if (d->op == FOP_JALR && d->rd != 0)
+			{
+				jit_store_imm(JIT_REG(d->rd), pc + 4);
+			}
+			jit_store_field(JIT_PC, JIT_EAX);
+			jit_leave(JIT_EXIT_PC);
+			break;
+		case FOP_SYSCALL:
+			jit_store_imm(JIT_PC, pc + 4);
+			jit_leave(JIT_EXIT_HALT);
+			break;
+		default: //DIV, DIVU and words func_execute() reports as not implemented
+			jit_slow[jit_slow_used] = *d;
+			jit_store_imm(JIT_PC, pc);
+			jit_emit8(0x48); //mov rdi, imm64
+			jit_emit8(0xBF);
+			jit_emit64((uint64_t)(uintptr_t)&jit_slow[jit_slow_used++]);
+			jit_call(jit_func);
+			break;
+		}
+	}
+	last_op = b->insts[b->count - 1].op;
+	if (!bb_ends_block(last_op))
+	{
+		jit_stub_jump(0xE9, 0, b->start + 4 * b->count, 0, 0, 1); //the block stopped at BB_MAX_INSTS
+	}
+	jit_emit_stubs();
+
+	for (pc = b->start; pc < b->start + 4 * b->count; pc += 1 << JIT_PAGE_BITS)
+	{
+		jit_page[(pc - MEM_TEXT_BEGIN) >> JIT_PAGE_BITS] = 1;
+	}
+	jit_page[(b->start + 4 * b->count - 1 - MEM_TEXT_BEGIN) >> JIT_PAGE_BITS] = 1;
+	jit_blocks++;
+	return code;
+}
+
+/* Code for block b, translating it once it is hot; NULL while it runs interpreted */
+uint8_t *jit_lookup(const BB_Block *b)
+{
+	Jit_Entry *e = &jit_map[(b->start >> 2) & (JIT_MAP_SIZE - 1)];
+	uint32_t k;
+
+	if (e->pc == b->start && e->code != NULL)
+	{
+		return e->code;
+	}
+	if (e->pc != b->start)
+	{
+		e->pc = b->start;
+		e->hits = 0;
+		e->code = NULL;
+	}
+	if (e->hits == JIT_NEVER || ++e->hits < JIT_HOT)
+	{
+		return NULL;
+	}
+	if (jit_cache == NULL && !jit_init())
+	{
+		printf("JIT: cannot map an executable code cache, staying in the interpreter\n");
+		jit_enabled = 0;
+		return NULL;
+	}
+	for (k = 0; k < b->count; k++)
+	{
+		if (b->insts[k].brk)
+		{
+			e->hits = JIT_NEVER;
+			return NULL;
+		}
+	}
+	e->code = jit_translate(b);
+	e->pc = b->start; //jit_translate() may have flushed the map
+	e->hits = JIT_HOT;
+	return e->code;
+}
+
+/* Run translated code from code for at most budget instructions; returns how many ran */
+uint32_t jit_run(const uint8_t *code, uint32_t budget)
+{
+	uint32_t generation = jit_generation;
+	Jit_Entry *e;
+
+	CURRENT_STATE.REGS[0] = 0;
+	jit_exit_request = 0;
+	if (jit_enter(&CURRENT_STATE, code, budget) == JIT_EXIT_HALT)
+	{
+		RUN_FLAG = FALSE;
+	}
+	INSTRUCTION_COUNT += jit_out.retired;
+	jit_insts += budget - jit_out.budget;
+	if (jit_out.link != NULL && jit_generation == generation)
+	{
+		e = &jit_map[(CURRENT_STATE.PC >> 2) & (JIT_MAP_SIZE - 1)];
+		if (e->pc == CURRENT_STATE.PC && e->code != NULL)
+		{
+			jit_set_rel32(jit_out.link, e->code); //chain: the next time it jumps straight there
+			jit_links++;
+		}
+	}
+	return budget - jit_out.budget;
+}
+#else
+void jit_flush()
+{
+}
+
+void jit_invalidate(uint32_t address)
+{
+	(void)address;
+}
+
+void jit_rearm()
+{
+}
+#endif
+
+void jit_show()
+{
+#if FF_JIT
+	printf("JIT %s: %u blocks translated, %u KB of %u KB used, %u exits chained, %u flushes\n",
+		   jit_enabled ? "on" : "off", jit_blocks, jit_cache ? (uint32_t)(jit_ptr - jit_cache) >> 10 : 0,
+		   JIT_CODE_SIZE >> 10, jit_links, jit_flushes);
+	printf("Instructions run in translated code: %llu\n\n", (unsigned long long)jit_insts);
+#else
+	printf("The JIT is compiled out; rebuild with -DFF_JIT=1 on x86-64 Linux.\n\n");
+#endif
+}
+
+/* jit on|off|show */
+void jit_command(const char *arg)
+{
+	if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+	{
+		jit_enabled = arg[1] == 'n';
+	}
+	else if (strcmp(arg, "show") != 0)
+	{
+		printf("Usage: jit on|off|show\n\n");
+		return;
+	}
+	jit_show();
+}
+
+/***************************************************************/
+/* Execute up to n instructions functionally, a cached block   */
+/* at a time. L1Cache lines hit by stores are invalidated.     */
+/***************************************************************/
+void fast_forward(uint32_t n)
+{
+	Decoded_Inst d;
+	BB_Block *b = NULL;
+	uint32_t i = 0, k, generation;
+	uint32_t decoded = bb_decoded, chained = bb_chained;
+#if FF_JIT
+	uint64_t translated = jit_insts;
+	const uint8_t *code;
+#endif
+
+	if (RUN_FLAG == FALSE)
+	{
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	pipeline_flush();
+	printf("Fast-forwarding %u instructions from 0x%08x...\n\n", n, CURRENT_STATE.PC);
+	double t0 = host_seconds();
+	brk_stop = 0;
+
+	while (i < n && RUN_FLAG && !brk_stop)
+	{
+		b = bb_next(b, CURRENT_STATE.PC);
+		if (b == NULL)
+		{
+			//outside the text region, go through memory one instruction at a time
+			decode_instruction(mem_read_32(CURRENT_STATE.PC), &d);
+			i++;
+			if (ff_execute(&d))
+			{
+				RUN_FLAG = FALSE;
+			}
+			continue;
+		}
+#if FF_JIT
+		if (jit_enabled && n - i >= b->count && watch_count == 0 && !spm_enabled && dma_left == 0)
+		{
+			code = jit_lookup(b);
+			if (code != NULL)
+			{
+				i += jit_run(code, n - i);
+				b = NULL; //translated code may have left from any block
+				continue;
+			}
+		}
+#endif
+		generation = bb_generation;
+		for (k = 0; k < b->count && i < n && !brk_stop; k++)
+		{
+			if (b->insts[k].brk && i != 0 && brk_check(CURRENT_STATE.PC))
+			{
+				break; //stop before it executes
+			}
+			i++;
+			if (ff_execute(&b->insts[k]))
+			{
+				RUN_FLAG = FALSE;
+				break;
+			}
+			if (bb_generation != generation)
+			{
+				break; //the block rewrote itself, re-decode from the current PC
+			}
+		}
+	}
+	SIM_HOST_SECONDS += host_seconds() - t0;
+	check_state = CURRENT_STATE; //the reference continues from where fast-forward stopped
+
+	printf("Fast-forwarded %u instructions, PC = 0x%08x\n", i, CURRENT_STATE.PC);
+	printf("Block cache: %u blocks decoded, %u chained transitions\n", bb_decoded - decoded, bb_chained - chained);
+#if FF_JIT
+	printf("JIT: %llu instructions in translated code, %u blocks translated so far\n",
+		   (unsigned long long)(jit_insts - translated), jit_blocks);
+#endif
+	if (RUN_FLAG == FALSE)
+	{
+		printf("Simulation Finished.\n");
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Snapshot ring: every snap_interval cycles the registers,    */
+/* latches, cache and counters are copied; memory pages are    */
+/* copied on their first write after a snapshot. goto restores */
+/* the nearest earlier snapshot and re-executes forward.       */
+/***************************************************************/
+typedef struct Snap_Page_Struct {
+	struct Snap_Page_Struct *next;
+	int region;
+	uint8_t *mem; //the region's memory it came from, a thread's own under threads
+	uint32_t page;
+	uint8_t data[1 << SNAP_PAGE_BITS];
+} Snap_Page;
+
+/* Everything sim_step() reads or writes. The per-PC profile, host profile and
+   pipeline trace are observers and are not rewound. */
+#define SNAP_STATE(X)                                                                       \
+	X(CURRENT_STATE) X(IF_ID) X(ID_EX) X(EX_MEM) X(MEM_WB) X(L1Cache)                       \
+	X(INSTRUCTION_COUNT) X(CYCLE_COUNT) X(RUN_FLAG) X(ENABLE_FORWARDING)                   \
+	X(MISS_FLAG) X(miss_wait) X(cache_hits) X(cache_misses) X(cpi_cycles)                  \
+	X(EX_MEM_RegisterRd) X(MEM_WB_RegisterRd) X(EX_MEM_RegWrite) X(MEM_WB_RegWrite)        \
+	X(branch) X(EX_stall) X(MEM_stall)                                                      \
+	X(IF_stall) X(stallInstruction) X(redirect_pc) X(redirect_valid)                       \
+	X(ID_EX_cause) X(EX_MEM_cause) X(MEM_WB_cause) X(ID_EX_blame) X(EX_MEM_blame)          \
+	X(MEM_WB_blame) X(pcprof_miss_pc) X(check_state) X(check_count) X(check_history)       \
+	X(check_store_valid) X(check_store_addr) X(check_store_word) X(check_store_old)        \
+	X(fu) X(hilo_ready) X(hilo_stalls)                                                      \
+	X(mmu_enabled) X(itlb) X(dtlb) X(mmu_wait) X(mmu_walk_pc) X(mmu_faults)                \
+	X(spm_enabled) X(spm_size) X(spm_window) X(spm_mem) X(spm_reads) X(spm_writes)         \
+	X(dma_reg) X(dma_rate) X(dma_src) X(dma_dst) X(dma_left) X(dma_space) X(dma_transfers) \
+	X(dma_bytes) X(dma_busy_cycles)                                                        \
+	X(sb_enabled) X(sb_size) X(sb) X(sb_head) X(sb_count) X(sb_busy) X(sb_wait)           \
+	X(sb_wait_pc) X(sb_stores) X(sb_combined) X(sb_forwards) X(sb_drains)                  \
+	X(sb_drain_misses) X(sb_full_stalls) X(sb_overlap_stalls) X(sb_wait_cycles)            \
+	X(sb_max_count) X(sb_occupancy)                                                        \
+	X(fuse_enabled) X(fuse_allowed) X(fuse_pairs) X(fuse_saved) X(IF_ID_fuse)              \
+	X(ID_EX_fuse) X(EX_MEM_fuse) X(MEM_WB_fuse)                                            \
+	X(taken_branches) X(interval_next) X(interval_base) X(bbv_pc) X(bbv_count) X(bbv_used) \
+	X(bbv_nused) X(bbv_start) X(bbv_len) X(bbv_lost)                                       \
+	X(mt_threads) X(mt_policy) X(mt_ctx) X(mt_ready_at) X(mt_done) X(mt_retired)           \
+	X(mt_misses) X(mt_current) X(mt_switches) X(mt_idle) X(mt_start_cycle) X(IF_ID_tid)    \
+	X(ID_EX_tid) X(EX_MEM_tid) X(MEM_WB_tid)                                               \
+	X(fill_mode) X(fill_first) X(fill_beat) X(fill_line) X(fill_start) X(fill_crit)        \
+	X(fill_end) X(fill_wait) X(fill_wait_pc) X(fill_lines) X(fill_streaming)               \
+	X(fill_bus_waits) X(fill_wait_cycles) X(fill_saved)                                    \
+	X(trace_seq) X(IF_ID_seq) X(ID_EX_seq) X(EX_MEM_seq) X(MEM_WB_seq) X(ID_seen_seq)
+
+#define SNAP_MEMBER(v) __typeof__(v) v;
+#define SNAP_SAVE(v) memcpy(&snap->v, &v, sizeof(v));
+#define SNAP_LOAD(v) memcpy(&v, &snap->v, sizeof(v));
+
+typedef struct Snapshot_Struct {
+	SNAP_STATE(SNAP_MEMBER)
+	Snap_Page *undo; //old contents of the pages written after this snapshot was taken
+} Snapshot;
+
+Snapshot snap_ring[SNAP_RING];
+uint32_t snap_first = 0; //oldest snapshot
+uint32_t snap_count = 0;
+uint32_t snap_interval = SNAP_INTERVAL; //0 turns snapshots off
+uint32_t snap_pages_saved = 0;
+
+uint32_t snap_region_pages(int region)
+{
+	uint32_t size = MEM_REGIONS[region].end - MEM_REGIONS[region].begin + 1;
+	return ((size - 1) >> SNAP_PAGE_BITS) + 2; //one spare for a word straddling the end
+}
+
+void snap_free_undo(Snapshot *snap)
+{
+	while (snap->undo != NULL)
+	{
+		Snap_Page *p = snap->undo;
+		snap->undo = p->next;
+		free(p);
+		snap_pages_saved--;
+	}
+}
+
+/* Set every page's kept flag, in each thread's memory under threads; flags are
+   allocated on the first snapshot */
+void snap_mark(uint8_t kept)
+{
+	uint32_t space = mt_space, t;
+	int i;
+
+	for (t = 0; t == 0 || t < mt_threads; t++)
+	{
+		mt_map(t);
+		for (i = 0; i < NUM_MEM_REGION; i++)
+		{
+			if (snap_saved[i] == NULL && !kept)
+			{
+				snap_saved[i] = malloc(snap_region_pages(i));
+				assert(snap_saved[i] != NULL);
+			}
+			if (snap_saved[i] != NULL)
+			{
+				memset(snap_saved[i], kept, snap_region_pages(i));
+			}
+		}
+	}
+	mt_map(space);
+}
+
+/* No snapshots: mark every page as kept so mem_write_32 never calls in */
+void snap_restart()
+{
+	while (snap_count > 0)
+	{
+		snap_free_undo(&snap_ring[(snap_first + --snap_count) % SNAP_RING]);
+	}
+	snap_mark(1);
+	snap_next = snap_interval != 0 ? 0 : 0xFFFFFFFF;
+}
+
+/* First write to a page since the newest snapshot: keep its old contents there */
+void snap_save_page(int region, uint32_t page)
+{
+	uint32_t size = MEM_REGIONS[region].end - MEM_REGIONS[region].begin + 1;
+	uint32_t start = page << SNAP_PAGE_BITS;
+	Snapshot *snap = &snap_ring[(snap_first + snap_count - 1) % SNAP_RING];
+	Snap_Page *p;
+
+	if (snap_saved[region][page] || start >= size)
+	{
+		return;
+	}
+	p = malloc(sizeof(Snap_Page));
+	assert(p != NULL);
+	p->region = region;
+	p->mem = MEM_REGIONS[region].mem;
+	p->page = page;
+	memcpy(p->data, MEM_REGIONS[region].mem + start, size - start < sizeof(p->data) ? size - start : sizeof(p->data));
+	p->next = snap->undo;
+	snap->undo = p;
+	snap_saved[region][page] = 1;
+	snap_pages_saved++;
+}
+
+void snap_take()
+{
+	Snapshot *snap;
+
+	if (snap_interval == 0)
+	{
+		snap_next = 0xFFFFFFFF;
+		return;
+	}
+	if (snap_count == SNAP_RING)
+	{
+		snap_free_undo(&snap_ring[snap_first]); //only needed to get back to the oldest
+		snap_first = (snap_first + 1) % SNAP_RING;
+		snap_count--;
+	}
+	snap = &snap_ring[(snap_first + snap_count) % SNAP_RING];
+	snap_count++;
+	SNAP_STATE(SNAP_SAVE)
+	snap->undo = NULL;
+	snap_mark(0);
+	snap_next = CYCLE_COUNT + snap_interval;
+}
+
+/* Roll memory and state back to snapshot n (0 is the oldest); newer snapshots are dropped */
+void snap_restore(uint32_t n)
+{
+	Snapshot *snap;
+	Snap_Page *p;
+	uint32_t size;
+
+	for (;;)
+	{
+		snap = &snap_ring[(snap_first + snap_count - 1) % SNAP_RING];
+		for (p = snap->undo; p != NULL; p = p->next)
+		{
+			size = MEM_REGIONS[p->region].end - MEM_REGIONS[p->region].begin + 1 - (p->page << SNAP_PAGE_BITS);
+			memcpy(p->mem + (p->page << SNAP_PAGE_BITS), p->data, size < sizeof(p->data) ? size : sizeof(p->data));
+		}
+		snap_free_undo(snap);
+		if (snap_count == n + 1)
+		{
+			break; //snapshot n stays, now with nothing to undo
+		}
+		snap_count--;
+	}
+	SNAP_STATE(SNAP_LOAD)
+	state_log_used = 0;
+	snap_mark(0);
+	snap_next = CYCLE_COUNT + snap_interval;
+	bb_flush(); //text pages may have been rolled back
+}
+
+/* Seek to cycle target: back to the nearest snapshot if it is in the past, then run forward */
+void snap_goto(uint32_t target)
+{
+	uint32_t n;
+	double t0;
+
+	if (target < CYCLE_COUNT)
+	{
+		for (n = snap_count; n > 0 && snap_ring[(snap_first + n - 1) % SNAP_RING].CYCLE_COUNT > target; n--)
+		{
+		}
+		if (n == 0)
+		{
+			if (snap_count == 0)
+			{
+				printf("No snapshots to go back to.\n\n");
+			}
+			else
+			{
+				printf("Cycle %u is before the oldest snapshot (cycle %u).\n\n", target, snap_ring[snap_first].CYCLE_COUNT);
+			}
+			return;
+		}
+		snap_restore(n - 1);
+	}
+	t0 = host_seconds();
+	brk_ignore = 1;
+	brk_stop = 0;
+	sim_select()->loop(UINT32_MAX, target, 1);
+	brk_ignore = 0;
+	SIM_HOST_SECONDS += host_seconds() - t0;
+	printf("At cycle %u, PC = 0x%08x, %u instructions retired\n\n", CYCLE_COUNT, CURRENT_STATE.PC, INSTRUCTION_COUNT);
+}
+
+void snap_show()
+{
+	if (snap_interval == 0)
+	{
+		printf("Snapshots off\n\n");
+		return;
+	}
+	printf("Snapshot every %u cycles, %u of %u kept", snap_interval, snap_count, SNAP_RING);
+	if (snap_count > 0)
+	{
+		printf(" (cycles %u..%u)", snap_ring[snap_first].CYCLE_COUNT, snap_ring[(snap_first + snap_count - 1) % SNAP_RING].CYCLE_COUNT);
+	}
+	printf(", %u pages (%u KB) of memory saved\n\n", snap_pages_saved, snap_pages_saved << (SNAP_PAGE_BITS - 10));
+}
+
+/***************************************************************/
+/* Breakpoints and watchpoints                                 */
+/***************************************************************/
+typedef struct Break_Point_Struct {
+	int kind; //BRK_* bits, 0 for a free slot
+	uint32_t lo, hi; //PC, or the watched byte range
+	uint32_t hits;
+} Break_Point;
+
+Break_Point brk_points[BRK_MAX];
+uint32_t brk_count = 0; //PC breakpoints
+
+int brk_at(uint32_t pc)
+{
+	int i;
+	for (i = 0; i < BRK_MAX && brk_count != 0; i++)
+	{
+		if (brk_points[i].kind == BRK_EXEC && brk_points[i].lo == pc)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* pc is about to retire (pipeline) or execute (fast-forward); stop if it has a breakpoint */
+int brk_check(uint32_t pc)
+{
+	int i;
+	for (i = 0; i < BRK_MAX && !brk_ignore; i++)
+	{
+		if (brk_points[i].kind == BRK_EXEC && brk_points[i].lo == pc)
+		{
+			brk_points[i].hits++;
+			brk_hit_kind = BRK_EXEC;
+			printf("Breakpoint %d at 0x%08x, cycle %u, %u instructions retired\n", i + 1, pc, CYCLE_COUNT + 1, INSTRUCTION_COUNT);
+			brk_stop = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* A load or store of size bytes at addr touched a flagged page */
+void watch_check(uint32_t pc, int kind, uint32_t addr, uint32_t size)
+{
+	int i;
+	for (i = 0; i < BRK_MAX && !brk_ignore; i++)
+	{
+		Break_Point *w = &brk_points[i];
+		if ((w->kind & kind) && addr <= w->hi && addr + size - 1 >= w->lo)
+		{
+			w->hits++;
+			brk_hit_kind = w->kind;
+			brk_hit_addr = addr;
+			printf("Watchpoint %d: %s of 0x%08x by 0x%08x, word now 0x%08x, cycle %u\n", i + 1, kind == BRK_READ ? "read" : "write",
+				   addr, pc, mem_read_32(addr & 0xFFFFFFFC), CYCLE_COUNT + 1);
+			brk_stop = 1;
+		}
+	}
+}
+
+/* Recompute the page flags after a watchpoint change */
+void watch_rebuild()
+{
+	uint32_t page;
+	int i;
+
+	memset(watch_page, 0, sizeof(watch_page));
+	watch_count = 0;
+	for (i = 0; i < BRK_MAX; i++)
+	{
+		if (brk_points[i].kind & (BRK_READ | BRK_WRITE))
+		{
+			for (page = brk_points[i].lo >> WATCH_PAGE_BITS; page <= brk_points[i].hi >> WATCH_PAGE_BITS; page++)
+			{
+				watch_page[page] = 1;
+			}
+			watch_count++;
+		}
+	}
+}
+
+/* Returns the new point's slot, or -1 */
+int brk_add(int kind, uint32_t lo, uint32_t hi)
+{
+	int i;
+
+	if (lo > hi || (kind == BRK_EXEC && (lo & 3) != 0))
+	{
+		printf("Invalid address.\n\n");
+		return -1;
+	}
+	for (i = 0; i < BRK_MAX && brk_points[i].kind != 0; i++)
+	{
+	}
+	if (i == BRK_MAX)
+	{
+		printf("Too many breakpoints (%d).\n\n", BRK_MAX);
+		return -1;
+	}
+	brk_points[i].kind = kind;
+	brk_points[i].lo = lo;
+	brk_points[i].hi = hi;
+	brk_points[i].hits = 0;
+	if (kind == BRK_EXEC)
+	{
+		brk_count++;
+		bb_invalidate(lo); //re-decode with the flag set
+		printf("Breakpoint %d at 0x%08x\n\n", i + 1, lo);
+	}
+	else
+	{
+		watch_rebuild();
+		printf("Watchpoint %d on 0x%08x..0x%08x\n\n", i + 1, lo, hi);
+	}
+	return i;
+}
+
+/* Slot of the point with exactly this kind and range, or -1 */
+int brk_find(int kind, uint32_t lo, uint32_t hi)
+{
+	int i;
+	for (i = 0; i < BRK_MAX; i++)
+	{
+		if (brk_points[i].kind == kind && brk_points[i].lo == lo && brk_points[i].hi == hi)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Delete point n (1-based), or every point for n == 0 */
+void brk_delete(int n)
+{
+	int i;
+	for (i = 0; i < BRK_MAX; i++)
+	{
+		if ((n == 0 || n == i + 1) && brk_points[i].kind != 0)
+		{
+			if (brk_points[i].kind == BRK_EXEC)
+			{
+				brk_count--;
+				bb_invalidate(brk_points[i].lo);
+				jit_rearm();
+			}
+			brk_points[i].kind = 0;
+		}
+	}
+	if (brk_count == 0)
+	{
+		brk_armed = 0;
+	}
+	watch_rebuild();
+}
+
+void brk_list()
+{
+	const char *kinds[] = {"", "break", "watch r", "", "watch w", "", "watch rw"};
+	int i, any = 0;
+
+	for (i = 0; i < BRK_MAX; i++)
+	{
+		Break_Point *b = &brk_points[i];
+		if (b->kind == BRK_EXEC)
+		{
+			printf("%2d  %-8s 0x%08x             %u hits\n", i + 1, kinds[b->kind], b->lo, b->hits);
+		}
+		else if (b->kind != 0)
+		{
+			printf("%2d  %-8s 0x%08x..0x%08x %u hits\n", i + 1, kinds[b->kind], b->lo, b->hi, b->hits);
+		}
+		any |= b->kind;
+	}
+	printf(any ? "\n" : "No breakpoints or watchpoints.\n\n");
+}
+
+/***************************************************************/
+/* GDB remote serial protocol stub: `gdb <port>` waits for one */
+/* connection on 127.0.0.1 and serves it until gdb detaches.   */
+/* Registers follow gdb's mips32 order (GPRs, sr, lo, hi, bad, */
+/* cause, pc). The reported PC is the oldest instruction in    */
+/* flight, so after a stop it is the next one to retire.       */
+/***************************************************************/
+#define GDB_PACKET_SIZE 0x4000
+#define GDB_NUM_REGS 38
+#define GDB_POLL_STEPS 65536 //steps between looks for a ^C from gdb while running
+
+int gdb_fd = -1;
+int gdb_ack = 1; //cleared by QStartNoAckMode
+uint8_t gdb_in[4096];
+int gdb_in_used = 0;
+int gdb_in_pos = 0;
+char gdb_packet[GDB_PACKET_SIZE + 1];
+char gdb_reply[2 * GDB_PACKET_SIZE + 1];
+uint8_t gdb_mem[GDB_PACKET_SIZE];
+
+int gdb_getc()
+{
+	if (gdb_in_pos == gdb_in_used)
+	{
+		gdb_in_used = recv(gdb_fd, gdb_in, sizeof(gdb_in), 0);
+		gdb_in_pos = 0;
+		if (gdb_in_used <= 0)
+		{
+			gdb_in_used = 0;
+			return -1;
+		}
+	}
+	return gdb_in[gdb_in_pos++];
+}
+
+int gdb_hex(int c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* Read the next packet into gdb_packet, unescaped; returns its length, or -1 once gdb is gone */
+int gdb_read_packet()
+{
+	int c, len, sum, check;
+
+	for (;;)
+	{
+		do
+		{
+			c = gdb_getc(); //skips acks and stray ^C
+		} while (c >= 0 && c != '$');
+		len = 0;
+		sum = 0;
+		while ((c = gdb_getc()) >= 0 && c != '#')
+		{
+			sum += c;
+			if (c == '}')
+			{
+				c = gdb_getc();
+				sum += c;
+				c ^= 0x20;
+			}
+			if (len < GDB_PACKET_SIZE)
+			{
+				gdb_packet[len++] = c;
+			}
+		}
+		if (c < 0)
+		{
+			return -1;
+		}
+		check = gdb_hex(gdb_getc()) << 4;
+		check |= gdb_hex(gdb_getc());
+		if (!gdb_ack || check == (sum & 0xFF))
+		{
+			break;
+		}
+		send(gdb_fd, "-", 1, MSG_NOSIGNAL);
+	}
+	if (gdb_ack)
+	{
+		send(gdb_fd, "+", 1, MSG_NOSIGNAL);
+	}
+	gdb_packet[len] = 0;
+	return len;
+}
+
+void gdb_send(const char *data)
+{
+	static char frame[sizeof(gdb_reply) + 4];
+	uint32_t sum = 0;
+	int len = strlen(data), i;
+
+	frame[0] = '$';
+	for (i = 0; i < len; i++)
+	{
+		frame[i + 1] = data[i];
+		sum += (uint8_t)data[i];
+	}
+	sprintf(frame + len + 1, "#%02x", sum & 0xFF);
+	send(gdb_fd, frame, len + 4, MSG_NOSIGNAL);
+}
+
+/* Registers travel as target-order (little-endian) hex */
+void gdb_put_word(char *out, uint32_t value)
+{
+	sprintf(out, "%02x%02x%02x%02x", value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24);
+}
+
+uint32_t gdb_get_word(const char *in)
+{
+	uint32_t value = 0;
+	int i;
+	for (i = 0; i < 4; i++)
+	{
+		value |= (uint32_t)((gdb_hex(in[2 * i]) << 4) | gdb_hex(in[2 * i + 1])) << (8 * i);
+	}
+	return value;
+}
+
+uint32_t gdb_get_reg(int n)
+{
+	if (n < 32)
+	{
+		return CURRENT_STATE.REGS[n];
+	}
+	switch (n)
+	{
+	case 33:
+		return CURRENT_STATE.LO;
+	case 34:
+		return CURRENT_STATE.HI;
+	case 37:
+		return pipeline_oldest_pc();
+	}
+	return 0; //sr, badvaddr and cause are not modelled
+}
+
+/* Instructions in flight have read the old values, so restart them first */
+void gdb_set_reg(int n, uint32_t value)
+{
+	pipeline_flush();
+	if (n > 0 && n < 32)
+	{
+		CURRENT_STATE.REGS[n] = value;
+	}
+	else if (n == 33)
+	{
+		CURRENT_STATE.LO = value;
+	}
+	else if (n == 34)
+	{
+		CURRENT_STATE.HI = value;
+	}
+	else if (n == 37)
+	{
+		CURRENT_STATE.PC = value;
+	}
+	check_state = CURRENT_STATE;
+}
+
+void gdb_stop_reply(int signal)
+{
+	if (RUN_FLAG == FALSE && MISS_FLAG != 1)
+	{
+		gdb_send("W00");
+	}
+	else if (signal == 5 && (brk_hit_kind & (BRK_READ | BRK_WRITE)) != 0)
+	{
+		sprintf(gdb_reply, "T05%swatch:%08x;", brk_hit_kind == BRK_WRITE ? "" : brk_hit_kind == BRK_READ ? "r" : "a", brk_hit_addr);
+		gdb_send(gdb_reply);
+	}
+	else
+	{
+		sprintf(gdb_reply, "S%02x", signal);
+		gdb_send(gdb_reply);
+	}
+}
+
+/* Step until one more instruction retires, or continue until a stop; returns the signal */
+int gdb_resume(int step)
+{
+	uint32_t retired = INSTRUCTION_COUNT, n = 0;
+	int signal = 5;
+	uint8_t c;
+	double t0 = host_seconds();
+
+	brk_stop = 0;
+	brk_hit_kind = 0;
+	while ((RUN_FLAG || MISS_FLAG == 1) && !brk_stop)
+	{
+		sim_step();
+		if (step && INSTRUCTION_COUNT != retired)
+		{
+			break;
+		}
+		if (++n % GDB_POLL_STEPS == 0 && recv(gdb_fd, &c, 1, MSG_DONTWAIT) == 1 && c == 0x03)
+		{
+			signal = 2; //interrupted
+			break;
+		}
+	}
+	SIM_HOST_SECONDS += host_seconds() - t0;
+	return signal;
+}
+
+/* Handle the packet in gdb_packet; returns 0 to end the session */
+int gdb_handle(int len)
+{
+	char *p = gdb_packet;
+	uint32_t addr, size, value, i, done;
+	int n, type;
+
+	gdb_reply[0] = 0;
+	switch (p[0])
+	{
+	case '?':
+		gdb_stop_reply(5);
+		return 1;
+	case 'g':
+		for (n = 0; n < GDB_NUM_REGS; n++)
+		{
+			gdb_put_word(gdb_reply + 8 * n, gdb_get_reg(n));
+		}
+		break;
+	case 'G':
+		for (n = 0; n < GDB_NUM_REGS && 8 * n + 8 < len; n++)
+		{
+			gdb_set_reg(n, gdb_get_word(p + 1 + 8 * n));
+		}
+		strcpy(gdb_reply, "OK");
+		break;
+	case 'p':
+		n = strtoul(p + 1, NULL, 16);
+		if (n < GDB_NUM_REGS)
+		{
+			gdb_put_word(gdb_reply, gdb_get_reg(n));
+		}
+		else
+		{
+			strcpy(gdb_reply, "xxxxxxxx"); //FPU registers
+		}
+		break;
+	case 'P':
+		if (sscanf(p + 1, "%x=", &n) == 1 && strchr(p, '=') != NULL && strlen(strchr(p, '=') + 1) >= 8)
+		{
+			if (n < GDB_NUM_REGS)
+			{
+				gdb_set_reg(n, gdb_get_word(strchr(p, '=') + 1));
+			}
+			strcpy(gdb_reply, "OK");
+		}
+		else
+		{
+			strcpy(gdb_reply, "E01");
+		}
+		break;
+	case 'm':
+		if (sscanf(p + 1, "%x,%x", &addr, &size) != 2)
+		{
+			strcpy(gdb_reply, "E01");
+			break;
+		}
+		done = mem_read_block(addr, gdb_mem, size < sizeof(gdb_mem) ? size : sizeof(gdb_mem));
+		for (i = 0; i < done; i++)
+		{
+			sprintf(gdb_reply + 2 * i, "%02x", gdb_mem[i]);
+		}
+		if (done == 0)
+		{
+			strcpy(gdb_reply, "E01");
+		}
+		break;
+	case 'M':
+	case 'X':
+		if (sscanf(p + 1, "%x,%x:", &addr, &size) != 2 || strchr(p, ':') == NULL || size > sizeof(gdb_mem))
+		{
+			strcpy(gdb_reply, "E01");
+			break;
+		}
+		p = strchr(p, ':') + 1;
+		for (i = 0; i < size; i++)
+		{
+			if (gdb_packet[0] == 'X')
+			{
+				gdb_mem[i] = p + i < gdb_packet + len ? p[i] : 0;
+			}
+			else
+			{
+				gdb_mem[i] = (gdb_hex(p[2 * i]) << 4) | gdb_hex(p[2 * i + 1]);
+			}
+		}
+		if (size != 0)
+		{
+			pipeline_flush();
+			if (mem_write_block(addr, gdb_mem, size) != size)
+			{
+				strcpy(gdb_reply, "E01");
+				break;
+			}
+		}
+		strcpy(gdb_reply, "OK");
+		break;
+	case 'c':
+	case 's':
+		if (sscanf(p + 1, "%x", &value) == 1)
+		{
+			gdb_set_reg(37, value);
+		}
+		gdb_stop_reply(gdb_resume(p[0] == 's'));
+		return 1;
+	case 'Z':
+	case 'z':
+		if (sscanf(p + 1, "%d,%x,%x", &type, &addr, &size) != 3 || type > 4)
+		{
+			break; //unsupported
+		}
+		type = type <= 1 ? BRK_EXEC : type == 2 ? BRK_WRITE : type == 3 ? BRK_READ : BRK_READ | BRK_WRITE;
+		value = type == BRK_EXEC ? addr : addr + size - 1;
+		if (p[0] == 'Z')
+		{
+			strcpy(gdb_reply, brk_find(type, addr, value) >= 0 || brk_add(type, addr, value) >= 0 ? "OK" : "E01");
+		}
+		else
+		{
+			n = brk_find(type, addr, value);
+			if (n >= 0)
+			{
+				brk_delete(n + 1);
+			}
+			strcpy(gdb_reply, "OK");
+		}
+		break;
+	case 'H':
+		strcpy(gdb_reply, "OK");
+		break;
+	case 'q':
+	case 'Q':
+		if (strncmp(p, "qSupported", 10) == 0)
+		{
+			sprintf(gdb_reply, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+		}
+		else if (strcmp(p, "QStartNoAckMode") == 0)
+		{
+			gdb_send("OK");
+			gdb_ack = 0;
+			return 1;
+		}
+		else if (strcmp(p, "qAttached") == 0)
+		{
+			strcpy(gdb_reply, "1");
+		}
+		break;
+	case 'D':
+		gdb_send("OK");
+		return 0;
+	case 'k':
+		return 0;
+	}
+	gdb_send(gdb_reply); //empty for anything unsupported
+	return 1;
+}
+
+void gdb_serve(int port)
+{
+	struct sockaddr_in sa;
+	int listen_fd, one = 1, len;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listen_fd, 1) < 0)
+	{
+		printf("Error: Can't listen on port %d\n\n", port);
+		if (listen_fd >= 0)
+		{
+			close(listen_fd);
+		}
+		return;
+	}
+	printf("Waiting for gdb on 127.0.0.1:%d (target remote :%d, set endian little)...\n", port, port);
+	fflush(stdout);
+	gdb_fd = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+	if (gdb_fd < 0)
+	{
+		printf("Error: accept failed\n\n");
+		return;
+	}
+	setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	gdb_ack = 1;
+	gdb_in_used = 0;
+	gdb_in_pos = 0;
+	printf("gdb connected\n");
+	while ((len = gdb_read_packet()) >= 0 && gdb_handle(len))
+	{
+	}
+	close(gdb_fd);
+	gdb_fd = -1;
+	printf("gdb disconnected\n\n");
+}
+
+/***************************************************************/
+/* Functional units: latency and initiation interval per class */
+/***************************************************************/
+static inline int fu_class(uint32_t ir)
+{
+	if ((ir >> 26) == 0 && (ir & 0x3C) == 0x18)
+	{
+		return (ir & 0x2) ? FU_DIV : FU_MUL; //MULT/MULTU, DIV/DIVU
+	}
+	return FU_ALU;
+}
+
+/* MTHI, MTLO, MULT(U) and DIV(U) */
+static inline int fu_writes_hilo(uint32_t ir)
+{
+	return (ir >> 26) == 0 && ((ir & 0x3C) == 0x18 || (ir & 0x3D) == 0x11);
+}
+
+/* Called by ID: must ir wait before it can go to EX next cycle? */
+static inline int fu_hold(uint32_t ir, int *cause)
+{
+	uint32_t next = CYCLE_COUNT + 1;
+	int unit;
+
+	if (((ir >> 26) != 0 || (ir & 0x30) != 0x10) && fu[FU_ALU].interval == 1)
+	{
+		return 0; //neither a HI/LO access nor a multiply/divide, and the ALU takes one every cycle
+	}
+	unit = fu_class(ir);
+	if ((ir >> 26) == 0 && (ir & 0x3D) == 0x10) //MFHI, MFLO read HI/LO in EX
+	{
+		if (next < hilo_ready || fu_writes_hilo(EX_MEM.IR) || fu_writes_hilo(MEM_WB.IR))
+		{
+			hilo_stalls++;
+			*cause = CPI_DATA_HAZARD;
+			return 1;
+		}
+	}
+	if (next < fu[unit].free_at)
+	{
+		fu[unit].stalls++;
+		*cause = CPI_STRUCTURAL;
+		return 1;
+	}
+	return 0;
+}
+
+/* Called by EX for every instruction it executes */
+static inline void fu_issue(uint32_t ir)
+{
+	Func_Unit *u = &fu[fu_class(ir)];
+
+	u->ops++;
+	u->busy += u->interval;
+	u->free_at = CYCLE_COUNT + u->interval;
+	if (u != &fu[FU_ALU])
+	{
+		hilo_ready = CYCLE_COUNT + u->latency;
+	}
+}
+
+void fu_show()
+{
+	int i;
+
+	printf("[Unit]\t[Latency]\t[Interval]\t[Ops]\t\t[Busy]\t\t[Occupancy]\t[Stalls]\n");
+	for (i = 0; i < FU_NUM; i++)
+	{
+		printf("%s\t%u\t\t%u\t\t%-10u\t%-10u\t%6.2f%%\t\t%u\n", fu_names[i], fu[i].latency, fu[i].interval, fu[i].ops, fu[i].busy,
+			   CYCLE_COUNT ? 100.0 * (fu[i].busy < CYCLE_COUNT ? fu[i].busy : CYCLE_COUNT) / CYCLE_COUNT : 0.0, fu[i].stalls);
+	}
+	printf("HI/LO interlock stalls: %u\n\n", hilo_stalls);
+}
+
+/* unit alu|mul|div <latency> <interval> */
+void fu_config(const char *name, uint32_t latency, uint32_t interval)
+{
+	int i;
+
+	for (i = 0; i < FU_NUM && strcmp(name, fu_names[i]) != 0; i++)
+	{
+	}
+	if (i == FU_NUM || latency == 0 || interval == 0)
+	{
+		printf("Usage: unit alu|mul|div <latency> <interval>, both at least 1\n\n");
+		return;
+	}
+	if (i == FU_ALU && latency != 1)
+	{
+		printf("The ALU latency is fixed at 1: dependent instructions take their operands from the forwarding paths.\n\n");
+		return;
+	}
+	fu[i].latency = latency;
+	fu[i].interval = interval;
+	snap_restart(); //the timing model changed under the snapshots
+	fu_show();
+}
+
+void cacheDump()
+{
+	int i;
+	double prob;
+	prob = ((double)cache_misses / ((double)cache_misses + (double)cache_hits)) * 100;
+
+	printf("------------Cache Content----------------\n");
+	printf("-----------------------------------------\n");
+	printf("Hitted Caches: %d\n", cache_misses);
+	printf("MIssed Caches: %d\n", cache_hits);
+	printf("Cache Hit probability: %0.2f%c\n", prob, 37);
+	printf("-----------------------------------------\n");
+
+	printf("%d sets of %d ways\n", NUM_CACHE_BLOCKS >> L1_WAY_BITS, 1 << L1_WAY_BITS);
+	printf("Block\tValid\tTag\tWord 1\t\tWord 2\t\tWord 3\t\tWord 4\n");
+
+	for (i = 0; i < 16; i++)
+	{
+		printf("[B%d]\t%d\t%x\t0x%08x\t0x%08x\t0x%08x\t0x%08x\n", i, L1Cache.valid[i], L1Cache.tag[i], L1Cache.words[i][0], L1Cache.words[i][1], L1Cache.words[i][2], L1Cache.words[i][3]);
+	}
+	printf("-----------------------------------------\n");
 }
 
 /***************************************************************/
 /* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop)
+void mdump(uint32_t start, uint32_t stop)
+{
+	uint32_t address;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4)
+	{
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address,
+			   mem_read_32(address));
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Bulk binary dump, load and diff of simulated memory         */
+/***************************************************************/
+#define DIFF_MAX_RANGES 32 //ranges printed before the rest are only counted
+
+typedef struct Diff_Stats_Struct {
+	uint32_t ranges;
+	uint32_t words;
+} Diff_Stats;
+
+/* Offset of the first differing word at or after from, or n; the equal stretches are skipped 64 bytes at a time */
+uint32_t diff_next(const uint8_t *a, const uint8_t *b, uint32_t n, uint32_t from)
+{
+	uint32_t i = from, x, y;
+
+#if defined(__SSE2__)
+	for (; i + 64 <= n; i += 64)
+	{
+		__m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+		__m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+		__m128i e2 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32)));
+		__m128i e3 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)));
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3))) != 0xFFFF)
+		{
+			break;
+		}
+	}
+#endif
+	for (; i + 4 <= n; i += 4)
+	{
+		memcpy(&x, a + i, 4);
+		memcpy(&y, b + i, 4);
+		if (x != y)
+		{
+			return i;
+		}
+	}
+	return i < n && memcmp(a + i, b + i, n - i) != 0 ? i : n;
+}
+
+/* Print the runs of differing words in a[0..n) and b[0..n), labelled from base */
+void diff_report(const uint8_t *a, const uint8_t *b, uint32_t n, uint32_t base, Diff_Stats *st)
+{
+	uint32_t i = 0, end, x, y;
+
+	while ((i = diff_next(a, b, n, i)) < n)
+	{
+		for (end = i; end < n && memcmp(a + end, b + end, n - end < 4 ? n - end : 4) != 0; end += 4)
+		{
+			st->words++;
+		}
+		end = end < n ? end : n;
+		if (st->ranges++ < DIFF_MAX_RANGES)
+		{
+			x = y = 0;
+			memcpy(&x, a + i, end - i < 4 ? end - i : 4);
+			memcpy(&y, b + i, end - i < 4 ? end - i : 4);
+			printf("\t0x%08x..0x%08x\t%u words\tfirst 0x%08x vs 0x%08x\n", base + i, base + end - 1, (end - i + 3) / 4, x, y);
+		}
+		i = end;
+	}
+}
+
+void diff_summary(const Diff_Stats *st)
+{
+	if (st->ranges > DIFF_MAX_RANGES)
+	{
+		printf("\t... %u more ranges\n", st->ranges - DIFF_MAX_RANGES);
+	}
+	printf(st->ranges ? "%u ranges, %u words differ\n\n" : "No differences.\n\n", st->ranges, st->words);
+}
+
+/* Whole file in a malloc'ed buffer, or NULL */
+uint8_t *read_file(const char *path, uint32_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+	uint8_t *buf = NULL;
+	long len;
+
+	if (fp == NULL)
+	{
+		printf("Error: Can't open %s\n\n", path);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = malloc(len > 0 ? len : 1);
+	if (buf == NULL || fread(buf, 1, len, fp) != (size_t)len)
+	{
+		printf("Error: Can't read %s\n\n", path);
+		free(buf);
+		buf = NULL;
+	}
+	*size = len;
+	fclose(fp);
+	return buf;
+}
+
+/* Write [start, stop] to path straight from the host backing, one fwrite per region */
+void dump_bin(uint32_t start, uint32_t stop, const char *path)
+{
+	FILE *fp;
+	uint32_t addr = start, avail, n;
+	uint8_t *p;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+	{
+		printf("Error: Can't open %s\n\n", path);
+		return;
+	}
+	while (addr <= stop && addr >= start)
+	{
+		p = mem_host_ptr(addr, &avail);
+		if (p == NULL)
+		{
+			printf("Error: 0x%08x is not mapped\n", addr);
+			break;
+		}
+		n = stop - addr < avail - 1 ? stop - addr + 1 : avail;
+		fwrite(p, 1, n, fp);
+		addr += n;
+	}
+	printf("Wrote %u bytes from 0x%08x to %s\n\n", addr - start, start, path);
+	fclose(fp);
+}
+
+void load_bin(uint32_t addr, const char *path)
+{
+	uint32_t size, done;
+	uint8_t *buf = read_file(path, &size);
+
+	if (buf == NULL)
+	{
+		return;
+	}
+	pipeline_flush(); //nothing in flight may have seen the old contents
+	done = mem_write_block(addr, buf, size);
+	printf("Loaded %u of %u bytes from %s at 0x%08x\n\n", done, size, path, addr);
+	free(buf);
+}
+
+void diff_files(const char *path_a, const char *path_b)
+{
+	uint32_t size_a, size_b;
+	uint8_t *a = read_file(path_a, &size_a), *b = NULL;
+	Diff_Stats st = {0, 0};
+
+	if (a != NULL && (b = read_file(path_b, &size_b)) != NULL)
+	{
+		if (size_a != size_b)
+		{
+			printf("Sizes differ (%u and %u bytes), comparing the first %u\n", size_a, size_b, size_a < size_b ? size_a : size_b);
+		}
+		diff_report(a, b, size_a < size_b ? size_a : size_b, 0, &st);
+		diff_summary(&st);
+	}
+	free(a);
+	free(b);
+}
+
+/* Compare memory from addr with a dump file; differences are labelled by address */
+void diff_mem(uint32_t addr, const char *path)
+{
+	uint32_t size, done = 0, avail, n;
+	uint8_t *buf = read_file(path, &size), *p;
+	Diff_Stats st = {0, 0};
+
+	if (buf == NULL)
+	{
+		return;
+	}
+	while (done < size && (p = mem_host_ptr(addr + done, &avail)) != NULL)
+	{
+		n = size - done < avail ? size - done : avail;
+		diff_report(p, buf + done, n, addr + done, &st);
+		done += n;
+	}
+	if (done < size)
+	{
+		printf("0x%08x is not mapped, compared %u of %u bytes\n", addr + done, done, size);
+	}
+	diff_summary(&st);
+	free(buf);
+}
+
+/***************************************************************/
+/* Print the CPI stack: cycles lost per cause                  */
+/***************************************************************/
+void cpi_dump()
 {
-	uint32_t address;
+	int i;
+	uint32_t total = 0;
+	double insts = INSTRUCTION_COUNT ? (double)INSTRUCTION_COUNT : 1.0;
+
+	for (i = 0; i < CPI_NUM; i++)
+	{
+		total += cpi_cycles[i];
+	}
+	printf("-------------------------------------\n");
+	printf("CPI Stack\n");
+	printf("-------------------------------------\n");
+	printf("[Category]\t[Cycles]\t[CPI]\t[Share]\n");
+	for (i = 0; i < CPI_NUM; i++)
+	{
+		printf("%-13s\t%u\t\t%.3f\t%5.1f%c\n", cpi_names[i], cpi_cycles[i], cpi_cycles[i] / insts,
+			   total ? 100.0 * cpi_cycles[i] / total : 0.0, 37);
+	}
+	printf("%-13s\t%u\t\t%.3f\n", "total", total, total / insts);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Print run statistics as one JSON line, for scripts          */
+/***************************************************************/
+void stats_dump()
+{
+	int i;
+	uint32_t accesses = cache_hits + cache_misses;
+
+	printf("STATS {\"instructions\":%u,\"cycles\":%u,\"cpi\":%.4f,\"cache_hits\":%u,\"cache_misses\":%u,"
+		   "\"hit_rate\":%.4f,\"halted\":%d,\"host_seconds\":%.6f,\"sim_ips\":%.0f,\"cpi_stack\":{",
+		   INSTRUCTION_COUNT, CYCLE_COUNT, INSTRUCTION_COUNT ? (double)CYCLE_COUNT / INSTRUCTION_COUNT : 0.0,
+		   cache_hits, cache_misses, accesses ? (double)cache_hits / accesses : 0.0, RUN_FLAG == FALSE,
+		   SIM_HOST_SECONDS, SIM_HOST_SECONDS > 0 ? INSTRUCTION_COUNT / SIM_HOST_SECONDS : 0.0);
+	for (i = 0; i < CPI_NUM; i++)
+	{
+		printf("%s\"%s\":%u", i ? "," : "", cpi_names[i], cpi_cycles[i]);
+	}
+	printf("}");
+	if (mmu_enabled)
+	{
+		printf(",\"itlb_misses\":%u,\"dtlb_misses\":%u,\"walk_cycles\":%u", itlb.misses, dtlb.misses,
+			   itlb.walk_cycles + dtlb.walk_cycles);
+	}
+	if (sb_enabled)
+	{
+		printf(",\"sb_forwards\":%u,\"sb_combined\":%u,\"sb_stall_cycles\":%u,\"sb_avg_occupancy\":%.4f", sb_forwards,
+			   sb_combined, sb_wait_cycles, CYCLE_COUNT ? (double)sb_occupancy / CYCLE_COUNT : 0.0);
+	}
+	if (fuse_enabled)
+	{
+		printf(",\"fused_pairs\":{");
+		for (i = 0; i < FUSE_NUM; i++)
+		{
+			printf("%s\"%s\":%u", i ? "," : "", fuse_names[i], fuse_pairs[i]);
+		}
+		printf("},\"fuse_saved_cycles\":%u", fuse_saved);
+	}
+	if (mt_threads != 0)
+	{
+		printf(",\"threads\":%u,\"thread_retired\":[", mt_threads);
+		for (i = 0; i < (int)mt_threads; i++)
+		{
+			printf("%s%u", i ? "," : "", mt_retired[i]);
+		}
+		printf("],\"no_ready_cycles\":%u", mt_idle);
+	}
+	if (L1_WAY_BITS != 0)
+	{
+		printf(",\"l1_ways\":%d", 1 << L1_WAY_BITS);
+	}
+	if (fill_mode != FILL_OFF)
+	{
+		printf(",\"fill_lines\":%u,\"fill_stall_cycles\":%u,\"fill_saved_cycles\":%u", fill_lines, fill_wait_cycles,
+			   fill_saved);
+	}
+	printf("}\n");
+}
+
+/***************************************************************/
+/* Host-time profile control and report                        */
+/***************************************************************/
+#if HOST_PROFILE
+/* Ticks in a slot, less the cost of its own probe and of the probes nested inside it */
+double prof_net_ticks(int slot)
+{
+	double net = (double)prof.ticks[slot] - (double)prof_probe_ticks * prof.calls[slot] - (double)prof_nested_ticks * prof.nested[slot];
+	return net > 0 ? net : 0;
+}
+
+/* Time empty probes, alone and nested, with the real macros; keep the fastest of many tries */
+void prof_calibrate()
+{
+	int i;
+	uint64_t empty = ~(uint64_t)0, nested = ~(uint64_t)0, before;
+
+	prof_sampling = 1;
+	for (i = 0; i < 1000; i++)
+	{
+		before = prof.ticks[PROF_CYCLE];
+		{
+			PROF_BEGIN(PROF_CYCLE);
+			PROF_END(PROF_CYCLE);
+		}
+		if (prof.ticks[PROF_CYCLE] - before < empty)
+		{
+			empty = prof.ticks[PROF_CYCLE] - before;
+		}
+		before = prof.ticks[PROF_CYCLE];
+		{
+			PROF_BEGIN(PROF_CYCLE);
+			PROF_BEGIN(PROF_STATS);
+			PROF_END(PROF_STATS);
+			PROF_END(PROF_CYCLE);
+		}
+		if (prof.ticks[PROF_CYCLE] - before < nested)
+		{
+			nested = prof.ticks[PROF_CYCLE] - before;
+		}
+	}
+	prof_sampling = 0;
+	prof_probe_ticks = empty;
+	prof_nested_ticks = nested > empty ? nested - empty : 0;
+}
+#endif
+
+void hostprof(const char *arg)
+{
+#if HOST_PROFILE
+	int i;
+	double ns_per_tick, cycle_ticks, other, t;
+	uint64_t sampled;
+
+	if (strcmp(arg, "on") == 0 || strcmp(arg, "reset") == 0)
+	{
+		prof_calibrate();
+		memset(&prof, 0, sizeof(prof));
+		prof_discarded = 0;
+		prof_start_ticks = prof_now();
+		prof_start_seconds = host_seconds();
+		prof_enabled = prof_enabled || arg[0] == 'o';
+		return;
+	}
+	if (strcmp(arg, "off") == 0)
+	{
+		prof_enabled = 0;
+		return;
+	}
+	sampled = prof.calls[PROF_CYCLE];
+	if (sampled == 0)
+	{
+		printf("No cycles sampled; use hostprof on and run first.\n\n");
+		return;
+	}
+	/* calibrate ticks against the wall clock over the profiling window */
+	ns_per_tick = (host_seconds() - prof_start_seconds) * 1e9 / (double)(prof_now() - prof_start_ticks);
+	/* the cycle total and the stage times are corrected separately; never let the stages exceed the total */
+	other = prof_net_ticks(PROF_CYCLE);
+	for (i = PROF_WB; i <= PROF_COMMIT; i++)
+	{
+		other -= prof_net_ticks(i);
+	}
+	if (other < 0)
+	{
+		other = 0;
+	}
+	cycle_ticks = other;
+	for (i = PROF_WB; i <= PROF_COMMIT; i++)
+	{
+		cycle_ticks += prof_net_ticks(i);
+	}
+	if (cycle_ticks <= 0)
+	{
+		cycle_ticks = 1;
+	}
+
+	printf("Host profile: %llu cycles sampled (1 in %d, %llu outliers dropped), %.2f ns/cycle, probe cost %.2f/%.2f ns removed\n",
+		   (unsigned long long)sampled, PROF_PERIOD, (unsigned long long)prof_discarded, cycle_ticks * ns_per_tick / sampled,
+		   prof_probe_ticks * ns_per_tick, prof_nested_ticks * ns_per_tick);
+	printf("-------------------------------------\n");
+	printf("%-14s %10s %7s\n", "stage", "ns/cycle", "share");
+	for (i = PROF_WB; i <= PROF_COMMIT; i++)
+	{
+		t = prof_net_ticks(i);
+		printf("%-14s %10.2f %6.1f%%\n", prof_names[i], t * ns_per_tick / sampled, 100.0 * t / cycle_ticks);
+	}
+	printf("%-14s %10.2f %6.1f%%\n", "other", other * ns_per_tick / sampled, 100.0 * other / cycle_ticks);
+	printf("\n%-14s %10s %10s %7s  (inside the stages above)\n", "subsystem", "ns/cycle", "ns/call", "share");
+	for (i = PROF_DECODE; i <= PROF_STATS; i++)
+	{
+		t = prof_net_ticks(i);
+		printf("%-14s %10.2f %10.2f %6.1f%%\n", prof_names[i], t * ns_per_tick / sampled,
+			   prof.calls[i] ? t * ns_per_tick / prof.calls[i] : 0.0, 100.0 * t / cycle_ticks);
+	}
+	printf("\n");
+#else
+	(void)arg;
+	printf("Host profiling is compiled out; rebuild with -DHOST_PROFILE=1.\n\n");
+#endif
+}
+
+/***************************************************************/
+/* Per-PC profile: flat profile, hot loops and callgrind output */
+/***************************************************************/
+#define PCPROF_MAX_EDGES 1024
+#define PCPROF_MAX_DEPTH 1024
+
+typedef struct Call_Edge_Struct {
+	uint32_t site; //PC of the JAL/JALR
+	uint32_t callee;
+	uint32_t calls;
+	uint64_t cycles; //inclusive, from the call to the matching JR $ra
+	uint64_t insts;
+} Call_Edge;
+
+typedef struct Call_Frame_Struct {
+	uint32_t edge;
+	uint32_t cycle;
+	uint32_t insts;
+} Call_Frame;
+
+Call_Edge pcprof_edges[PCPROF_MAX_EDGES];
+uint32_t pcprof_num_edges = 0;
+Call_Frame pcprof_stack[PCPROF_MAX_DEPTH];
+uint32_t pcprof_depth = 0;
+uint32_t pcprof_lost = 0; //calls deeper than PCPROF_MAX_DEPTH, whose returns are skipped
+
+/* Profile entry for pc, or NULL outside the loaded program */
+PC_Profile *pcprof_at(uint32_t pc)
+{
+	uint32_t i = (pc - MEM_TEXT_BEGIN) >> 2;
+	return (pc >= MEM_TEXT_BEGIN && i < pcprof_size) ? &pcprof[i] : NULL;
+}
+
+void pcprof_charge(uint32_t pc, int retired, int cause)
+{
+	PC_Profile *p = pcprof_at(pc);
+	if (p == NULL)
+	{
+		return; //pipeline fill before the first instruction
+	}
+	p->cycles++;
+	p->retired += retired;
+	if (cause != CPI_BASE)
+	{
+		p->stalls++;
+	}
+}
+
+void pcprof_miss(uint32_t pc)
+{
+	PC_Profile *p = pcprof_at(pc);
+	pcprof_miss_pc = pc;
+	if (p != NULL)
+	{
+		p->misses++;
+	}
+}
+
+/* EX redirected fetch from pc to target: track calls, returns and backward branches */
+void pcprof_redirect(uint32_t pc, uint32_t ir, uint32_t target)
+{
+	uint32_t opcode = (ir & 0xFC000000) >> 26;
+	uint32_t funct = ir & 0x0000003F;
+	uint32_t i;
+	Call_Edge *e;
+	PC_Profile *p;
+
+	if (opcode == 0x03 || (opcode == 0x00 && funct == 0x09)) //JAL, JALR
+	{
+		for (i = 0; i < pcprof_num_edges; i++)
+		{
+			if (pcprof_edges[i].site == pc && pcprof_edges[i].callee == target)
+			{
+				break;
+			}
+		}
+		if (i == PCPROF_MAX_EDGES)
+		{
+			return;
+		}
+		e = &pcprof_edges[i];
+		if (i == pcprof_num_edges)
+		{
+			memset(e, 0, sizeof(*e));
+			e->site = pc;
+			e->callee = target;
+			pcprof_num_edges++;
+		}
+		e->calls++;
+		if (pcprof_depth == PCPROF_MAX_DEPTH)
+		{
+			pcprof_lost++;
+			return;
+		}
+		pcprof_stack[pcprof_depth].edge = i;
+		pcprof_stack[pcprof_depth].cycle = CYCLE_COUNT;
+		pcprof_stack[pcprof_depth].insts = INSTRUCTION_COUNT;
+		pcprof_depth++;
+		return;
+	}
+	if (opcode == 0x00 && funct == 0x08) //JR
+	{
+		if (((ir & 0x03E00000) >> 21) != 31)
+		{
+			return;
+		}
+		if (pcprof_lost != 0)
+		{
+			pcprof_lost--;
+		}
+		else if (pcprof_depth != 0)
+		{
+			pcprof_depth--;
+			e = &pcprof_edges[pcprof_stack[pcprof_depth].edge];
+			e->cycles += CYCLE_COUNT - pcprof_stack[pcprof_depth].cycle;
+			e->insts += INSTRUCTION_COUNT - pcprof_stack[pcprof_depth].insts;
+		}
+		return;
+	}
+	p = pcprof_at(pc);
+	if (target <= pc && p != NULL)
+	{
+		p->back_taken++;
+		p->back_target = target;
+	}
+}
+
+/* (Re)start profiling the loaded program from zero */
+void pcprof_start()
+{
+	free(pcprof);
+	pcprof_size = PROGRAM_SIZE;
+	pcprof = calloc(pcprof_size ? pcprof_size : 1, sizeof(PC_Profile));
+	pcprof_num_edges = 0;
+	pcprof_depth = 0;
+	pcprof_lost = 0;
+}
+
+void pcprof_stop()
+{
+	free(pcprof);
+	pcprof = NULL;
+	pcprof_size = 0;
+}
+
+int pcprof_by_cycles(const void *a, const void *b)
+{
+	uint32_t x = pcprof[*(const uint32_t *)a].cycles, y = pcprof[*(const uint32_t *)b].cycles;
+	return (x < y) - (x > y);
+}
+
+/* Hot loops are keyed by their backward branch; the body is [back_target, branch] */
+uint64_t pcprof_loop_cycles(uint32_t i)
+{
+	uint32_t j;
+	uint64_t sum = 0;
+	for (j = (pcprof[i].back_target - MEM_TEXT_BEGIN) >> 2; j <= i; j++)
+	{
+		sum += pcprof[j].cycles;
+	}
+	return sum;
+}
+
+int pcprof_by_loop_cycles(const void *a, const void *b)
+{
+	uint64_t x = pcprof_loop_cycles(*(const uint32_t *)a), y = pcprof_loop_cycles(*(const uint32_t *)b);
+	return (x < y) - (x > y);
+}
+
+void pcprof_show()
+{
+	uint32_t i, n = 0, loops = 0, *order, *loop;
+	uint64_t charged = 0, body;
+	char text[64];
+
+	if (pcprof == NULL)
+	{
+		printf("Per-PC profiling is off; use pcprof on and run first.\n\n");
+		return;
+	}
+	order = malloc((pcprof_size + 1) * sizeof(uint32_t));
+	loop = malloc((pcprof_size + 1) * sizeof(uint32_t));
+	for (i = 0; i < pcprof_size; i++)
+	{
+		charged += pcprof[i].cycles;
+		if (pcprof[i].cycles != 0)
+		{
+			order[n++] = i;
+		}
+		if (pcprof[i].back_taken != 0)
+		{
+			loop[loops++] = i;
+		}
+	}
+	qsort(order, n, sizeof(uint32_t), pcprof_by_cycles);
+	qsort(loop, loops, sizeof(uint32_t), pcprof_by_loop_cycles);
+
+	printf("Flat profile: %llu of %u cycles charged to program PCs\n", (unsigned long long)charged, CYCLE_COUNT);
+	printf("-------------------------------------------------------------------------\n");
+	printf("%-10s %9s %9s %6s %9s %9s  %s\n", "PC", "retired", "cycles", "share", "stalls", "misses", "instruction");
+	for (i = 0; i < n && i < 20; i++)
+	{
+		PC_Profile *p = &pcprof[order[i]];
+		uint32_t pc = MEM_TEXT_BEGIN + 4 * order[i];
+		disassemble(mem_read_32(pc), pc, text, sizeof(text));
+		printf("0x%08x %9u %9u %5.1f%% %9u %9u  %s\n", pc, p->retired, p->cycles, charged ? 100.0 * p->cycles / charged : 0.0,
+			   p->stalls, p->misses, text);
+	}
+
+	printf("\nHot loops (by taken backward branch)\n");
+	printf("-------------------------------------------------------------------------\n");
+	printf("%-23s %9s %11s %6s %10s\n", "body", "iters", "cycles", "share", "cyc/iter");
+	for (i = 0; i < loops && i < 10; i++)
+	{
+		PC_Profile *p = &pcprof[loop[i]];
+		body = pcprof_loop_cycles(loop[i]);
+		printf("0x%08x-0x%08x %9u %11llu %5.1f%% %10.1f\n", p->back_target, MEM_TEXT_BEGIN + 4 * loop[i], p->back_taken,
+			   (unsigned long long)body, charged ? 100.0 * body / charged : 0.0, (double)body / p->back_taken);
+	}
+	printf("\n");
+	free(order);
+	free(loop);
+}
+
+/* Name of the function containing pc: the nearest call target at or below it */
+uint32_t pcprof_function(uint32_t pc)
+{
+	uint32_t i, best = MEM_TEXT_BEGIN;
+	for (i = 0; i < pcprof_num_edges; i++)
+	{
+		if (pcprof_edges[i].callee <= pc && pcprof_edges[i].callee > best)
+		{
+			best = pcprof_edges[i].callee;
+		}
+	}
+	return best;
+}
+
+void pcprof_fn_name(uint32_t start, char *buf, size_t len)
+{
+	if (start == MEM_TEXT_BEGIN)
+	{
+		snprintf(buf, len, "_start");
+	}
+	else
+	{
+		snprintf(buf, len, "func_%08x", start);
+	}
+}
+
+/* Write a callgrind profile plus the disassembly listing its line numbers refer to (<path>.asm) */
+void pcprof_callgrind(const char *path)
+{
+	FILE *out, *asm_out;
+	char listing[300], text[64], name[32];
+	uint32_t i, j, k, fn, current = 0xFFFFFFFF;
+	uint64_t totals[4] = {0, 0, 0, 0}, cycles, insts;
+
+	if (pcprof == NULL)
+	{
+		printf("Per-PC profiling is off; use pcprof on and run first.\n\n");
+		return;
+	}
+	snprintf(listing, sizeof(listing), "%s.asm", path);
+	out = fopen(path, "w");
+	asm_out = fopen(listing, "w");
+	if (out == NULL || asm_out == NULL)
+	{
+		printf("Error: Can't write %s\n\n", out == NULL ? path : listing);
+		if (out != NULL)
+		{
+			fclose(out);
+		}
+		if (asm_out != NULL)
+		{
+			fclose(asm_out);
+		}
+		return;
+	}
+	for (i = 0; i < pcprof_size; i++)
+	{
+		uint32_t pc = MEM_TEXT_BEGIN + 4 * i;
+		disassemble(mem_read_32(pc), pc, text, sizeof(text));
+		fprintf(asm_out, "0x%08x:  %s\n", pc, text);
+		totals[0] += pcprof[i].retired;
+		totals[1] += pcprof[i].cycles;
+		totals[2] += pcprof[i].stalls;
+		totals[3] += pcprof[i].misses;
+	}
+	fclose(asm_out);
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4)
+	fprintf(out, "# callgrind format\nversion: 1\ncreator: mu-mips pcprof\ncmd: %s\n", prog_file);
+	fprintf(out, "positions: line\nevents: Ir Cycles Stalls DMiss\n");
+	fprintf(out, "summary: %llu %llu %llu %llu\n\nfl=%s\n", (unsigned long long)totals[0], (unsigned long long)totals[1],
+			(unsigned long long)totals[2], (unsigned long long)totals[3], listing);
+	for (i = 0; i < pcprof_size; i++)
 	{
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address,
-			   mem_read_32(address));
+		uint32_t pc = MEM_TEXT_BEGIN + 4 * i;
+		PC_Profile *p = &pcprof[i];
+
+		fn = pcprof_function(pc);
+		if (fn != current)
+		{
+			current = fn;
+			pcprof_fn_name(fn, name, sizeof(name));
+			fprintf(out, "\nfn=%s\n", name);
+		}
+		if (p->cycles != 0 || p->retired != 0 || p->misses != 0)
+		{
+			fprintf(out, "%u %u %u %u %u\n", i + 1, p->retired, p->cycles, p->stalls, p->misses);
+		}
+		for (j = 0; j < pcprof_num_edges; j++)
+		{
+			Call_Edge *e = &pcprof_edges[j];
+			if (e->site != pc)
+			{
+				continue;
+			}
+			cycles = e->cycles;
+			insts = e->insts;
+			for (k = 0; k < pcprof_depth; k++) //calls still open when the run stopped
+			{
+				if (pcprof_stack[k].edge == j)
+				{
+					cycles += CYCLE_COUNT - pcprof_stack[k].cycle;
+					insts += INSTRUCTION_COUNT - pcprof_stack[k].insts;
+				}
+			}
+			pcprof_fn_name(e->callee, name, sizeof(name));
+			fprintf(out, "cfn=%s\ncalls=%u %u\n%u %llu %llu\n", name, e->calls, ((e->callee - MEM_TEXT_BEGIN) >> 2) + 1, i + 1,
+					(unsigned long long)insts, (unsigned long long)cycles);
+		}
 	}
-	printf("\n");
+	fclose(out);
+	printf("Wrote %s and %s\n\n", path, listing);
 }
 
 /***************************************************************/
@@ -297,7 +5408,7 @@ void rdump()
 	printf("-------------------------------------\n");
 	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
 	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
+	cpi_dump();
 }
 
 /***************************************************************/
@@ -306,6 +5417,8 @@ void rdump()
 void handle_command()
 {
 	char buffer[20];
+	char arg[20];
+	char path[256], path2[256];
 	uint32_t start, stop, cycles;
 	uint32_t register_no;
 	int register_value;
@@ -326,6 +5439,69 @@ void handle_command()
 		{
 			show_pipeline();
 		}
+		else if (buffer[1] == 't' || buffer[1] == 'T')
+		{
+			stats_dump();
+		}
+		else if (buffer[1] == 'p' || buffer[1] == 'P')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "size") == 0 || strcmp(arg, "dma") == 0)
+			{
+				if (scanf("%u", &start) == 1)
+				{
+					spm_config(arg, start);
+				}
+			}
+			else
+			{
+				spm_command(arg);
+			}
+		}
+		else if (buffer[1] == 'b' || buffer[1] == 'B')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "size") == 0)
+			{
+				if (scanf("%u", &start) == 1)
+				{
+					sb_config(start);
+				}
+			}
+			else
+			{
+				sb_command(arg);
+			}
+		}
+		else if (buffer[1] == 'n' || buffer[1] == 'N')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "off") == 0)
+			{
+				snap_interval = 0;
+				snap_restart();
+			}
+			else if (strcmp(arg, "show") != 0)
+			{
+				if (sscanf(arg, "%u", &cycles) != 1 || cycles == 0)
+				{
+					printf("Invalid snapshot interval.\n\n");
+					break;
+				}
+				snap_interval = cycles;
+				snap_restart();
+			}
+			snap_show();
+		}
 		else
 		{
 			runAll();
@@ -333,81 +5509,374 @@ void handle_command()
 		break;
 	case 'c':
 	case 'C':
-		cacheDump();
+		if (buffer[1] == 'p' || buffer[1] == 'P')
+		{
+			cpi_dump();
+		}
+		else if (buffer[1] == 'h' || buffer[1] == 'H')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "on") == 0 && mt_threads != 0)
+			{
+				printf("The lockstep checker needs one thread ('threads off').\n");
+			}
+			else if (strcmp(arg, "on") == 0)
+			{
+				check_start();
+			}
+			else if (strcmp(arg, "off") == 0)
+			{
+				check_enabled = 0;
+			}
+			printf("Lockstep check %s, %u instructions checked\n\n", check_enabled ? "on" : "off", check_count);
+		}
+		else
+		{
+			cacheDump();
+		}
+		break;
+	case 'B':
+	case 'b':
+		if (buffer[1] == 'r' || buffer[1] == 'R')
+		{
+			if (scanf("%x", &start) == 1)
+			{
+				brk_add(BRK_EXEC, start, start);
+			}
+			break;
+		}
+		if (buffer[1] == 'l' || buffer[1] == 'L')
+		{
+			brk_list();
+			break;
+		}
+		if (scanf("%u", &cycles) != 1)
+		{
+			break;
+		}
+		snap_goto(cycles < CYCLE_COUNT ? CYCLE_COUNT - cycles : 0);
+		break;
+	case 'W':
+	case 'w':
+		if (scanf("%19s %x %x", arg, &start, &stop) != 3)
+		{
+			break;
+		}
+		if (strcmp(arg, "r") == 0 || strcmp(arg, "w") == 0 || strcmp(arg, "rw") == 0)
+		{
+			brk_add((strchr(arg, 'r') ? BRK_READ : 0) | (strchr(arg, 'w') ? BRK_WRITE : 0), start, stop);
+		}
+		else
+		{
+			printf("Usage: watch r|w|rw <start> <end>\n\n");
+		}
+		break;
+	case 'D':
+	case 'd':
+		if (buffer[1] == 'u' || buffer[1] == 'U')
+		{
+			if (scanf("%x %x %255s", &start, &stop, path) == 3)
+			{
+				dump_bin(start, stop, path);
+			}
+			break;
+		}
+		if ((buffer[1] == 'i' || buffer[1] == 'I') && (buffer[4] == 'm' || buffer[4] == 'M'))
+		{
+			if (scanf("%x %255s", &start, path) == 2)
+			{
+				diff_mem(start, path);
+			}
+			break;
+		}
+		if (buffer[1] == 'i' || buffer[1] == 'I')
+		{
+			if (scanf("%255s %255s", path, path2) == 2)
+			{
+				diff_files(path, path2);
+			}
+			break;
+		}
+		if (scanf("%19s", arg) != 1)
+		{
+			break;
+		}
+		brk_delete(strcmp(arg, "all") == 0 ? 0 : atoi(arg));
+		brk_list();
+		break;
+	case 'G':
+	case 'g':
+		if (scanf("%u", &cycles) != 1)
+		{
+			break;
+		}
+		if (buffer[1] == 'd' || buffer[1] == 'D')
+		{
+			gdb_serve(cycles);
+			break;
+		}
+		snap_goto(cycles);
+		break;
+	case 'M':
+	case 'm':
+		if (buffer[1] == 'm' || buffer[1] == 'M')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (arg[0] == 'i' || arg[0] == 'd')
+			{
+				if (scanf("%u %u", &start, &stop) == 2)
+				{
+					mmu_config(arg, start, stop);
+				}
+			}
+			else
+			{
+				mmu_command(arg);
+			}
+			break;
+		}
+		if (scanf("%x %x", &start, &stop) != 2)
+		{
+			break;
+		}
+		mdump(start, stop);
+		break;
+	case '?':
+		help();
+		break;
+	case 'Q':
+	case 'q':
+		printf("**************************\n");
+		printf("Exiting MU-MIPS! Good Bye...\n");
+		printf("**************************\n");
+		exit(0);
+	case 'R':
+	case 'r':
+		if (buffer[1] == 'd' || buffer[1] == 'D')
+		{
+			rdump();
+		}
+		else if (buffer[1] == 'e' || buffer[1] == 'E')
+		{
+			reset();
+		}
+		else
+		{
+			if (scanf("%d", &cycles) != 1)
+			{
+				break;
+			}
+			run(cycles);
+		}
+		break;
+	case 'I':
+	case 'i':
+		if ((buffer[1] == 'n' || buffer[1] == 'N') && (buffer[2] == 't' || buffer[2] == 'T'))
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "off") == 0)
+			{
+				interval_stop();
+			}
+			else if (strcmp(arg, "show") == 0)
+			{
+				interval_show();
+			}
+			else if (scanf("%255s", path) == 1)
+			{
+				interval_start(strtoul(arg, NULL, 0), path);
+			}
+			break;
+		}
+		if (scanf("%u %i", &register_no, &register_value) != 2)
+		{
+			break;
+		}
+		CURRENT_STATE.REGS[register_no] = register_value;
+		check_state.REGS[register_no] = register_value;
+		snap_restart();
+		break;
+	case 'H':
+	case 'h':
+		if (buffer[1] == 'o' || buffer[1] == 'O')
+		{
+			if (scanf("%19s", arg) == 1)
+			{
+				hostprof(arg);
+			}
+			break;
+		}
+		if (scanf("%i", &hi_reg_value) != 1)
+		{
+			break;
+		}
+		CURRENT_STATE.HI = hi_reg_value;
+		check_state.HI = hi_reg_value;
+		snap_restart();
+		break;
+	case 'L':
+	case 'l':
+		if (buffer[1] == '1')
+		{
+			l1_show();
+			break;
+		}
+		if (buffer[1] == 'i' || buffer[1] == 'I')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "first") == 0 || strcmp(arg, "beat") == 0)
+			{
+				if (scanf("%u", &start) == 1)
+				{
+					fill_config(arg, start);
+				}
+			}
+			else
+			{
+				fill_command(arg);
+			}
+			break;
+		}
+		if (buffer[1] == 'o' && (buffer[2] == 'a' || buffer[2] == 'A'))
+		{
+			if (scanf("%x %255s", &start, path) == 2)
+			{
+				load_bin(start, path);
+			}
+			break;
+		}
+		if (scanf("%i", &lo_reg_value) != 1)
+		{
+			break;
+		}
+		CURRENT_STATE.LO = lo_reg_value;
+		check_state.LO = lo_reg_value;
+		snap_restart();
+		break;
+	case 'P':
+	case 'p':
+		if (buffer[1] == 'c' || buffer[1] == 'C')
+		{
+			if (scanf("%19s", arg) != 1)
+			{
+				break;
+			}
+			if (strcmp(arg, "on") == 0 || strcmp(arg, "reset") == 0)
+			{
+				pcprof_start();
+			}
+			else if (strcmp(arg, "off") == 0)
+			{
+				pcprof_stop();
+			}
+			else if (strcmp(arg, "callgrind") == 0)
+			{
+				if (scanf("%255s", path) == 1)
+				{
+					pcprof_callgrind(path);
+				}
+			}
+			else
+			{
+				pcprof_show();
+			}
+			break;
+		}
+		print_program();
 		break;
-	case 'M':
-	case 'm':
-		if (scanf("%x %x", &start, &stop) != 2)
+	case 'T':
+	case 't':
+		if (scanf("%19s", arg) != 1)
 		{
 			break;
 		}
-		mdump(start, stop);
-		break;
-	case '?':
-		help();
-		break;
-	case 'Q':
-	case 'q':
-		printf("**************************\n");
-		printf("Exiting MU-MIPS! Good Bye...\n");
-		printf("**************************\n");
-		exit(0);
-	case 'R':
-	case 'r':
-		if (buffer[1] == 'd' || buffer[1] == 'D')
+		if (buffer[1] == 'h' || buffer[1] == 'H')
 		{
-			rdump();
+			mt_command(arg);
 		}
-		else if (buffer[1] == 'e' || buffer[1] == 'E')
+		else if (strcmp(arg, "off") == 0)
 		{
-			reset();
+			trace_stop();
 		}
-		else
+		else if (strcmp(arg, "konata") == 0 || strcmp(arg, "chrome") == 0)
 		{
-			if (scanf("%d", &cycles) != 1)
+			if (scanf("%255s %255s", path, path2) != 2)
 			{
 				break;
 			}
-			run(cycles);
+			if (arg[0] == 'k')
+			{
+				trace_export_konata(path, path2);
+			}
+			else
+			{
+				trace_export_chrome(path, path2);
+			}
 		}
-		break;
-	case 'I':
-	case 'i':
-		if (scanf("%u %i", &register_no, &register_value) != 2)
+		else
 		{
-			break;
+			trace_start(arg);
 		}
-		CURRENT_STATE.REGS[register_no] = register_value;
-		NEXT_STATE.REGS[register_no] = register_value;
 		break;
-	case 'H':
-	case 'h':
-		if (scanf("%i", &hi_reg_value) != 1)
+	case 'U':
+	case 'u':
+		if (scanf("%19s", arg) != 1)
 		{
 			break;
 		}
-		CURRENT_STATE.HI = hi_reg_value;
-		NEXT_STATE.HI = hi_reg_value;
-		break;
-	case 'L':
-	case 'l':
-		if (scanf("%i", &lo_reg_value) != 1)
+		if (strcmp(arg, "show") == 0)
 		{
-			break;
+			fu_show();
+		}
+		else if (scanf("%u %u", &start, &stop) == 2)
+		{
+			fu_config(arg, start, stop);
 		}
-		CURRENT_STATE.LO = lo_reg_value;
-		NEXT_STATE.LO = lo_reg_value;
 		break;
-	case 'P':
-	case 'p':
-		print_program();
+	case 'J':
+	case 'j':
+		if (scanf("%19s", arg) == 1)
+		{
+			jit_command(arg);
+		}
 		break;
 	case 'F':
 	case 'f':
+		if (buffer[1] == 'a' || buffer[1] == 'A')
+		{
+			if (scanf("%u", &cycles) != 1)
+			{
+				break;
+			}
+			fast_forward(cycles);
+			break;
+		}
+		if (buffer[1] == 'u' || buffer[1] == 'U')
+		{
+			if (scanf("%19s", arg) == 1)
+			{
+				fuse_command(arg);
+			}
+			break;
+		}
 		if (scanf("%d", &ENABLE_FORWARDING) != 1)
 		{
 			break;
 		}
+		ENABLE_FORWARDING = ENABLE_FORWARDING != 0; //ID and EX both read it as a flag
+		snap_restart();
 		ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
 		break;
 	default:
@@ -422,6 +5891,10 @@ void handle_command()
 void reset()
 {
 	int i;
+	if (interval_len != 0)
+	{
+		interval_sample(); //rows restart at cycle 0 after the reset
+	}
 	/*reset registers*/
 	for (i = 0; i < MIPS_REGS; i++)
 	{
@@ -437,14 +5910,56 @@ void reset()
 	}
 
 	/*load program*/
+	bb_flush();
 	load_program();
 	cache_misses = 0;
 	cache_hits = 0;
+	MISS_FLAG = 0;
+	miss_wait = 1;
+	for (i = 0; i < FU_NUM; i++)
+	{
+		fu[i].free_at = 0;
+		fu[i].ops = 0;
+		fu[i].busy = 0;
+		fu[i].stalls = 0;
+	}
+	hilo_ready = 0;
+	hilo_stalls = 0;
+	spm_reset();
+	sb_reset();
+	fill_reset();
+	memset(fuse_pairs, 0, sizeof(fuse_pairs));
+	fuse_saved = 0;
+	mmu_reset();
+	taken_branches = 0;
+	if (mmu_enabled)
+	{
+		mmu_build(); //memory was cleared
+	}
+	memset(cpi_cycles, 0, sizeof(cpi_cycles));
+	if (pcprof != NULL)
+	{
+		pcprof_start(); //the program may have changed size
+	}
+	pipeline_flush(); //nothing issued before the reset may retire after it
 	/*reset PC*/
 	INSTRUCTION_COUNT = 0;
+	CYCLE_COUNT = 0;
+	SIM_HOST_SECONDS = 0;
 	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
 	RUN_FLAG = TRUE;
+	if (check_enabled)
+	{
+		check_start();
+	}
+	interval_done = 0;
+	bbv_start = 0;
+	bbv_len = 0;
+	interval_begin();
+	if (mt_threads != 0)
+	{
+		mt_init(mt_threads, mt_policy);
+	}
 }
 
 /***************************************************************/
@@ -495,41 +6010,108 @@ void load_program()
 	fclose(fp);
 }
 
-/************************************************************/
-/* maintain the pipeline                                                                                           */
-/************************************************************/
-void handle_pipeline()
+/* The register an instruction writes in WB, or 0: what ID waits for and EX forwards */
+static inline uint32_t ir_dest(uint32_t ir)
+{
+	switch (ir >> 26)
+	{
+	case 0x00:
+		switch (ir & 0x0000003F)
+		{
+		case 0x08: case 0x0C: case 0x11: case 0x13: case 0x18: case 0x19: case 0x1A: case 0x1B:
+			return 0; //JR, SYSCALL, MTHI/MTLO and MULT/DIV leave the registers alone
+		default:
+			return (ir & 0x0000F800) >> 11;
+		}
+	case 0x03: //JAL
+		return 31;
+	case 0x08: case 0x09: case 0x0A: case 0x0C: case 0x0D: case 0x0E: case 0x0F: case 0x20: case 0x21: case 0x23:
+		return (ir & 0x001F0000) >> 16;
+	default:
+		return 0;
+	}
+}
+
+static inline int ir_is_load(uint32_t ir)
+{
+	return (ir >> 26) == 0x20 || (ir >> 26) == 0x21 || (ir >> 26) == 0x23;
+}
+
+/* The value the instruction in a latch writes to ir_dest() */
+static inline uint32_t latch_result(const CPU_Pipeline_Reg *latch)
+{
+	if (ir_is_load(latch->IR))
+	{
+		return latch->LMD;
+	}
+	if ((latch->IR >> 26) == 0x00 && (latch->IR & 0x0000003F) == 0x10)
+	{
+		return latch->HI; //MFHI
+	}
+	if ((latch->IR >> 26) == 0x00 && (latch->IR & 0x0000003F) == 0x12)
+	{
+		return latch->LO; //MFLO
+	}
+	return latch->ALUOutput;
+}
+
+/* Whether a reader in ID waits for producer, in EX_MEM if ex_mem, else in MEM_WB.
+   Without forwarding it waits until the producer has been written back; with it,
+   only for a load right ahead, whose data comes too late for EX. */
+static inline int hazard_waits(uint32_t producer, int ex_mem, const int fwd)
 {
-	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
-	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */
+	return !fwd || (ex_mem && ir_is_load(producer));
+}
+
+/* Whether ir, in IF_ID, has to wait in ID for a source register that an older
+   instruction of its thread writes */
+static inline int hazard_hold(uint32_t ir, const int fwd, int *cause)
+{
+	uint32_t opcode = ir >> 26;
+	uint32_t rs = opcode == 0x02 || opcode == 0x03 ? 0 : (ir & 0x03E00000) >> 21;
+	uint32_t rt = opcode == 0x00 || opcode == 0x04 || opcode == 0x05 || opcode >= 0x28 ? (ir & 0x001F0000) >> 16 : 0;
 
-	WB();
-	MEM();
-	EX();
-	ID();
-	IF();
+	if (EX_MEM_RegWrite && EX_MEM_RegisterRd != 0 && (EX_MEM_RegisterRd == rs || EX_MEM_RegisterRd == rt) &&
+		EX_MEM_tid == IF_ID_tid && hazard_waits(EX_MEM.IR, 1, fwd))
+	{
+		*cause = ir_is_load(EX_MEM.IR) ? CPI_LOAD_USE : CPI_DATA_HAZARD;
+		return 1;
+	}
+	if (MEM_WB_RegWrite && MEM_WB_RegisterRd != 0 && (MEM_WB_RegisterRd == rs || MEM_WB_RegisterRd == rt) &&
+		MEM_WB_tid == IF_ID_tid && hazard_waits(MEM_WB.IR, 0, fwd))
+	{
+		*cause = CPI_DATA_HAZARD;
+		return 1;
+	}
+	return 0;
 }
 
 /************************************************************/
 /* writeback (WB) pipeline stage:                                                                          */
 /************************************************************/
-void WB()
+SIM_INLINE void WB_stage(CPU_State *const cpu, const int probe)
 {
 	/*IMPLEMENT THIS*/
 	if (MEM_WB.IR == 0)
 	{
-		if (stall != 0)
+		cpi_cycles[MEM_WB_cause]++;
+		if (probe && pcprof != NULL)
 		{
-			stall--;
+			pcprof_charge(MEM_WB_blame, 0, MEM_WB_cause);
 		}
 		return;
 	}
+	cpi_cycles[CPI_BASE]++;
+	if (probe && pcprof != NULL)
+	{
+		pcprof_charge(MEM_WB.PC - 4, 1, CPI_BASE);
+	}
+	TRACE(TRACE_WB, MEM_WB_seq, MEM_WB.PC - 4, MEM_WB.IR, CPI_BASE);
 
 	uint32_t opcode;
 	uint32_t funct;
 	uint32_t rd;
 	uint32_t rt;
-	prevInstruction = MEM_WB.IR;
 	opcode = (MEM_WB.IR & 0xFC000000) >> 26;
 	funct = MEM_WB.IR & 0x0000003F;
 	rd = (MEM_WB.IR & 0x0000F800) >> 11;
@@ -540,13 +6122,13 @@ void WB()
 		switch (funct)
 		{
 		case 0x00: //SLL, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x02: //SRL, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x03: //SRA, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x0C: //SYSCALL
 			if (MEM_WB.ALUOutput == 0xA)
@@ -557,63 +6139,64 @@ void WB()
 			}
 			break;
 		case 0x10: //MFHI, Load/Store Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.HI;
+			state_write(&cpu->REGS[rd], MEM_WB.HI);
 			break;
 		case 0x11: //MTHI, Load/Store Instruction
-			NEXT_STATE.HI = MEM_WB.ALUOutput;
+			state_write(&cpu->HI, MEM_WB.ALUOutput);
 			break;
 		case 0x12: //MFLO, Load/Store Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.LO;
+			state_write(&cpu->REGS[rd], MEM_WB.LO);
 			break;
 		case 0x13: //MTLO, Load/Store Instruction
-			NEXT_STATE.LO = MEM_WB.ALUOutput;
+			state_write(&cpu->LO, MEM_WB.ALUOutput);
 			break;
 		case 0x18: //MULT, ALU Instruction
-			NEXT_STATE.LO = MEM_WB.LO;
-			NEXT_STATE.HI = MEM_WB.HI;
+			state_write(&cpu->LO, MEM_WB.LO);
+			state_write(&cpu->HI, MEM_WB.HI);
 			break;
 		case 0x19: //MULTU, ALU Instruction
-			NEXT_STATE.LO = MEM_WB.LO;
-			NEXT_STATE.HI = MEM_WB.HI;
+			state_write(&cpu->LO, MEM_WB.LO);
+			state_write(&cpu->HI, MEM_WB.HI);
 			break;
 		case 0x1A: //DIV, ALU Instruction
-			NEXT_STATE.LO = MEM_WB.LO;
-			NEXT_STATE.HI = MEM_WB.HI;
+			state_write(&cpu->LO, MEM_WB.LO);
+			state_write(&cpu->HI, MEM_WB.HI);
 			break;
 		case 0x1B: //DIVU, ALU Instruction
-			NEXT_STATE.LO = MEM_WB.LO;
-			NEXT_STATE.HI = MEM_WB.HI;
+			state_write(&cpu->LO, MEM_WB.LO);
+			state_write(&cpu->HI, MEM_WB.HI);
 			break;
 		case 0x20: //ADD, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x21: //ADDU, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x22: //SUB, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x23: //SUBU, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x24: //AND, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x25: //OR, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x26: //XOR, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x27: //NOR, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x2A: //SLT, ALU Instruction
-			NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		case 0x08: //JR
 			break;
 		case 0x09: //JALR
+			state_write(&cpu->REGS[rd], MEM_WB.ALUOutput);
 			break;
 		default:
 			printf("Funct instruction at 0x%x is not implemented!\n", funct);
@@ -625,34 +6208,34 @@ void WB()
 		switch (opcode)
 		{
 		case 0x08: //ADDI, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x09: //ADDIU, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x0A: //SLTI, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x0C: //ANDI, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x0D: //ORI, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x0E: //XORI, ALU Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x0F: //LUI, Load/Store Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
+			state_write(&cpu->REGS[rt], MEM_WB.ALUOutput);
 			break;
 		case 0x20: //LB, Load/Store Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
+			state_write(&cpu->REGS[rt], MEM_WB.LMD);
 			break;
 		case 0x21: //LH, Load/Store Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
+			state_write(&cpu->REGS[rt], MEM_WB.LMD);
 			break;
 		case 0x23: //LW, Load/Store Instruction
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
+			state_write(&cpu->REGS[rt], MEM_WB.LMD);
 			break;
 		case 0x28: //SB, Load/Store Instruction
 			// do nothing
@@ -668,6 +6251,7 @@ void WB()
 		case 0x02: //J
 			break;
 		case 0x03: //JAL
+			state_write(&cpu->REGS[31], MEM_WB.ALUOutput);
 			break;
 		case 0x04: //BEQ
 			break;
@@ -683,20 +6267,46 @@ void WB()
 			break;
 		}
 	}
-	if (stall != 0)
+	INSTRUCTION_COUNT++;
+	if (MEM_WB_fuse.first != 0)
+	{
+		INSTRUCTION_COUNT++;
+		fuse_pairs[MEM_WB_fuse.kind]++;
+		fuse_saved += 1 + MEM_WB_fuse.raw; //the second's issue slot and its RAW wait
+		if (probe && pcprof != NULL && pcprof_at(MEM_WB.PC) != NULL)
+		{
+			pcprof_at(MEM_WB.PC)->retired++; //the second of the pair
+		}
+	}
+	if (probe && interval_len != 0)
 	{
-		stall--;
+		bbv_retire(MEM_WB.PC - 4, MEM_WB_fuse.first != 0 ? MEM_WB_fuse.second : MEM_WB.IR, MEM_WB_fuse.first != 0 ? 2 : 1);
+	}
+	if (probe && check_enabled)
+	{
+		check_retire();
 	}
-	INSTRUCTION_COUNT++;
 }
 
 /************************************************************/
 /* memory access (MEM) pipeline stage:                                                          */
 /************************************************************/
-void MEM()
+SIM_INLINE void MEM_stage(const int probe, const int mmu)
 {
 	/*IMPLEMENT THIS*/
 	MEM_WB.IR = EX_MEM.IR;
+	MEM_WB.PC = EX_MEM.PC;
+	if (brk_armed && MEM_WB.IR != 0)
+	{
+		brk_check(MEM_WB.PC - 4); //stop with it next to retire
+	}
+	MEM_WB_cause = EX_MEM_cause;
+	MEM_WB_blame = EX_MEM_blame;
+	MEM_WB_fuse = EX_MEM_fuse;
+	check_store_valid = 0;
+#if PIPE_TRACE
+	MEM_WB_seq = EX_MEM_seq;
+#endif
 	EX_MEM.A = ID_EX.A;
 	uint32_t opcode;
 	uint32_t funct;
@@ -704,13 +6314,19 @@ void MEM()
 	opcode = (MEM_WB.IR & 0xFC000000) >> 26;
 	funct = MEM_WB.IR & 0x0000003F;
 
-	MEM_WB_RegisterRt = (MEM_WB.IR & 0x001F0000) >> 16; //reg destination (register)
-	MEM_WB_RegisterRd = (MEM_WB.IR & 0x0000F800) >> 11;
+	MEM_WB_RegisterRd = ir_dest(MEM_WB.IR);
 
 	if (MEM_WB.IR == 0)
 	{
 		return;
 	}
+	TRACE(TRACE_MEM, MEM_WB_seq, MEM_WB.PC - 4, MEM_WB.IR, CPI_BASE);
+	uint32_t misses = cache_misses;
+	uint32_t addr = EX_MEM.ALUOutput; //a load or store's physical address
+	if (mmu && opcode >= 0x20)
+	{
+		addr = mmu_translate(&dtlb, addr, MEM_WB.PC - 4);
+	}
 
 	//MEM_WB.LO = EX_MEM.LO;
 	//MEM_WB.HI = EX_MEM.HI;
@@ -744,16 +6360,20 @@ void MEM()
 			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
 			break;
 		case 0x18: //MULT, ALU Instruction
-			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+			MEM_WB.HI = EX_MEM.HI;
+			MEM_WB.LO = EX_MEM.LO;
 			break;
 		case 0x19: //MULTU, ALU Instruction
-			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+			MEM_WB.HI = EX_MEM.HI;
+			MEM_WB.LO = EX_MEM.LO;
 			break;
 		case 0x1A: //DIV, ALU Instruction
-			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+			MEM_WB.HI = EX_MEM.HI;
+			MEM_WB.LO = EX_MEM.LO;
 			break;
 		case 0x1B: //DIVU, ALU Instruction
-			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+			MEM_WB.HI = EX_MEM.HI;
+			MEM_WB.LO = EX_MEM.LO;
 			break;
 		case 0x20: //ADD, ALU Instruction
 			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
@@ -785,6 +6405,7 @@ void MEM()
 		case 0x08: //JR
 			break;
 		case 0x09: //JALR
+			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
 			break;
 		default:
 			printf("Funct instruction at 0x%x is not implemented!\n", funct);
@@ -817,38 +6438,48 @@ void MEM()
 			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
 			break;
 		case 0x20: //LB, Load/Store Instruction
-			data = cache_read_32(EX_MEM.ALUOutput);
+			data = sb_read_32(addr, 0x1) >> ((addr & 3) * 8);
 			MEM_WB.LMD =
 				((data & 0x000000FF) & 0x80) > 0 ? (data | 0xFFFFFF00) : (data & 0x000000FF);
 			break;
 		case 0x21: //LH, Load/Store Instruction
-			data = cache_read_32(EX_MEM.ALUOutput);
+			data = sb_read_32(addr, 0x3) >> ((addr & 2) * 8);
 			MEM_WB.LMD =
 				((data & 0x0000FFFF) & 0x8000) > 0 ? (data | 0xFFFF0000) : (data & 0x0000FFFF);
 			break;
 		case 0x23: //LW, Load/Store Instruction
-			MEM_WB.LMD = cache_read_32(EX_MEM.ALUOutput);
+			MEM_WB.LMD = sb_read_32(addr, 0xF);
 			break;
 		case 0x28: //SB, Load/Store Instruction
-			data = cache_read_32(EX_MEM.ALUOutput);
-			data = (data & 0xFFFFFF00) | (EX_MEM.B & 0x000000FF);
-			//mem_write_32(EX_MEM.ALUOutput, data);
-			cache_write_32(EX_MEM.ALUOutput, EX_MEM.B);
+			if (sb_enabled)
+			{
+				sb_write_32(addr, EX_MEM.B, 0x1);
+				break;
+			}
+			cache_write_32(addr, EX_MEM.B);
 			break;
 		case 0x29: //SH, Load/Store Instruction
-			data = cache_read_32(EX_MEM.ALUOutput);
-			data = (data & 0xFFFF0000) | (EX_MEM.B & 0x0000FFFF);
-			//mem_write_32(EX_MEM.ALUOutput, data);
-			cache_write_32(EX_MEM.ALUOutput, EX_MEM.B);
+			if (sb_enabled)
+			{
+				sb_write_32(addr, EX_MEM.B, 0x3);
+				break;
+			}
+			cache_write_32(addr, EX_MEM.B);
 			break;
 		case 0x2B: //SW, Load/Store Instruction
-			cache_write_32(EX_MEM.ALUOutput, EX_MEM.B);
+			if (sb_enabled)
+			{
+				sb_write_32(addr, EX_MEM.B, 0xF);
+				break;
+			}
+			cache_write_32(addr, EX_MEM.B);
 			break;
 		case 0x01: //BLTZ and BGEZ
 			break;
 		case 0x02: //J
 			break;
 		case 0x03: //JAL
+			MEM_WB.ALUOutput = EX_MEM.ALUOutput;
 			break;
 		case 0x04: //BEQ
 			break;
@@ -864,99 +6495,75 @@ void MEM()
 			break;
 		}
 	}
+	if (watch_count != 0 && opcode >= 0x20 && watch_page[EX_MEM.ALUOutput >> WATCH_PAGE_BITS])
+	{
+		watch_check(MEM_WB.PC - 4, opcode >= 0x28 ? BRK_WRITE : BRK_READ, EX_MEM.ALUOutput, (opcode & 3) + 1);
+	}
+	if (probe && pcprof != NULL && cache_misses != misses)
+	{
+		pcprof_miss(MEM_WB.PC - 4);
+	}
 }
 
 /************************************************************/
 /* execution (EX) pipeline stage:                                                                          */
 /************************************************************/
-void EX()
+SIM_INLINE void EX_stage(CPU_State *const cpu, const int fwd, const int probe)
 {
 	/*IMPLEMENT THIS*/
 	EX_MEM.IR = ID_EX.IR;
+	EX_MEM.PC = ID_EX.PC;
+	EX_MEM_cause = ID_EX_cause;
+	EX_MEM_blame = ID_EX_blame;
+	EX_MEM_fuse = ID_EX_fuse;
+#if PIPE_TRACE
+	EX_MEM_seq = ID_EX_seq;
+#endif
 	uint32_t opcode;
 	uint32_t funct;
 	uint32_t sa;
+	uint32_t rs;
 	uint32_t rt;
-	uint32_t rd;
 	uint32_t immediate;
 	uint64_t product, p1, p2;
 	sa = (EX_MEM.IR & 0x000007C0) >> 6;
 	opcode = (EX_MEM.IR & 0xFC000000) >> 26;
 	funct = EX_MEM.IR & 0x0000003F;
+	rs = (EX_MEM.IR & 0x03E00000) >> 21;
 	rt = (EX_MEM.IR & 0x001F0000) >> 16;
-	rd = (EX_MEM.IR & 0x0000F800) >> 11;
 	immediate = EX_MEM.IR & 0x0000FFFF;
 
 	//EX_MEM.B = ID_EX.B;
 
-	EX_MEM_RegisterRt = rt;
-	EX_MEM_RegisterRd = rd;
+	EX_MEM_RegisterRd = ir_dest(EX_MEM.IR);
 	if (EX_MEM.IR == 0)
 	{
 		return;
 	}
+	TRACE(TRACE_EX, EX_MEM_seq, EX_MEM.PC - 4, EX_MEM.IR, CPI_BASE);
+	fu_issue(EX_MEM.IR);
 
-	if (ENABLE_FORWARDING)
+	if (fwd)
 	{
-		ID_EX.A = CURRENT_STATE.REGS[ID_EX_rs];
-		ID_EX.B = CURRENT_STATE.REGS[ID_EX_rt];
+		/* WB has written the instruction two ahead by now, and MEM has finished
+		   the one right ahead, so its result bypasses the register file if it is
+		   the same thread's */
+		ID_EX.A = state_read(&cpu->REGS[rs]);
+		ID_EX.B = state_read(&cpu->REGS[rt]);
 		ID_EX.imm = immediate;
-		if (forwardA == 0x10)
-		{
-			if (((MEM_WB.IR & 0xFC000000) >> 26) == 0x23)
-			{
-				ID_EX.A = MEM_WB.LMD; // LW
-			}
-			else
-			{
-				ID_EX.A = EX_MEM.ALUOutput;
-			}
-		}
-		else if (forwardB == 0x10)
-		{
-			if (((MEM_WB.IR & 0xFC000000) >> 26) == 0x23)
-			{
-				ID_EX.B = MEM_WB.LMD; // LW
-			}
-			else
-			{
-				ID_EX.B = EX_MEM.ALUOutput;
-			}
-		}
-
-		if (forwardA == 0x01)
+		if (MEM_WB_RegWrite && MEM_WB_RegisterRd != 0 && MEM_WB_RegisterRd == rs && MEM_WB_tid == ID_EX_tid)
 		{
-			if (((MEM_WB.IR & 0xFC000000) >> 26) == 0x23)
-			{
-				ID_EX.A = MEM_WB.LMD; //LW
-			}
-			else
-			{
-				ID_EX.A = MEM_WB.ALUOutput;
-			}
+			ID_EX.A = latch_result(&MEM_WB);
 		}
-		else if (forwardB == 0x01)
+		if (MEM_WB_RegWrite && MEM_WB_RegisterRd != 0 && MEM_WB_RegisterRd == rt && MEM_WB_tid == ID_EX_tid)
 		{
-			if (((MEM_WB.IR & 0xFC000000) >> 26) == 0x23)
-			{
-				ID_EX.B = MEM_WB.LMD; //LW
-			}
-			else
-			{
-				ID_EX.B = MEM_WB.ALUOutput;
-			}
-			if (((prevInstruction & 0xFC000000) >> 26) == 0x23)
-			{
-				ID_EX.B = MEM_WB.LMD;
-			}
-			else
-			{
-				ID_EX.B = MEM_WB.ALUOutput;
-			}
+			ID_EX.B = latch_result(&MEM_WB);
 		}
 	}
-	forwardA = 0x00;
-	forwardB = 0x00; //reset
+	if (EX_MEM_fuse.first != 0 && EX_MEM_fuse.kind != FUSE_SLT_BRANCH)
+	{
+		ID_EX.A = EX_MEM_fuse.hi; //the fused LUI's result
+	}
 
 	//Different operation according to different instruction
 	if (opcode == 0x00)
@@ -970,7 +6577,7 @@ void EX()
 			EX_MEM.ALUOutput = ID_EX.B >> sa;
 			break;
 		case 0x03: //SRA, ALU Instruction
-			if ((ID_EX.B & 0x80000000) == 1)
+			if ((ID_EX.B & 0x80000000) != 0)
 			{
 				EX_MEM.ALUOutput = ~(~ID_EX.B >> sa);
 			}
@@ -983,13 +6590,13 @@ void EX()
 			EX_MEM.ALUOutput = 0xA;
 			break;
 		case 0x10: //MFHI, Load/Store Instruction
-			EX_MEM.HI = CURRENT_STATE.HI;
+			EX_MEM.HI = state_read(&cpu->HI);
 			break;
 		case 0x11: //MTHI, Load/Store Instruction
 			EX_MEM.ALUOutput = ID_EX.A;
 			break;
 		case 0x12: //MFLO, Load/Store Instruction
-			EX_MEM.LO = CURRENT_STATE.LO;
+			EX_MEM.LO = state_read(&cpu->LO);
 			break;
 		case 0x13: //MTLO, Load/Store Instruction
 			EX_MEM.ALUOutput = ID_EX.A;
@@ -1066,7 +6673,7 @@ void EX()
 			EX_MEM.ALUOutput = ~(ID_EX.A | ID_EX.B);
 			break;
 		case 0x2A: //SLT, ALU Instruction
-			if (ID_EX.A < ID_EX.B)
+			if ((int32_t)ID_EX.A < (int32_t)ID_EX.B)
 			{
 				EX_MEM.ALUOutput = 0x1;
 			}
@@ -1076,12 +6683,12 @@ void EX()
 			}
 			break;
 		case 0x08: //JR
-			CURRENT_STATE.PC = ID_EX.A;
+			redirect_pc = ID_EX.A;
 			branch = 1;
 			break;
 		case 0x09: //JALR
-			CURRENT_STATE.PC = ID_EX.A;
-			NEXT_STATE.REGS[31] = ID_EX.PC;
+			redirect_pc = ID_EX.A;
+			EX_MEM.ALUOutput = ID_EX.PC; //the link, written in WB
 			branch = 1;
 			break;
 		default:
@@ -1098,8 +6705,8 @@ void EX()
 			{ //BLTZ, Jump, branch instruction
 				if ((ID_EX.A & 0x80000000) > 0)
 				{
-					ID_EX.imm = ID_EX.imm << 2;
-					CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+					ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+					redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 					branch = 1;
 				}
 			}
@@ -1107,50 +6714,50 @@ void EX()
 			{ //BGEZ, Jump, branch instruction
 				if ((ID_EX.A & 0x80000000) == 0x0)
 				{
-					ID_EX.imm = ID_EX.imm << 2;
-					CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+					ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+					redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 					branch = 1;
 				}
 			}
 			break;
 		case 0x02: //J, Jump, branch instruction
-			CURRENT_STATE.PC = (ID_EX.PC & 0xF0000000) | ((ID_EX.IR & 0x03FFFFFF) << 2);
+			redirect_pc = (ID_EX.PC & 0xF0000000) | ((ID_EX.IR & 0x03FFFFFF) << 2);
 			branch = 1;
 			break;
 		case 0x03: //JAL, Jump, branch instruction
-			CURRENT_STATE.PC = (ID_EX.PC & 0xF0000000) | ((ID_EX.IR & 0x03FFFFFF) << 2);
-			NEXT_STATE.REGS[31] = ID_EX.PC;
+			redirect_pc = (ID_EX.PC & 0xF0000000) | ((ID_EX.IR & 0x03FFFFFF) << 2);
+			EX_MEM.ALUOutput = ID_EX.PC; //the link, written in WB
 			branch = 1;
 			break;
 		case 0x04: //BEQ, Jump, branch instruction
 			if (ID_EX.A == ID_EX.B)
 			{
-				ID_EX.imm = ID_EX.imm << 2;
-				CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+				ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+				redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 				branch = 1;
 			}
 			break;
 		case 0x05: //BNE, Jump, branch instruction
 			if (ID_EX.A != ID_EX.B)
 			{
-				ID_EX.imm = ID_EX.imm << 2;
-				CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+				ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+				redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 				branch = 1;
 			}
 			break;
 		case 0x06: //BLEZ, Jump, branch instruction
-			if (ID_EX.A <= 0)
+			if ((int32_t)ID_EX.A <= 0)
 			{
-				ID_EX.imm = ID_EX.imm << 2;
-				CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+				ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+				redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 				branch = 1;
 			}
 			break;
 		case 0x07: //BGTZ, Jump, branch instruction
-			if (ID_EX.A > 0)
+			if ((int32_t)ID_EX.A > 0)
 			{
-				ID_EX.imm = ID_EX.imm << 2;
-				CURRENT_STATE.PC = (ID_EX.PC + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) - 4);
+				ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+				redirect_pc = ID_EX.PC + ID_EX.imm - 4;
 				branch = 1;
 			}
 			break;
@@ -1163,8 +6770,7 @@ void EX()
 				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			break;
 		case 0x0A: //SLTI, ALU Instruction
-			if (((int32_t)ID_EX.A - (int32_t)(
-										(ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF))) < 0)
+			if ((int32_t)ID_EX.A < (int32_t)((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)))
 			{
 				EX_MEM.ALUOutput = 0x1;
 			}
@@ -1186,11 +6792,13 @@ void EX()
 			EX_MEM.ALUOutput = ID_EX.imm << 16;
 			break;
 		case 0x20: //LB, Load/Store Instruction
-			EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
+			EX_MEM.ALUOutput =
+				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			EX_MEM.B = ID_EX.B;
 			break;
 		case 0x21: //LH, Load/Store Instruction
-			EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
+			EX_MEM.ALUOutput =
+				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			EX_MEM.B = ID_EX.B;
 			break;
 		case 0x23: //LW, Load/Store Instruction
@@ -1199,18 +6807,19 @@ void EX()
 			//EX_MEM.B = ID_EX.B;
 			break;
 		case 0x28: //SB, Load/Store Instruction
-			EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
+			EX_MEM.ALUOutput =
+				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			EX_MEM.B = ID_EX.B;
 			break;
 		case 0x29: //SH, Load/Store Instruction
-			EX_MEM.ALUOutput = ID_EX.A + ID_EX.imm;
+			EX_MEM.ALUOutput =
+				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			EX_MEM.B = ID_EX.B;
 			break;
 		case 0x2B: //SW, Load/Store Instruction
 			EX_MEM.ALUOutput =
 				ID_EX.A + ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
 			EX_MEM.B = ID_EX.B;
-			EX_MEM_RegisterRt = 0;
 			break;
 		default:
 			// put more things here
@@ -1218,163 +6827,628 @@ void EX()
 			break;
 		}
 	}
+	if (EX_MEM_fuse.first != 0 && EX_MEM_fuse.kind == FUSE_SLT_BRANCH && (EX_MEM.ALUOutput != 0) == ((EX_MEM_fuse.second >> 26) == 0x05))
+	{
+		ID_EX.imm = EX_MEM_fuse.second & 0x0000FFFF;
+		ID_EX.imm = ((ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF)) << 2;
+		redirect_pc = ID_EX.PC + ID_EX.imm; //the branch sits at EX_MEM.PC, one after the compare
+		branch = 1;
+	}
+	if (branch == 1)
+	{
+		redirect_valid = 1;
+		taken_branches++;
+		if (probe && pcprof != NULL)
+		{
+			if (EX_MEM_fuse.first != 0)
+			{
+				pcprof_redirect(EX_MEM.PC, EX_MEM_fuse.second, redirect_pc);
+			}
+			else
+			{
+				pcprof_redirect(EX_MEM.PC - 4, EX_MEM.IR, redirect_pc);
+			}
+		}
+	}
+}
+
+/************************************************************/
+/* instruction decode (ID) pipeline stage:                                                         */
+/************************************************************/
+SIM_INLINE void ID_stage(CPU_State *const cpu, const int fwd, const int probe)
+{
+	(void)probe; //only the trace hooks use it, and PIPE_TRACE=0 drops them
+	/* a fused pair's second instruction, had it been fetched on its own, would sit
+	   here now, waiting on its first for as long as a reader of the first would */
+	if (EX_MEM_fuse.first != 0 && hazard_waits(EX_MEM_fuse.first, 1, fwd))
+	{
+		EX_MEM_fuse.raw++;
+	}
+	if (MEM_WB_fuse.first != 0 && hazard_waits(MEM_WB_fuse.first, 0, fwd))
+	{
+		MEM_WB_fuse.raw++;
+	}
+	if (branch == 1)
+	{
+		branch = 0;
+		if (IF_ID_tid == EX_MEM_tid) //fetched after the branch, unless another thread's
+		{
+			ID_EX.IR = 0;
+			ID_EX_fuse.first = 0;
+			ID_EX_cause = CPI_CONTROL;
+			ID_EX_blame = EX_MEM.PC - 4; //the branch that just resolved
+			TRACE(TRACE_FLUSH, IF_ID_seq, IF_ID.PC - 4, IF_ID.IR, CPI_CONTROL);
+			return;
+		}
+	}
+#if PIPE_TRACE
+	if (probe && trace_fp != NULL && IF_ID_seq != ID_seen_seq)
+	{
+		ID_seen_seq = IF_ID_seq;
+		trace_emit(TRACE_ID, IF_ID_seq, IF_ID.PC - 4, IF_ID.IR, CPI_BASE);
+	}
+#endif
+	/*IMPLEMENT THIS*/
+	ID_EX.PC = IF_ID.PC;
+	//ID_EX.IR = IF_ID.IR;
+	uint32_t rs;
+	uint32_t rt;
+	uint32_t immediate;
+	int cause = CPI_DATA_HAZARD;
+
+	rs = (IF_ID.IR & 0x03E00000) >> 21;
+	rt = (IF_ID.IR & 0x001F0000) >> 16;
+	immediate = IF_ID.IR & 0x0000FFFF; // use bit mask
+
+	ID_EX.A = state_read(&cpu->REGS[rs]);
+	ID_EX.B = state_read(&cpu->REGS[rt]);
+	ID_EX.imm = immediate;
+
+	int hold = IF_ID.IR != 0 && (hazard_hold(IF_ID.IR, fwd, &cause) || fu_hold(IF_ID.IR, &cause));
+	ID_EX_blame = IF_ID.PC - 4; //a stall is charged to the instruction kept waiting
+	if (!hold)
+	{
+		ID_EX.IR = IF_ID.IR;
+		ID_EX_fuse = IF_ID_fuse;
+#if PIPE_TRACE
+		ID_EX_seq = IF_ID_seq;
+#endif
+	}
+	else
+	{
+		ID_EX.IR = 0;
+		ID_EX_fuse.first = 0;
+		ID_EX_cause = cause;
+		TRACE(TRACE_STALL, IF_ID_seq, IF_ID.PC - 4, IF_ID.IR, cause);
+		IF_stall = 1; //keep IF_ID for one cycle and decide again
+	}
+}
+
+/************************************************************/
+/* instruction fetch (IF) pipeline stage:                                                              */
+/************************************************************/
+SIM_INLINE void IF_stage(CPU_State *const cpu, const int probe, const int mmu)
+{
+	uint32_t pc = cpu->PC;
+
+	(void)probe; //only the trace hooks use it, and PIPE_TRACE=0 drops them
+
+	if (redirect_valid)
+	{
+		pc = redirect_pc; //EX resolved a taken branch this cycle
+		redirect_valid = 0;
+	}
+	if (IF_stall == 0)
+	{
+		PROF_BEGIN(PROF_DECODE);
+		IF_ID.IR = bb_fetch(mmu ? mmu_translate(&itlb, pc, pc) : pc);
+		IF_ID_fuse.first = 0;
+		PROF_END(PROF_DECODE);
+		state_write(&cpu->PC, fuse_enabled && fuse_fetch(pc, mmu) ? pc + 8 : pc + 4);
+		IF_ID.PC = pc + 4;
+#if PIPE_TRACE
+		IF_ID_seq = ++trace_seq;
+#endif
+		TRACE(TRACE_IF, IF_ID_seq, pc, IF_ID.IR, CPI_BASE);
+		/*IMPLEMENT THIS*/
+	}
+	else if (pc != cpu->PC)
+	{
+		state_write(&cpu->PC, pc); //fetch from the target once the stall clears
+	}
+	IF_stall = 0;
 }
 
 /************************************************************/
-/* instruction decode (ID) pipeline stage:                                                         */
+/* One cycle of the pipeline for one configuration          */
 /************************************************************/
-void ID()
+SIM_INLINE void pipeline_cycle(const int fwd, const int probe, const int mmu)
 {
-	if (stall != 0)
+#if HOST_PROFILE
+	prof_sampling = prof_enabled && (CYCLE_COUNT % PROF_PERIOD) == 0;
+	if (prof_sampling)
 	{
-		return;
+		prof_saved = prof;
 	}
-	if (branch == 1)
+#endif
+	PROF_BEGIN(PROF_CYCLE);
+	PROF_BEGIN(PROF_WB);
+	WB_stage(&CURRENT_STATE, probe);
+	PROF_END(PROF_WB);
+	PROF_BEGIN(PROF_MEM);
+	MEM_stage(probe, mmu);
+	PROF_END(PROF_MEM);
+	PROF_BEGIN(PROF_EX);
+	EX_stage(&CURRENT_STATE, fwd, probe);
+	PROF_END(PROF_EX);
+	PROF_BEGIN(PROF_ID);
+	ID_stage(&CURRENT_STATE, fwd, probe);
+	PROF_END(PROF_ID);
+	PROF_BEGIN(PROF_IF);
+	IF_stage(&CURRENT_STATE, probe, mmu);
+	PROF_END(PROF_IF);
+	if (dma_left != 0)
 	{
-		branch = 0;
-		ID_EX.IR = 0;
-		return;
+		dma_step();
 	}
-	/*IMPLEMENT THIS*/
-	ID_EX.PC = IF_ID.PC;
-	//ID_EX.IR = IF_ID.IR;
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t immediate;
+	if (sb_count != 0)
+	{
+		sb_step();
+	}
+	PROF_BEGIN(PROF_COMMIT);
+	state_commit();
+	PROF_END(PROF_COMMIT);
+	CYCLE_COUNT++;
+	PROF_END(PROF_CYCLE);
+#if HOST_PROFILE
+	if (prof_sampling && prof.ticks[PROF_CYCLE] - prof_saved.ticks[PROF_CYCLE] > 1000 * prof_probe_ticks)
+	{
+		prof = prof_saved; //preempted or faulted on the host, not simulator work
+		prof_discarded++;
+	}
+	prof_sampling = 0;
+#endif
+}
 
-	rs = (IF_ID.IR & 0x03E00000) >> 21;
-	rt = (IF_ID.IR & 0x001F0000) >> 16;
-	immediate = IF_ID.IR & 0x0000FFFF; // use bit mask
-	ID_EX_rs = rs;
-	ID_EX_rt = rt;
+/************************************************************/
+/* Step while the program runs (with drain, also while the  */
+/* D-cache miss it ended on is pending), no breakpoint has  */
+/* stopped it and CYCLE_COUNT < until; at most steps steps. */
+/* A step is a cycle, plus a penalty cycle while a miss is  */
+/* pending, or one cycle of a page walk. Everything that   */
+/* advances the simulation goes through here so back/goto   */
+/* replay it exactly.                                       */
+/************************************************************/
+SIM_INLINE uint32_t sim_loop(const int probe, const int mmu, void (*const cycle_fn)(), uint32_t steps, uint32_t until, int drain)
+{
+	uint32_t i;
 
-	// to forward from EX stage
-	if ((EX_MEM_RegWrite && (EX_MEM_RegisterRd != 0)) && (EX_MEM_RegisterRd == ID_EX_rs))
+	for (i = 0; i < steps && CYCLE_COUNT < until && (RUN_FLAG || (drain && MISS_FLAG == 1)) && !brk_stop; i++)
 	{
-		if (ENABLE_FORWARDING == 1)
+		if (CYCLE_COUNT >= snap_next)
 		{
-			forwardA = 0x10;
+			snap_take();
 		}
-		else
+		if (CYCLE_COUNT >= interval_next)
 		{
-			stall = 3;
+			interval_sample();
 		}
-	}
-	if ((EX_MEM_RegWrite && (EX_MEM_RegisterRd != 0)) && (EX_MEM_RegisterRd == ID_EX_rt))
-	{
-		if (ENABLE_FORWARDING == 1)
+		if (mmu && mmu_wait != 0)
 		{
-			forwardB = 0x10;
+			mmu_wait--; //the pipeline is frozen for the walk
+			CYCLE_COUNT++;
+			cpi_cycles[CPI_TLB]++;
+			if (probe && pcprof != NULL)
+			{
+				pcprof_charge(mmu_walk_pc, 0, CPI_TLB);
+			}
+			continue;
 		}
-		else
+		if (sb_wait != 0)
 		{
-			stall = 3;
+			sb_wait--; //a load or store waits for the buffer to drain
+			CYCLE_COUNT++;
+			cpi_cycles[CPI_STORE_BUFFER]++;
+			sb_wait_cycles++;
+			if (probe && pcprof != NULL)
+			{
+				pcprof_charge(sb_wait_pc, 0, CPI_STORE_BUFFER);
+			}
+			continue;
 		}
-	}
-	if ((EX_MEM_RegWrite && (EX_MEM_RegisterRt != 0)) && (EX_MEM_RegisterRt == ID_EX_rs))
-	{
-		if (ENABLE_FORWARDING == 1)
+		if (fill_wait != 0)
 		{
-			forwardA = 0x10;
+			fill_wait--; //a load or store waits for its word of a line fill
+			CYCLE_COUNT++;
+			cpi_cycles[CPI_DCACHE_MISS]++;
+			fill_wait_cycles++;
+			if (probe && pcprof != NULL)
+			{
+				pcprof_charge(fill_wait_pc, 0, CPI_DCACHE_MISS);
+			}
+			continue;
 		}
-		else
+		if (MISS_FLAG == 1)
 		{
-			stall = 3;
+			if (miss_wait < 100)
+			{
+				miss_wait++;
+				CYCLE_COUNT++;
+				cpi_cycles[CPI_DCACHE_MISS]++;
+				if (probe && pcprof != NULL)
+				{
+					pcprof_charge(pcprof_miss_pc, 0, CPI_DCACHE_MISS);
+				}
+			}
+			else
+			{
+				MISS_FLAG = 0;
+			}
 		}
+		cycle_fn();
+	}
+	return i;
+}
+
+/* fwd: ENABLE_FORWARDING; probe: pipeline trace, per-PC profile or lockstep checker on; mmu: mmu_enabled.
+   These three are the only options folded into a variant. L1 geometry is fixed at build time
+   (NUM_CACHE_BLOCKS, L1_WAY_BITS). Everything else is still a single flag or counter tested
+   every cycle, which stays not-taken while the option is off:
+   - store buffer: sb_enabled on a store in MEM, sb_count on a load and after the stages,
+     sb_wait in sim_loop
+   - fusion: fuse_enabled in IF
+   - line fills: fill_mode on a miss, fill_end on a hit, fill_wait in sim_loop
+   - scratchpad: spm_window on each L1 access, dma_left after the stages
+   - snapshots and interval statistics: snap_next and interval_next in sim_loop
+   - breakpoints and watchpoints: brk_armed in WB, watch_count in MEM */
+#define SIM_VARIANTS(X) \
+	X(0, 0, 0) X(0, 0, 1) X(0, 1, 0) X(0, 1, 1) X(1, 0, 0) X(1, 0, 1) X(1, 1, 0) X(1, 1, 1)
+
+#define SIM_DEFINE(fwd, probe, mmu)                                                       \
+	void cycle_##fwd##probe##mmu()                                                        \
+	{                                                                                     \
+		pipeline_cycle(fwd, probe, mmu);                                                  \
+	}                                                                                     \
+	uint32_t sim_loop_##fwd##probe##mmu(uint32_t steps, uint32_t until, int drain)        \
+	{                                                                                     \
+		return sim_loop(probe, mmu, cycle_##fwd##probe##mmu, steps, until, drain);        \
+	}
+SIM_VARIANTS(SIM_DEFINE)
+
+#define SIM_ENTRY(fwd, probe, mmu) {cycle_##fwd##probe##mmu, sim_loop_##fwd##probe##mmu},
+const Sim_Variant sim_variants[] = {SIM_VARIANTS(SIM_ENTRY)};
+
+/************************************************************/
+/* Hardware multithreading                                  */
+/************************************************************/
+/* Point the regions but the text, and their snapshot flags, at thread t's copy */
+void mt_map(uint32_t t)
+{
+	int i;
+
+	if (t == mt_space || t >= MT_MAX)
+	{
+		return;
 	}
-	if ((EX_MEM_RegWrite && (EX_MEM_RegisterRt != 0)) && (EX_MEM_RegisterRt == ID_EX_rt))
+	for (i = 0; i < NUM_MEM_REGION; i++)
 	{
-		if (ENABLE_FORWARDING == 1)
+		if (MEM_REGIONS[i].begin != MEM_TEXT_BEGIN)
 		{
-			forwardB = 0x10;
+			mt_mem[mt_space][i] = MEM_REGIONS[i].mem;
+			mt_saved[mt_space][i] = snap_saved[i];
+			MEM_REGIONS[i].mem = mt_mem[t][i];
+			snap_saved[i] = mt_saved[t][i];
 		}
-		else
+	}
+	mt_space = t;
+}
+
+/* Thread t's registers. Thread 0 keeps CURRENT_STATE, which the commands and the
+   debugger show; an idle slot (MT_IDLE) only carries bubbles, so any context does. */
+static inline CPU_State *mt_state(uint32_t t)
+{
+	return t == 0 || t >= mt_threads ? &CURRENT_STATE : &mt_ctx[t];
+}
+
+/* Next thread to fetch from, or MT_IDLE */
+uint32_t mt_pick()
+{
+	uint32_t i, t;
+
+	for (i = 0; i < mt_threads; i++)
+	{
+		t = (mt_current + i + (mt_policy == MT_ROUND_ROBIN)) % mt_threads;
+		if (!mt_done[t] && CYCLE_COUNT >= mt_ready_at[t])
 		{
-			stall = 3;
+			mt_switches += t != mt_current;
+			mt_current = t;
+			return t;
 		}
 	}
+	return MT_IDLE;
+}
+
+/* Drop thread t's instructions from IF_ID, ID_EX and EX_MEM (and MEM_WB if all),
+   so it fetches again from the oldest one */
+void mt_squash(uint32_t t, int all)
+{
+	int squashed = 0;
+	uint32_t resume = 0;
+
+	if (IF_ID.IR != 0 && IF_ID_tid == t)
+	{
+		resume = IF_ID.PC - 4;
+		squashed = 1;
+		IF_ID.IR = 0;
+		IF_ID_fuse.first = 0;
+		IF_ID_tid = MT_IDLE; //ID turns it into a miss bubble
+		IF_stall = 0;
+	}
+	if (ID_EX.IR != 0 && ID_EX_tid == t)
+	{
+		resume = ID_EX.PC - 4;
+		squashed = 1;
+		ID_EX.IR = 0;
+		ID_EX_fuse.first = 0;
+		ID_EX_cause = CPI_DCACHE_MISS;
+	}
+	if (EX_MEM.IR != 0 && EX_MEM_tid == t)
+	{
+		resume = EX_MEM.PC - 4;
+		squashed = 1;
+		EX_MEM.IR = 0;
+		EX_MEM_fuse.first = 0;
+		EX_MEM_cause = CPI_DCACHE_MISS;
+	}
+	if (all && MEM_WB.IR != 0 && MEM_WB_tid == t)
+	{
+		resume = MEM_WB.PC - 4;
+		squashed = 1;
+		MEM_WB.IR = 0;
+		MEM_WB_fuse.first = 0;
+		MEM_WB_cause = CPI_DCACHE_MISS;
+	}
+	if (squashed)
+	{
+		mt_state(t)->PC = resume;
+	}
+}
+
+/* One pipeline cycle with the stages interleaving threads */
+void mt_cycle()
+{
+	const int fwd = ENABLE_FORWARDING != 0, mmu = mmu_enabled != 0;
+	uint32_t wb = MEM_WB_tid, retired = INSTRUCTION_COUNT, t;
+	int halted;
+
+	mt_map(wb);
+	WB_stage(mt_state(wb), 1);
+	if (wb < mt_threads)
+	{
+		mt_retired[wb] += INSTRUCTION_COUNT - retired;
+	}
+	//a thread's exit SYSCALL ends only that thread; any other stop ends the run
+	halted = RUN_FLAG == FALSE && wb < mt_threads && (MEM_WB.IR & 0xFC00003F) == 0x0000000C;
+	if (halted)
+	{
+		RUN_FLAG = TRUE;
+	}
+
+	mt_map(EX_MEM_tid);
+	MEM_stage(1, mmu);
+	MEM_WB_tid = EX_MEM_tid;
+
+	mt_map(ID_EX_tid);
+	EX_stage(mt_state(ID_EX_tid), fwd, 1);
+	EX_MEM_tid = ID_EX_tid;
+	if (redirect_valid)
+	{
+		mt_state(EX_MEM_tid)->PC = redirect_pc; //where the branch's thread fetches next
+		redirect_valid = 0;
+	}
+
+	mt_map(IF_ID_tid);
+	ID_stage(mt_state(IF_ID_tid), fwd, 1);
+	ID_EX_tid = IF_ID_tid; //the instruction, or the bubble ID left in its place
+	if (IF_ID_tid == MT_IDLE)
+	{
+		ID_EX_cause = CPI_DCACHE_MISS; //nothing was ready to fetch, or a miss squashed it
+	}
 
-	// to forward form MEM stage
-	if ((MEM_WB_RegWrite && (MEM_WB_RegisterRt != 0)) && (MEM_WB_RegisterRt == ID_EX_rs))
+	if (IF_stall == 0)
 	{
-		if (ENABLE_FORWARDING == 1)
+		t = mt_pick();
+		if (t == MT_IDLE)
 		{
-			forwardA = 0x01;
+			IF_ID.IR = 0;
+			IF_ID_fuse.first = 0;
+			mt_idle++;
 		}
 		else
 		{
-			stall = 2;
+			mt_map(t);
+			IF_stage(mt_state(t), 1, mmu);
 		}
+		IF_ID_tid = t;
 	}
-	if ((MEM_WB_RegWrite && (MEM_WB_RegisterRt != 0)) && (MEM_WB_RegisterRt == ID_EX_rt))
+	IF_stall = 0;
+	mt_map(0);
+
+	if (dma_left != 0)
 	{
-		if (ENABLE_FORWARDING == 1)
-		{
-			forwardB = 0x01;
-		}
-		else
+		dma_step();
+	}
+	if (sb_count != 0)
+	{
+		sb_step();
+	}
+	state_commit();
+	CYCLE_COUNT++;
+
+	if (MISS_FLAG == 1 || fill_wait != 0)
+	{
+		MISS_FLAG = 0; //only the thread that missed waits
+		if (MEM_WB_tid < mt_threads)
 		{
-			stall = 2;
+			mt_misses[MEM_WB_tid]++;
+			mt_ready_at[MEM_WB_tid] = CYCLE_COUNT + (fill_wait != 0 ? fill_wait : MT_MISS_CYCLES);
+			mt_squash(MEM_WB_tid, 0);
 		}
+		fill_wait = 0;
 	}
-	if ((MEM_WB_RegWrite && (MEM_WB_RegisterRd != 0)) && (MEM_WB_RegisterRd == ID_EX_rs))
+	if (halted)
 	{
-		if (ENABLE_FORWARDING == 1)
+		mt_done[wb] = 1;
+		mt_squash(wb, 1);
+		for (t = 0; t < mt_threads && mt_done[t]; t++)
 		{
-			forwardA = 0x01;
 		}
-		else
+		if (t == mt_threads)
 		{
-			stall = 2;
+			RUN_FLAG = FALSE; //that was the last one
 		}
 	}
-	if ((MEM_WB_RegWrite && (MEM_WB_RegisterRd != 0)) && (MEM_WB_RegisterRd == ID_EX_rt))
+}
+
+uint32_t mt_loop(uint32_t steps, uint32_t until, int drain)
+{
+	return sim_loop(1, mmu_enabled != 0, mt_cycle, steps, until, drain);
+}
+
+const Sim_Variant mt_variant = {mt_cycle, mt_loop};
+
+/* n contexts: thread 0 continues from CURRENT_STATE, the others start at the entry point
+   with their own copy of thread 0's memory */
+void mt_init(uint32_t n, int policy)
+{
+	uint32_t t, size;
+	int i;
+
+	pipeline_flush();
+	memset(mt_ctx, 0, sizeof(mt_ctx)); //thread 0 keeps CURRENT_STATE
+	for (t = 1; t < n; t++)
 	{
-		if (ENABLE_FORWARDING == 1)
-		{
-			forwardB = 0x01;
-		}
-		else
+		mt_ctx[t].PC = MEM_TEXT_BEGIN;
+		for (i = 0; i < NUM_MEM_REGION; i++)
 		{
-			stall = 2;
+			if (MEM_REGIONS[i].begin != MEM_TEXT_BEGIN)
+			{
+				size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+				if (mt_mem[t][i] == NULL)
+				{
+					mt_mem[t][i] = malloc(size);
+					assert(mt_mem[t][i] != NULL);
+				}
+				memcpy(mt_mem[t][i], MEM_REGIONS[i].mem, size); //thread 0's memory as it is now
+			}
 		}
 	}
+	memset(mt_ready_at, 0, sizeof(mt_ready_at));
+	memset(mt_done, 0, sizeof(mt_done));
+	memset(mt_retired, 0, sizeof(mt_retired));
+	memset(mt_misses, 0, sizeof(mt_misses));
+	mt_current = policy == MT_ROUND_ROBIN ? n - 1 : 0; //so thread 0 fetches first
+	mt_switches = 0;
+	mt_idle = 0;
+	mt_start_cycle = CYCLE_COUNT;
+	IF_ID_tid = 0;
+	ID_EX_tid = 0;
+	EX_MEM_tid = 0;
+	MEM_WB_tid = 0;
+	mt_threads = n;
+	mt_policy = policy;
+	snap_restart(); //the other threads' memory has nothing to keep either
+	if (check_enabled)
+	{
+		check_enabled = 0;
+		printf("Lockstep check off: the reference model runs one thread.\n");
+	}
+}
 
-	ID_EX.A = CURRENT_STATE.REGS[ID_EX_rs];
-	ID_EX.B = CURRENT_STATE.REGS[ID_EX_rt];
-	ID_EX.imm = immediate;
+/* Back to one thread, thread 0, with nothing in flight */
+void mt_stop()
+{
+	uint32_t t;
+
+	for (t = 0; t < mt_threads; t++)
+	{
+		mt_squash(t, 1);
+	}
+	RUN_FLAG = !mt_done[0];
+	mt_threads = 0;
+	IF_ID_tid = 0;
+	ID_EX_tid = 0;
+	EX_MEM_tid = 0;
+	MEM_WB_tid = 0;
+	pipeline_flush();
+}
+
+void mt_show()
+{
+	uint32_t cycles = CYCLE_COUNT - mt_start_cycle, total = 0, t;
+
+	if (mt_threads == 0)
+	{
+		printf("Multithreading off\n\n");
+		return;
+	}
+	printf("%u threads, %s, %u cycles since they started\n", mt_threads,
+		   mt_policy == MT_ROUND_ROBIN ? "round-robin per cycle" : "switch on miss", cycles);
+	printf("[Thread]\t[PC]\t\t[Retired]\t[IPC]\t[Misses]\t[$v1]\t\t[State]\n");
+	for (t = 0; t < mt_threads; t++)
+	{
+		printf("%u\t\t0x%08x\t%u\t\t%.3f\t%u\t\t0x%08x\t%s\n", t, mt_state(t)->PC, mt_retired[t],
+			   cycles ? (double)mt_retired[t] / cycles : 0.0, mt_misses[t], mt_state(t)->REGS[3],
+			   mt_done[t] ? "done" : CYCLE_COUNT < mt_ready_at[t] ? "miss" : "ready");
+		total += mt_retired[t];
+	}
+	printf("Throughput %.3f IPC; no thread ready to fetch in %u cycles (%.1f%%); %u thread switches\n\n",
+		   cycles ? (double)total / cycles : 0.0, mt_idle, cycles ? 100.0 * mt_idle / cycles : 0.0, mt_switches);
+}
+
+/* threads <n> rr|miss, threads off|show */
+void mt_command(const char *arg)
+{
+	char policy[8];
+	uint32_t n;
 
-	int temp_OP = ((EX_MEM.IR & 0xFC000000) >> 26);
-	if (temp_OP == 0x23 || temp_OP == 0x21 || temp_OP == 0x20)
+	if (strcmp(arg, "show") == 0)
 	{
-		// load case is special
-		if (stall == 0)
+		mt_show();
+		return;
+	}
+	if (strcmp(arg, "off") == 0)
+	{
+		if (mt_threads != 0)
 		{
-			stall = 2;
+			mt_stop();
 		}
+		mt_show();
+		return;
 	}
-	if (stall == 0)
+	n = strtoul(arg, NULL, 0);
+	if (n == 0 || n > MT_MAX || scanf("%7s", policy) != 1 || (strcmp(policy, "rr") != 0 && strcmp(policy, "miss") != 0))
 	{
-		ID_EX.IR = IF_ID.IR;
+		printf("Usage: threads <1..%d> rr|miss, threads off|show\n\n", MT_MAX);
+		return;
 	}
-	else
+	if (mt_threads != 0)
 	{
-		ID_EX.IR = 0;
+		mt_stop();
 	}
+	mt_init(n, policy[0] == 'r' ? MT_ROUND_ROBIN : MT_SWITCH_ON_MISS);
+	mt_show();
 }
 
-/************************************************************/
-/* instruction fetch (IF) pipeline stage:                                                              */
-/************************************************************/
-void IF()
+/* The options can only change between runs, so callers select once per run */
+const Sim_Variant *sim_select()
 {
-	if (stall == 0)
+	int probe = pcprof != NULL || check_enabled || trace_fp != NULL || interval_len != 0;
+	if (mt_threads != 0)
 	{
-		IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
-		NEXT_STATE.PC = CURRENT_STATE.PC + 4; //correct
-		IF_ID.PC = NEXT_STATE.PC;
-		/*IMPLEMENT THIS*/
+		return &mt_variant;
 	}
+	return &sim_variants[4 * (ENABLE_FORWARDING != 0) + 2 * probe + (mmu_enabled != 0)];
 }
 
 /************************************************************/
@@ -1384,7 +7458,6 @@ void initialize()
 {
 	init_memory();
 	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
 	RUN_FLAG = TRUE;
 }
 
@@ -1454,11 +7527,10 @@ void show_pipeline()
 	printf("%x", MEM_WB.LMD);
 }
 
-void print_instruction(uint32_t addr)
+/* Format one instruction word in MIPS assembly syntax into buf */
+void disassemble(uint32_t instruction, uint32_t addr, char *buf, size_t len)
 {
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-
-	instruction = mem_read_32(addr);
+	uint32_t opcode, function, rs, rt, rd, sa, immediate, target;
 
 	opcode = (instruction & 0xFC000000) >> 26;
 	function = instruction & 0x0000003F;
@@ -1476,83 +7548,83 @@ void print_instruction(uint32_t addr)
 		switch (function)
 		{
 		case 0x00:
-			printf("SLL $r%u, $r%u, 0x%x\n", rd, rt, sa);
+			snprintf(buf, len, "SLL $r%u, $r%u, 0x%x", rd, rt, sa);
 			break;
 		case 0x02:
-			printf("SRL $r%u, $r%u, 0x%x\n", rd, rt, sa);
+			snprintf(buf, len, "SRL $r%u, $r%u, 0x%x", rd, rt, sa);
 			break;
 		case 0x03:
-			printf("SRA $r%u, $r%u, 0x%x\n", rd, rt, sa);
+			snprintf(buf, len, "SRA $r%u, $r%u, 0x%x", rd, rt, sa);
 			break;
 		case 0x08:
-			printf("JR $r%u\n", rs);
+			snprintf(buf, len, "JR $r%u", rs);
 			break;
 		case 0x09:
 			if (rd == 31)
 			{
-				printf("JALR $r%u\n", rs);
+				snprintf(buf, len, "JALR $r%u", rs);
 			}
 			else
 			{
-				printf("JALR $r%u, $r%u\n", rd, rs);
+				snprintf(buf, len, "JALR $r%u, $r%u", rd, rs);
 			}
 			break;
 		case 0x0C:
-			printf("SYSCALL\n");
+			snprintf(buf, len, "SYSCALL");
 			break;
 		case 0x10:
-			printf("MFHI $r%u\n", rd);
+			snprintf(buf, len, "MFHI $r%u", rd);
 			break;
 		case 0x11:
-			printf("MTHI $r%u\n", rs);
+			snprintf(buf, len, "MTHI $r%u", rs);
 			break;
 		case 0x12:
-			printf("MFLO $r%u\n", rd);
+			snprintf(buf, len, "MFLO $r%u", rd);
 			break;
 		case 0x13:
-			printf("MTLO $r%u\n", rs);
+			snprintf(buf, len, "MTLO $r%u", rs);
 			break;
 		case 0x18:
-			printf("MULT $r%u, $r%u\n", rs, rt);
+			snprintf(buf, len, "MULT $r%u, $r%u", rs, rt);
 			break;
 		case 0x19:
-			printf("MULTU $r%u, $r%u\n", rs, rt);
+			snprintf(buf, len, "MULTU $r%u, $r%u", rs, rt);
 			break;
 		case 0x1A:
-			printf("DIV $r%u, $r%u\n", rs, rt);
+			snprintf(buf, len, "DIV $r%u, $r%u", rs, rt);
 			break;
 		case 0x1B:
-			printf("DIVU $r%u, $r%u\n", rs, rt);
+			snprintf(buf, len, "DIVU $r%u, $r%u", rs, rt);
 			break;
 		case 0x20:
-			printf("ADD $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "ADD $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x21:
-			printf("ADDU $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "ADDU $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x22:
-			printf("SUB $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "SUB $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x23:
-			printf("SUBU $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "SUBU $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x24:
-			printf("AND $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "AND $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x25:
-			printf("OR $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "OR $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x26:
-			printf("XOR $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "XOR $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x27:
-			printf("NOR $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "NOR $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		case 0x2A:
-			printf("SLT $r%u, $r%u, $r%u\n", rd, rs, rt);
+			snprintf(buf, len, "SLT $r%u, $r%u, $r%u", rd, rs, rt);
 			break;
 		default:
-			printf("Instruction is not implemented!\n");
+			snprintf(buf, len, "Instruction is not implemented!");
 			break;
 		}
 	}
@@ -1563,75 +7635,309 @@ void print_instruction(uint32_t addr)
 		case 0x01:
 			if (rt == 0)
 			{
-				printf("BLTZ $r%u, 0x%x\n", rs, immediate << 2);
+				snprintf(buf, len, "BLTZ $r%u, 0x%x", rs, immediate << 2);
 			}
 			else if (rt == 1)
 			{
-				printf("BGEZ $r%u, 0x%x\n", rs, immediate << 2);
+				snprintf(buf, len, "BGEZ $r%u, 0x%x", rs, immediate << 2);
 			}
 			break;
 		case 0x02:
-			printf("J 0x%x\n", (addr & 0xF0000000) | (target << 2));
+			snprintf(buf, len, "J 0x%x", (addr & 0xF0000000) | (target << 2));
 			break;
 		case 0x03:
-			printf("JAL 0x%x\n", (addr & 0xF0000000) | (target << 2));
+			snprintf(buf, len, "JAL 0x%x", (addr & 0xF0000000) | (target << 2));
 			break;
 		case 0x04:
-			printf("BEQ $r%u, $r%u, 0x%x\n", rs, rt, immediate << 2);
+			snprintf(buf, len, "BEQ $r%u, $r%u, 0x%x", rs, rt, immediate << 2);
 			break;
 		case 0x05:
-			printf("BNE $r%u, $r%u, 0x%x\n", rs, rt, immediate << 2);
+			snprintf(buf, len, "BNE $r%u, $r%u, 0x%x", rs, rt, immediate << 2);
 			break;
 		case 0x06:
-			printf("BLEZ $r%u, 0x%x\n", rs, immediate << 2);
+			snprintf(buf, len, "BLEZ $r%u, 0x%x", rs, immediate << 2);
 			break;
 		case 0x07:
-			printf("BGTZ $r%u, 0x%x\n", rs, immediate << 2);
+			snprintf(buf, len, "BGTZ $r%u, 0x%x", rs, immediate << 2);
 			break;
 		case 0x08:
-			printf("ADDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "ADDI $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x09:
-			printf("ADDIU $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "ADDIU $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x0A:
-			printf("SLTI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "SLTI $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x0C:
-			printf("ANDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "ANDI $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x0D:
-			printf("ORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "ORI $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x0E:
-			printf("XORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
+			snprintf(buf, len, "XORI $r%u, $r%u, 0x%x", rt, rs, immediate);
 			break;
 		case 0x0F:
-			printf("LUI $r%u, 0x%x\n", rt, immediate);
+			snprintf(buf, len, "LUI $r%u, 0x%x", rt, immediate);
 			break;
 		case 0x20:
-			printf("LB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "LB $r%u, 0x%x($r%u)", rt, immediate, rs);
 			break;
 		case 0x21:
-			printf("LH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "LH $r%u, 0x%x($r%u)", rt, immediate, rs);
 			break;
 		case 0x23:
-			printf("LW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "LW $r%u, 0x%x($r%u)", rt, immediate, rs);
 			break;
 		case 0x28:
-			printf("SB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "SB $r%u, 0x%x($r%u)", rt, immediate, rs);
 			break;
 		case 0x29:
-			printf("SH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "SH $r%u, 0x%x($r%u)", rt, immediate, rs);
 			break;
 		case 0x2B:
-			printf("SW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
+			snprintf(buf, len, "SW $r%u, 0x%x($r%u)", rt, immediate, rs);
+			break;
+		default:
+			snprintf(buf, len, "Instruction is not implemented!");
+			break;
+		}
+	}
+}
+
+/* Print the instruction stored at addr */
+void print_instruction(uint32_t addr)
+{
+	char buf[64];
+
+	disassemble(mem_read_32(addr), addr, buf, sizeof(buf));
+	printf("%s\n", buf);
+}
+
+/***************************************************************/
+/* Pipeline trace export                                       */
+/***************************************************************/
+#define TRACE_RING 256 //more than the instructions ever in flight at once
+
+const char *trace_stage_names[] = {"IF", "ID", "EX", "MEM", "WB"};
+
+typedef struct Trace_Slot_Struct {
+	uint32_t seq;
+	uint32_t id; //Konata needs dense ids; seq has gaps where NOPs were fetched
+	int stage; //TRACE_IF..TRACE_WB, -1 once finished
+	uint32_t start;
+	uint32_t pc;
+	uint32_t ir;
+} Trace_Slot;
+
+FILE *trace_open_read(const char *path)
+{
+	uint32_t header[2];
+	FILE *fp = fopen(path, "rb");
+
+	if (fp == NULL)
+	{
+		printf("Error: Can't open trace file %s\n", path);
+		return NULL;
+	}
+	if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != TRACE_MAGIC || header[1] != sizeof(Trace_Record))
+	{
+		printf("Error: %s is not a pipeline trace\n", path);
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/* Konata (Kanata 0004) pipeline viewer log */
+void trace_export_konata(const char *in_path, const char *out_path)
+{
+	Trace_Slot ring[TRACE_RING];
+	Trace_Record r;
+	FILE *in, *out;
+	char text[64];
+	uint32_t cycle = 0, retired = 0, records = 0, pending = 0, ids = 0;
+	int have_cycle = 0, have_pending = 0;
+
+	if ((in = trace_open_read(in_path)) == NULL)
+	{
+		return;
+	}
+	if ((out = fopen(out_path, "w")) == NULL)
+	{
+		printf("Error: Can't open %s\n", out_path);
+		fclose(in);
+		return;
+	}
+	memset(ring, 0, sizeof(ring));
+	fprintf(out, "Kanata\t0004\n");
+
+	while (fread(&r, sizeof(r), 1, in) == 1)
+	{
+		Trace_Slot *slot = &ring[r.seq % TRACE_RING];
+
+		records++;
+		if (!have_cycle)
+		{
+			fprintf(out, "C=\t%u\n", r.cycle);
+			cycle = r.cycle;
+			have_cycle = 1;
+		}
+		else if (r.cycle != cycle)
+		{
+			fprintf(out, "C\t%u\n", r.cycle - cycle);
+			cycle = r.cycle;
+			if (have_pending)
+			{
+				//WB lasts one cycle, then the instruction retires
+				fprintf(out, "E\t%u\t0\tWB\nR\t%u\t%u\t0\n", pending, pending, retired++);
+				have_pending = 0;
+			}
+		}
+		if (slot->seq != r.seq)
+		{
+			//first record of this instruction (IF, or the trace started while it was in flight)
+			slot->seq = r.seq;
+			slot->id = ids++;
+			slot->stage = -1;
+			disassemble(r.ir, r.pc, text, sizeof(text));
+			fprintf(out, "I\t%u\t%u\t0\nL\t%u\t0\t%08x: %s\n", slot->id, r.seq, slot->id, r.pc, text);
+		}
+		switch (r.kind)
+		{
+		case TRACE_STALL:
+			fprintf(out, "L\t%u\t1\tstall (%s) at cycle %u\n", slot->id, cpi_names[r.cause], r.cycle);
+			break;
+		case TRACE_FLUSH:
+			if (slot->stage >= 0)
+			{
+				fprintf(out, "E\t%u\t0\t%s\n", slot->id, trace_stage_names[slot->stage]);
+			}
+			fprintf(out, "R\t%u\t%u\t1\n", slot->id, slot->id);
+			slot->stage = -1;
+			break;
+		default:
+			if (slot->stage >= 0)
+			{
+				fprintf(out, "E\t%u\t0\t%s\n", slot->id, trace_stage_names[slot->stage]);
+			}
+			fprintf(out, "S\t%u\t0\t%s\n", slot->id, trace_stage_names[r.kind]);
+			slot->stage = r.kind;
+			if (r.kind == TRACE_WB)
+			{
+				pending = slot->id;
+				have_pending = 1;
+			}
+			break;
+		}
+	}
+	if (have_pending)
+	{
+		fprintf(out, "C\t1\nE\t%u\t0\tWB\nR\t%u\t%u\t0\n", pending, pending, retired++);
+	}
+	fclose(in);
+	fclose(out);
+	printf("Wrote %u trace records (%u retired instructions) to %s\n", records, retired, out_path);
+}
+
+void trace_chrome_slice(FILE *out, const Trace_Slot *slot, uint32_t end, int *first)
+{
+	char text[64];
+
+	disassemble(slot->ir, slot->pc, text, sizeof(text));
+	fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":1,\"tid\":%d,"
+				 "\"args\":{\"pc\":\"0x%08x\",\"seq\":%u}}",
+			*first ? "" : ",", text, trace_stage_names[slot->stage], slot->start,
+			end > slot->start ? end - slot->start : 1, slot->stage, slot->pc, slot->seq);
+	*first = 0;
+}
+
+/* Chrome trace event JSON: one lane per stage, one slice per instruction per stage, cycles as microseconds */
+void trace_export_chrome(const char *in_path, const char *out_path)
+{
+	Trace_Slot ring[TRACE_RING];
+	Trace_Record r;
+	FILE *in, *out;
+	uint32_t records = 0, last = 0;
+	int i, first = 1;
+
+	if ((in = trace_open_read(in_path)) == NULL)
+	{
+		return;
+	}
+	if ((out = fopen(out_path, "w")) == NULL)
+	{
+		printf("Error: Can't open %s\n", out_path);
+		fclose(in);
+		return;
+	}
+	memset(ring, 0, sizeof(ring));
+	for (i = 0; i < TRACE_RING; i++)
+	{
+		ring[i].stage = -1;
+	}
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = TRACE_IF; i <= TRACE_WB; i++)
+	{
+		fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", i, trace_stage_names[i]);
+		first = 0;
+	}
+
+	while (fread(&r, sizeof(r), 1, in) == 1)
+	{
+		Trace_Slot *slot = &ring[r.seq % TRACE_RING];
+
+		records++;
+		last = r.cycle;
+		if (slot->seq != r.seq)
+		{
+			slot->seq = r.seq;
+			slot->stage = -1;
+			slot->pc = r.pc;
+			slot->ir = r.ir;
+		}
+		switch (r.kind)
+		{
+		case TRACE_STALL:
+		case TRACE_FLUSH:
+			fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%u,\"pid\":1,\"tid\":%d,"
+						 "\"args\":{\"pc\":\"0x%08x\",\"seq\":%u}}",
+					r.kind == TRACE_STALL ? cpi_names[r.cause] : "flush", r.kind == TRACE_STALL ? "stall" : "flush",
+					r.cycle, r.kind == TRACE_STALL ? TRACE_ID : (slot->stage >= 0 ? slot->stage : TRACE_IF), r.pc, r.seq);
+			if (r.kind == TRACE_FLUSH && slot->stage >= 0)
+			{
+				trace_chrome_slice(out, slot, r.cycle + 1, &first);
+				slot->stage = -1;
+			}
 			break;
 		default:
-			printf("Instruction is not implemented!\n");
+			if (slot->stage >= 0)
+			{
+				trace_chrome_slice(out, slot, r.cycle, &first);
+			}
+			slot->stage = r.kind;
+			slot->start = r.cycle;
+			if (r.kind == TRACE_WB)
+			{
+				trace_chrome_slice(out, slot, r.cycle + 1, &first);
+				slot->stage = -1;
+			}
 			break;
 		}
 	}
+	for (i = 0; i < TRACE_RING; i++)
+	{
+		if (ring[i].stage >= 0)
+		{
+			trace_chrome_slice(out, &ring[i], last + 1, &first);
+		}
+	}
+	fprintf(out, "\n]}\n");
+	fclose(in);
+	fclose(out);
+	printf("Wrote %u trace records to %s\n", records, out_path);
 }
 
 /***************************************************************/
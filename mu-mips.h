@@ -5,18 +5,24 @@
 #define WORD_PER_BLOCK 4
 
 
-typedef struct CacheBlock_Struct {
+#define CACHE_MAX_WAY_BITS 4 //up to NUM_CACHE_BLOCKS ways: fully associative
+#ifndef L1_WAY_BITS
+#define L1_WAY_BITS 0         //log2 of the associativity; build with -DL1_WAY_BITS=2 for 4 ways
+#endif
+#define CACHE_TAG_PAD 4       //tag[] and valid[] run this far past the last block, so a 4-way compare may load there
 
-  int valid; //indicates if the given block contains a valid data. Initially, this is 0
-  uint32_t tag; //this field should contain the tag, i.e. the high-order 32 - (2+2+4)  = 24 bits
-  uint32_t words[WORD_PER_BLOCK]; //this is where actual data is stored. Each word is 4-byte long, and each cache block contains 4 blocks.
-  
-  
-} CacheBlock;
 
+/* The 16 blocks form 16 >> L1_WAY_BITS sets of 1 << L1_WAY_BITS ways; L1_WAY_BITS
+   is 0, a direct-mapped cache, unless the build sets it. A set's tags and valid bits
+   sit side by side in tag[] and valid[], so a lookup compares all of its ways
+   without touching the data words. */
 typedef struct Cache_Struct {
 
-  CacheBlock blocks[NUM_CACHE_BLOCKS]; // there are 16 blocks in the cache
+  uint32_t tag[NUM_CACHE_BLOCKS + CACHE_TAG_PAD]; //the high-order bits above the set index and the 4-bit block offset; 24 bits when direct-mapped
+  uint32_t valid[NUM_CACHE_BLOCKS + CACHE_TAG_PAD]; //1 if the block contains valid data. Initially, this is 0
+  uint32_t used[NUM_CACHE_BLOCKS]; //LRU stamp
+  uint32_t clock;
+  uint32_t words[NUM_CACHE_BLOCKS][WORD_PER_BLOCK]; //this is where actual data is stored. Each word is 4-byte long, and each cache block contains 4 words.
   
 } Cache;
 